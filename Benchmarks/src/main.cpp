@@ -0,0 +1,724 @@
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // This is how long, at least, each benchmark runs, in seconds.  The
+    // number of iterations is doubled until a run takes at least this long.
+    const double MIN_RUN_SECONDS = 0.25;
+
+    // This is the script loaded and called by several of the benchmarks.
+    const char* const ADD_AND_ROUND_SCRIPT = R"lua(
+        local a, b = ...
+        return math.floor(a + b + 0.5)
+    )lua";
+
+    // This counts the memory allocated by Lua instances which use
+    // `CountingAllocator`.
+    struct AllocationCounters {
+        size_t allocations = 0;
+        size_t bytes = 0;
+    };
+
+    // This is an allocator which works the same as the one in Example2, except
+    // that it also counts how many blocks are allocated, and how many bytes
+    // in total Lua asks for when allocating or growing blocks.
+    void* CountingAllocator(void* ud, void* ptr, size_t osize, size_t nsize) {
+        const auto counters = (AllocationCounters*)ud;
+        if (nsize == 0) {
+            free(ptr);
+            return NULL;
+        }
+        if (ptr == NULL) {
+            ++counters->allocations;
+            counters->bytes += nsize;
+        } else if (nsize > osize) {
+            ++counters->allocations;
+            counters->bytes += nsize - osize;
+        }
+        return realloc(ptr, nsize);
+    }
+
+    lua_State* NewState(AllocationCounters& counters) {
+        const auto lua = lua_newstate(CountingAllocator, &counters);
+        lua_gc(lua, LUA_GCSTOP, 0);
+        luaL_openlibs(lua);
+        lua_gc(lua, LUA_GCRESTART, 0);
+        return lua;
+    }
+
+    struct LuaReaderState {
+        const std::string* chunk = nullptr;
+        bool read = false;
+    };
+
+    const char* LuaReader(lua_State* lua, void* data, size_t* size) {
+        LuaReaderState* state = (LuaReaderState*)data;
+        if (state->read) {
+            return NULL;
+        } else {
+            state->read = true;
+            *size = state->chunk->length();
+            return state->chunk->c_str();
+        }
+    }
+
+    int LuaTraceback(lua_State* lua) {
+        const char* message = lua_tostring(lua, 1);
+        if (message == NULL) {
+            if (!lua_isnoneornil(lua, 1)) {
+                if (!luaL_callmeta(lua, 1, "__tostring")) {
+                    lua_pushliteral(lua, "(no error message)");
+                }
+            }
+        } else {
+            luaL_traceback(lua, lua, message, 1);
+        }
+        return 1;
+    }
+
+    // This is the key of the Lua registry entry holding the cache of userdata
+    // made for shared objects, as in Example3.
+    const char SHARED_OBJECT_CACHE_KEY = 0;
+
+    // These are the same kinds of userdata as in Example3.  Unlike there,
+    // the finalizers don't print anything, since they run many times.
+    struct SimpleStruct {
+        int x = 0;
+        int y = 0;
+    };
+
+    struct TestObject {
+        int v;
+        std::string s;
+    };
+
+    // This is the string field of Example3 whose Lua string is cached in the
+    // user value of each userdata giving Lua access to it, and refreshed only
+    // when the field changes version.
+    class CachedString {
+    public:
+        CachedString()
+            : version_(NewVersion())
+        {
+        }
+
+        CachedString(const CachedString& other)
+            : value_(other.value_)
+            , version_(NewVersion())
+        {
+        }
+
+        CachedString(CachedString&& other)
+            : value_(std::move(other.value_))
+            , version_(NewVersion())
+        {
+            other.version_ = NewVersion();
+        }
+
+        CachedString& operator=(const CachedString& other) {
+            value_ = other.value_;
+            version_ = NewVersion();
+            return *this;
+        }
+
+        CachedString& operator=(CachedString&& other) {
+            value_ = std::move(other.value_);
+            version_ = NewVersion();
+            other.version_ = NewVersion();
+            return *this;
+        }
+
+        CachedString& operator=(std::string value) {
+            value_ = std::move(value);
+            version_ = NewVersion();
+            return *this;
+        }
+
+        const std::string& Get() const {
+            return value_;
+        }
+
+        lua_Integer Version() const {
+            return version_;
+        }
+
+    private:
+        static lua_Integer NewVersion() {
+            static std::atomic< lua_Integer > nextVersion(1);
+            return nextVersion.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        std::string value_;
+        lua_Integer version_;
+    };
+
+    struct CachedTestObject {
+        int v;
+        CachedString s;
+    };
+
+    // Look up the key at index 2 of the Lua stack in the table of field
+    // names given as the first upvalue, returning the position of the
+    // field, or -1 if there is no such field.
+    lua_Integer LookUpField(lua_State* lua) {
+        lua_pushvalue(lua, 2);
+        const auto position = (
+            (lua_rawget(lua, lua_upvalueindex(1)) == LUA_TNUMBER)
+            ? lua_tointeger(lua, -1)
+            : -1
+        );
+        lua_pop(lua, 1);
+        return position;
+    }
+
+    // Set the `__index` metamethod of the metatable at the top of the Lua
+    // stack, giving it a table which maps the given field names to their
+    // positions.
+    void SetIndex(lua_State* lua, const char* const* names, lua_CFunction index) {
+        lua_newtable(lua);
+        for (lua_Integer i = 0; names[i] != NULL; ++i) {
+            lua_pushinteger(lua, i);
+            lua_setfield(lua, -2, names[i]);
+        }
+        lua_pushcclosure(lua, index, 1);
+        lua_setfield(lua, -2, "__index");
+    }
+
+    void PushTestObjectField(lua_State* lua, const TestObject& object) {
+        switch (LookUpField(lua)) {
+            case 0: lua_pushinteger(lua, object.v); break;
+            case 1: lua_pushlstring(lua, object.s.c_str(), object.s.length()); break;
+            default: lua_pushnil(lua); break;
+        }
+    }
+
+    // Push the cached string field at the given position of the userdata at
+    // index 1 of the Lua stack, the same way as `PushField` does for
+    // a `CachedString` in Example3: entry `2p + 1` of the user value table
+    // holds the Lua string, and entry `2p + 2` the version it was made from.
+    void PushCachedStringField(lua_State* lua, const CachedString& value, lua_Integer position) {
+        if (lua_getuservalue(lua, 1) != LUA_TTABLE) {
+            lua_pop(lua, 1);
+            lua_createtable(lua, 2, 0);
+            lua_pushvalue(lua, -1);
+            lua_setuservalue(lua, 1);
+        }
+        const auto cache = lua_gettop(lua);
+        if (
+            (lua_rawgeti(lua, cache, 2 * position + 2) == LUA_TNUMBER)
+            && (lua_tointeger(lua, -1) == value.Version())
+        ) {
+            lua_pop(lua, 1);
+            (void)lua_rawgeti(lua, cache, 2 * position + 1);
+        } else {
+            lua_pop(lua, 1);
+            lua_pushlstring(lua, value.Get().c_str(), value.Get().length());
+            lua_pushvalue(lua, -1);
+            lua_rawseti(lua, cache, 2 * position + 1);
+            lua_pushinteger(lua, value.Version());
+            lua_rawseti(lua, cache, 2 * position + 2);
+        }
+        lua_remove(lua, cache);
+    }
+
+    void PushSimpleValue(lua_State* lua, int value) {
+        *(int*)lua_newuserdata(lua, sizeof(int)) = value;
+        if (luaL_newmetatable(lua, "SimpleValue")) {
+            lua_pushcfunction(lua, [](lua_State* lua){
+                lua_pushinteger(lua, *(int*)lua_touserdata(lua, 1));
+                return 1;
+            });
+            lua_setfield(lua, -2, "__call");
+        }
+        lua_setmetatable(lua, -2);
+    }
+
+    void PushSimpleStruct(lua_State* lua, const SimpleStruct& simpleStruct) {
+        *(SimpleStruct*)lua_newuserdata(lua, sizeof(SimpleStruct)) = simpleStruct;
+        if (luaL_newmetatable(lua, "SimpleStruct")) {
+            static const char* const names[] = {"x", "y", NULL};
+            SetIndex(lua, names, [](lua_State* lua){
+                const auto& udata = *(SimpleStruct*)lua_touserdata(lua, 1);
+                switch (LookUpField(lua)) {
+                    case 0: lua_pushinteger(lua, udata.x); break;
+                    case 1: lua_pushinteger(lua, udata.y); break;
+                    default: lua_pushnil(lua); break;
+                }
+                return 1;
+            });
+        }
+        lua_setmetatable(lua, -2);
+    }
+
+    void PushOwnedObject(lua_State* lua, TestObject&& testObject) {
+        auto udata = (TestObject*)lua_newuserdata(lua, sizeof(TestObject));
+        new (udata) TestObject(std::move(testObject));
+        if (luaL_newmetatable(lua, "OwnedTestObject")) {
+            lua_pushcfunction(lua, [](lua_State* lua){
+                ((TestObject*)lua_touserdata(lua, 1))->~TestObject();
+                return 0;
+            });
+            lua_setfield(lua, -2, "__gc");
+            static const char* const names[] = {"v", "s", NULL};
+            SetIndex(lua, names, [](lua_State* lua){
+                PushTestObjectField(lua, *(TestObject*)lua_touserdata(lua, 1));
+                return 1;
+            });
+        }
+        lua_setmetatable(lua, -2);
+    }
+
+    // This always makes a new userdata for the shared object, as Example3 did
+    // before it cached them.
+    void PushNewSharedObject(lua_State* lua, const std::shared_ptr< TestObject >& testObject) {
+        auto udata = (std::shared_ptr< TestObject >*)lua_newuserdata(
+            lua,
+            sizeof(std::shared_ptr< TestObject >)
+        );
+        new (udata) std::shared_ptr< TestObject >(testObject);
+        if (luaL_newmetatable(lua, "SharedTestObject")) {
+            lua_pushcfunction(lua, [](lua_State* lua){
+                auto udata = (std::shared_ptr< TestObject >*)lua_touserdata(lua, 1);
+                udata->~shared_ptr< TestObject >();
+                return 0;
+            });
+            lua_setfield(lua, -2, "__gc");
+            static const char* const names[] = {"v", "s", NULL};
+            SetIndex(lua, names, [](lua_State* lua){
+                PushTestObjectField(lua, **(std::shared_ptr< TestObject >*)lua_touserdata(lua, 1));
+                return 1;
+            });
+        }
+        lua_setmetatable(lua, -2);
+    }
+
+    // This gives Lua the userdata already made for the shared object, if
+    // Lua still has one, looking it up by the object's address in a table
+    // with weak values, the same way as `PushSharedObject` in Example3.
+    void PushOwnedCachedObject(lua_State* lua, CachedTestObject&& testObject) {
+        auto udata = (CachedTestObject*)lua_newuserdata(lua, sizeof(CachedTestObject));
+        new (udata) CachedTestObject(std::move(testObject));
+        if (luaL_newmetatable(lua, "OwnedCachedTestObject")) {
+            lua_pushcfunction(lua, [](lua_State* lua){
+                ((CachedTestObject*)lua_touserdata(lua, 1))->~CachedTestObject();
+                return 0;
+            });
+            lua_setfield(lua, -2, "__gc");
+            static const char* const names[] = {"v", "s", NULL};
+            SetIndex(lua, names, [](lua_State* lua){
+                const auto& object = *(CachedTestObject*)lua_touserdata(lua, 1);
+                const auto position = LookUpField(lua);
+                switch (position) {
+                    case 0: lua_pushinteger(lua, object.v); break;
+                    case 1: PushCachedStringField(lua, object.s, position); break;
+                    default: lua_pushnil(lua); break;
+                }
+                return 1;
+            });
+        }
+        lua_setmetatable(lua, -2);
+    }
+
+    void PushSharedObject(lua_State* lua, const std::shared_ptr< TestObject >& testObject) {
+        if (lua_rawgetp(lua, LUA_REGISTRYINDEX, &SHARED_OBJECT_CACHE_KEY) != LUA_TTABLE) {
+            lua_pop(lua, 1);
+            lua_newtable(lua);
+            lua_createtable(lua, 0, 1);
+            lua_pushliteral(lua, "v");
+            lua_setfield(lua, -2, "__mode");
+            lua_setmetatable(lua, -2);
+            lua_pushvalue(lua, -1);
+            lua_rawsetp(lua, LUA_REGISTRYINDEX, &SHARED_OBJECT_CACHE_KEY);
+        }
+        if (lua_rawgetp(lua, -1, testObject.get()) == LUA_TUSERDATA) {
+            lua_remove(lua, -2);
+            return;
+        }
+        lua_pop(lua, 1);
+        PushNewSharedObject(lua, testObject);
+        lua_pushvalue(lua, -1);
+        lua_rawsetp(lua, -3, testObject.get());
+        lua_remove(lua, -2);
+    }
+
+    // This is the Lua instance each benchmark gets to use.  It's created
+    // fresh for each benchmark, and counts the memory it allocates.
+    struct Fixture {
+        AllocationCounters counters;
+        lua_State* lua = nullptr;
+    };
+
+    // Each benchmark is a function which prepares the fixture (if needed)
+    // and then performs the operation being measured the given number
+    // of times.  The preparation isn't timed, so each benchmark calls
+    // `Start` when it's ready to begin.
+    struct Timer {
+        std::chrono::steady_clock::time_point start;
+        AllocationCounters counters;
+        const AllocationCounters* source = nullptr;
+
+        void Start(const AllocationCounters& fixtureCounters) {
+            source = &fixtureCounters;
+            counters = fixtureCounters;
+            start = std::chrono::steady_clock::now();
+        }
+    };
+
+    typedef void (*Benchmark)(Fixture& fixture, Timer& timer, size_t iterations);
+
+    void BenchmarkNewState(Fixture& fixture, Timer& timer, size_t iterations) {
+        timer.Start(fixture.counters);
+        for (size_t i = 0; i < iterations; ++i) {
+            lua_close(NewState(fixture.counters));
+        }
+    }
+
+    void BenchmarkLoadString(Fixture& fixture, Timer& timer, size_t iterations) {
+        const auto lua = fixture.lua;
+        timer.Start(fixture.counters);
+        for (size_t i = 0; i < iterations; ++i) {
+            (void)luaL_loadstring(lua, ADD_AND_ROUND_SCRIPT);
+            lua_pop(lua, 1);
+        }
+    }
+
+    void BenchmarkLoadReader(Fixture& fixture, Timer& timer, size_t iterations) {
+        const auto lua = fixture.lua;
+        const std::string script = ADD_AND_ROUND_SCRIPT;
+        timer.Start(fixture.counters);
+        for (size_t i = 0; i < iterations; ++i) {
+            LuaReaderState luaReaderState;
+            luaReaderState.chunk = &script;
+            (void)lua_load(lua, LuaReader, &luaReaderState, "=example", "t");
+            lua_pop(lua, 1);
+        }
+    }
+
+    void BenchmarkCall(Fixture& fixture, Timer& timer, size_t iterations) {
+        const auto lua = fixture.lua;
+        (void)luaL_loadstring(lua, ADD_AND_ROUND_SCRIPT);
+        const auto function = lua_gettop(lua);
+        timer.Start(fixture.counters);
+        for (size_t i = 0; i < iterations; ++i) {
+            lua_pushvalue(lua, function);
+            lua_pushnumber(lua, 14.9);
+            lua_pushnumber(lua, 27.3);
+            lua_call(lua, 2, 1);
+            lua_pop(lua, 1);
+        }
+    }
+
+    void BenchmarkProtectedCall(Fixture& fixture, Timer& timer, size_t iterations) {
+        const auto lua = fixture.lua;
+        lua_pushcfunction(lua, LuaTraceback);
+        const auto handler = lua_gettop(lua);
+        (void)luaL_loadstring(lua, ADD_AND_ROUND_SCRIPT);
+        const auto function = lua_gettop(lua);
+        timer.Start(fixture.counters);
+        for (size_t i = 0; i < iterations; ++i) {
+            lua_pushvalue(lua, function);
+            lua_pushnumber(lua, 14.9);
+            lua_pushnumber(lua, 27.3);
+            (void)lua_pcall(lua, 2, 1, handler);
+            lua_pop(lua, 1);
+        }
+    }
+
+    void BenchmarkProtectedCallError(Fixture& fixture, Timer& timer, size_t iterations) {
+        const auto lua = fixture.lua;
+        lua_pushcfunction(lua, LuaTraceback);
+        const auto handler = lua_gettop(lua);
+        (void)luaL_loadstring(lua, "foobar()");
+        const auto function = lua_gettop(lua);
+        timer.Start(fixture.counters);
+        for (size_t i = 0; i < iterations; ++i) {
+            lua_pushvalue(lua, function);
+            (void)lua_pcall(lua, 0, 0, handler);
+            lua_pop(lua, 1);
+        }
+    }
+
+    void BenchmarkPushSimpleValue(Fixture& fixture, Timer& timer, size_t iterations) {
+        const auto lua = fixture.lua;
+        timer.Start(fixture.counters);
+        for (size_t i = 0; i < iterations; ++i) {
+            PushSimpleValue(lua, 42);
+            lua_pop(lua, 1);
+        }
+    }
+
+    void BenchmarkPushSimpleStruct(Fixture& fixture, Timer& timer, size_t iterations) {
+        const auto lua = fixture.lua;
+        SimpleStruct xy;
+        xy.x = 4;
+        xy.y = -7;
+        timer.Start(fixture.counters);
+        for (size_t i = 0; i < iterations; ++i) {
+            PushSimpleStruct(lua, xy);
+            lua_pop(lua, 1);
+        }
+    }
+
+    void BenchmarkPushOwnedObject(Fixture& fixture, Timer& timer, size_t iterations) {
+        const auto lua = fixture.lua;
+        timer.Start(fixture.counters);
+        for (size_t i = 0; i < iterations; ++i) {
+            TestObject obj;
+            obj.v = 99;
+            obj.s = "Hello,";
+            PushOwnedObject(lua, std::move(obj));
+            lua_pop(lua, 1);
+        }
+    }
+
+    void BenchmarkPushSharedObject(Fixture& fixture, Timer& timer, size_t iterations) {
+        const auto lua = fixture.lua;
+        const auto obj = std::make_shared< TestObject >();
+        obj->v = 77;
+        obj->s = "World!";
+        timer.Start(fixture.counters);
+        for (size_t i = 0; i < iterations; ++i) {
+            PushNewSharedObject(lua, obj);
+            lua_pop(lua, 1);
+        }
+    }
+
+    // Push a shared object which Lua already holds, as when a script keeps
+    // an object it was given, so every push finds it in the cache.
+    void BenchmarkPushSharedObjectCached(Fixture& fixture, Timer& timer, size_t iterations) {
+        const auto lua = fixture.lua;
+        const auto obj = std::make_shared< TestObject >();
+        obj->v = 77;
+        obj->s = "World!";
+        PushSharedObject(lua, obj);
+        timer.Start(fixture.counters);
+        for (size_t i = 0; i < iterations; ++i) {
+            PushSharedObject(lua, obj);
+            lua_pop(lua, 1);
+        }
+    }
+
+    // Have Lua access a field of the userdata at the top of the Lua stack
+    // the given number of times.
+    void AccessField(Fixture& fixture, Timer& timer, size_t iterations, const char* field) {
+        const auto lua = fixture.lua;
+        (void)luaL_loadstring(lua, R"lua(
+            local udata, field, n = ...
+            local value
+            for i = 1, n do
+                value = udata[field]
+            end
+        )lua");
+        lua_insert(lua, -2);
+        lua_pushstring(lua, field);
+        lua_pushinteger(lua, (lua_Integer)iterations);
+        timer.Start(fixture.counters);
+        lua_call(lua, 3, 0);
+    }
+
+    void BenchmarkIndexSimpleStruct(Fixture& fixture, Timer& timer, size_t iterations) {
+        SimpleStruct xy;
+        xy.x = 4;
+        xy.y = -7;
+        PushSimpleStruct(fixture.lua, xy);
+        AccessField(fixture, timer, iterations, "x");
+    }
+
+    void BenchmarkIndexOwnedObjectString(Fixture& fixture, Timer& timer, size_t iterations) {
+        TestObject obj;
+        obj.v = 99;
+        obj.s = "Hello,";
+        PushOwnedObject(fixture.lua, std::move(obj));
+        AccessField(fixture, timer, iterations, "s");
+    }
+
+    void BenchmarkIndexOwnedObjectCachedString(Fixture& fixture, Timer& timer, size_t iterations) {
+        CachedTestObject obj;
+        obj.v = 99;
+        obj.s = "Hello,";
+        PushOwnedCachedObject(fixture.lua, std::move(obj));
+        AccessField(fixture, timer, iterations, "s");
+    }
+
+    // These read a 16 KB string field, where copying the string on every
+    // read costs the most, with and without the cache.
+    const size_t LONG_STRING_LENGTH = 16384;
+
+    void BenchmarkIndexOwnedObjectLongString(Fixture& fixture, Timer& timer, size_t iterations) {
+        TestObject obj;
+        obj.v = 99;
+        obj.s = std::string(LONG_STRING_LENGTH, 'x');
+        PushOwnedObject(fixture.lua, std::move(obj));
+        AccessField(fixture, timer, iterations, "s");
+    }
+
+    void BenchmarkIndexOwnedObjectCachedLongString(Fixture& fixture, Timer& timer, size_t iterations) {
+        CachedTestObject obj;
+        obj.v = 99;
+        obj.s = std::string(LONG_STRING_LENGTH, 'x');
+        PushOwnedCachedObject(fixture.lua, std::move(obj));
+        AccessField(fixture, timer, iterations, "s");
+    }
+
+    void BenchmarkRegistry(Fixture& fixture, Timer& timer, size_t iterations) {
+        const auto lua = fixture.lua;
+        (void)luaL_loadstring(lua, ADD_AND_ROUND_SCRIPT);
+        timer.Start(fixture.counters);
+        for (size_t i = 0; i < iterations; ++i) {
+            lua_pushvalue(lua, -1);
+            const auto registryIndex = luaL_ref(lua, LUA_REGISTRYINDEX);
+            (void)lua_rawgeti(lua, LUA_REGISTRYINDEX, registryIndex);
+            lua_pop(lua, 1);
+            luaL_unref(lua, LUA_REGISTRYINDEX, registryIndex);
+        }
+    }
+
+    struct BenchmarkInfo {
+        const char* name;
+        Benchmark benchmark;
+    };
+
+    const BenchmarkInfo BENCHMARKS[] = {
+        {"state/newstate_openlibs_close", BenchmarkNewState},
+        {"load/luaL_loadstring", BenchmarkLoadString},
+        {"load/lua_load_reader", BenchmarkLoadReader},
+        {"call/lua_call", BenchmarkCall},
+        {"call/lua_pcall_traceback", BenchmarkProtectedCall},
+        {"call/lua_pcall_traceback_error", BenchmarkProtectedCallError},
+        {"push/simple_value", BenchmarkPushSimpleValue},
+        {"push/simple_struct", BenchmarkPushSimpleStruct},
+        {"push/owned_object", BenchmarkPushOwnedObject},
+        {"push/shared_object", BenchmarkPushSharedObject},
+        {"push/shared_object_cached", BenchmarkPushSharedObjectCached},
+        {"index/simple_struct_int", BenchmarkIndexSimpleStruct},
+        {"index/owned_object_string", BenchmarkIndexOwnedObjectString},
+        {"index/owned_object_cached_string", BenchmarkIndexOwnedObjectCachedString},
+        {"index/owned_object_string_16k", BenchmarkIndexOwnedObjectLongString},
+        {"index/owned_object_cached_string_16k", BenchmarkIndexOwnedObjectCachedLongString},
+        {"registry/ref_rawgeti_unref", BenchmarkRegistry},
+    };
+
+    struct Result {
+        const char* name;
+        size_t iterations;
+        double nanosecondsPerOp;
+        double allocationsPerOp;
+        double bytesPerOp;
+    };
+
+    // Run the given benchmark with more and more iterations until it runs
+    // long enough to measure accurately, and return the measurements from
+    // the last run.
+    Result Run(const BenchmarkInfo& info) {
+        Result result;
+        result.name = info.name;
+        for (size_t iterations = 1;; iterations *= 2) {
+            Fixture fixture;
+            fixture.lua = NewState(fixture.counters);
+            Timer timer;
+            info.benchmark(fixture, timer, iterations);
+            const auto end = std::chrono::steady_clock::now();
+            const auto seconds = std::chrono::duration< double >(end - timer.start).count();
+            const auto allocations = timer.source->allocations - timer.counters.allocations;
+            const auto bytes = timer.source->bytes - timer.counters.bytes;
+            lua_close(fixture.lua);
+            if (seconds >= MIN_RUN_SECONDS) {
+                result.iterations = iterations;
+                result.nanosecondsPerOp = seconds * 1e9 / (double)iterations;
+                result.allocationsPerOp = (double)allocations / (double)iterations;
+                result.bytesPerOp = (double)bytes / (double)iterations;
+                return result;
+            }
+        }
+    }
+
+    void PrintTable(const std::vector< Result >& results) {
+        (void)printf(
+            "%-40s %12s %12s %12s %12s\n",
+            "benchmark",
+            "iterations",
+            "ns/op",
+            "allocs/op",
+            "bytes/op"
+        );
+        for (const auto& result: results) {
+            (void)printf(
+                "%-40s %12zu %12.1f %12.2f %12.1f\n",
+                result.name,
+                result.iterations,
+                result.nanosecondsPerOp,
+                result.allocationsPerOp,
+                result.bytesPerOp
+            );
+        }
+    }
+
+    void PrintJson(const std::vector< Result >& results) {
+        (void)printf("{\n  \"lua_version\": \"%s\",\n  \"benchmarks\": [\n", LUA_VERSION);
+        for (size_t i = 0; i < results.size(); ++i) {
+            const auto& result = results[i];
+            (void)printf(
+                "    {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.3f, "
+                "\"allocs_per_op\": %.4f, \"bytes_per_op\": %.3f}%s\n",
+                result.name,
+                result.iterations,
+                result.nanosecondsPerOp,
+                result.allocationsPerOp,
+                result.bytesPerOp,
+                ((i + 1 < results.size()) ? "," : "")
+            );
+        }
+        (void)printf("  ]\n}\n");
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Parse the command line.  Benchmarks with names containing the given
+    // filter (if any) are run, and results are printed either as a table
+    // for humans or as JSON for tools.
+    bool json = false;
+    const char* filter = "";
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (argv[i][0] != '-') {
+            filter = argv[i];
+        } else {
+            (void)fprintf(stderr, "usage: %s [--json] [FILTER]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Run the benchmarks.
+    std::vector< Result > results;
+    for (const auto& info: BENCHMARKS) {
+        if (strstr(info.name, filter) != NULL) {
+            results.push_back(Run(info));
+        }
+    }
+
+    // Report the results.
+    if (json) {
+        PrintJson(results);
+    } else {
+        PrintTable(results);
+    }
+
+    // All done!
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,336 @@
+#include <algorithm>
+#include <chrono>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // This paces the Lua garbage collector, so that its work is done in
+    // small steps at times the program chooses, rather than whenever a
+    // script happens to allocate memory.
+    //
+    // While the pacer is running, automatic collection is stopped.  The
+    // program calls `Tick` at convenient moments, such as between requests
+    // or once per frame, giving it a time budget.  The pacer keeps track of
+    // how much memory scripts have allocated since the last tick, and does
+    // a matching amount of collection work using `LUA_GCSTEP`, stopping
+    // early if the budget runs out.
+    //
+    // Like Lua's own collector, once the pacer finishes a collection cycle
+    // it "pauses", owing no work until memory use grows by a certain
+    // percentage.  If the pacer falls behind, because scripts allocate faster
+    // than it can collect within its budget, it raises the collector's "step
+    // multiplier" so that each step does more work, and lengthens the pause so
+    // that cycles are less frequent, trading memory for time.  Once it's
+    // caught up, it gradually lowers both again.
+    class GcPacer {
+    public:
+        struct Options {
+            // This is the most time to spend collecting garbage in one tick,
+            // unless the caller gives a different budget.
+            std::chrono::microseconds tickBudget = std::chrono::microseconds(200);
+
+            // This is how many kilobytes of allocation each collection step
+            // pays for.  Smaller steps stay within the budget more closely.
+            int stepKilobytes = 16;
+
+            // These are the limits for the step multiplier, which is how
+            // much collection work is done for each kilobyte allocated,
+            // as a percentage.
+            int minStepMultiplier = 200;
+            int maxStepMultiplier = 1000;
+
+            // These are the limits for the pause, which is how much memory
+            // use must grow after a cycle before the next one starts, as a
+            // percentage.
+            int minPause = 150;
+            int maxPause = 400;
+        };
+
+        // These are counters the pacer keeps about its work.
+        struct Counters {
+            size_t ticks = 0;
+            size_t steps = 0;
+            size_t cycles = 0;
+            std::chrono::nanoseconds lastTickTime = std::chrono::nanoseconds(0);
+            std::chrono::nanoseconds maxTickTime = std::chrono::nanoseconds(0);
+            std::chrono::nanoseconds totalTime = std::chrono::nanoseconds(0);
+            size_t ticksOverBudget = 0;
+        };
+
+        GcPacer(lua_State* lua, const Options& options)
+            : lua_(lua)
+            , options_(options)
+            , stepMultiplier_(options.minStepMultiplier)
+            , pause_(options.minPause)
+        {
+        }
+
+        ~GcPacer() {
+            Stop();
+        }
+
+        GcPacer(const GcPacer&) = delete;
+        GcPacer& operator=(const GcPacer&) = delete;
+
+        // Stop automatic garbage collection, leaving it to the pacer.
+        void Start() {
+            if (running_) {
+                return;
+            }
+            lua_gc(lua_, LUA_GCSTOP, 0);
+            originalStepMultiplier_ = lua_gc(lua_, LUA_GCSETSTEPMUL, stepMultiplier_);
+            lastBytes_ = GetBytesInUse();
+            pausing_ = false;
+            owedKilobytes_ = 0;
+            running_ = true;
+        }
+
+        // Hand garbage collection back to Lua.
+        void Stop() {
+            if (!running_) {
+                return;
+            }
+            (void)lua_gc(lua_, LUA_GCSETSTEPMUL, originalStepMultiplier_);
+            lua_gc(lua_, LUA_GCRESTART, 0);
+            running_ = false;
+        }
+
+        // Do collection work to make up for memory allocated since the last
+        // tick, using at most the default time budget.
+        void Tick() {
+            Tick(options_.tickBudget);
+        }
+
+        // Do collection work to make up for memory allocated since the last
+        // tick, using at most the given time budget.
+        void Tick(std::chrono::microseconds budget) {
+            if (!running_) {
+                return;
+            }
+            const auto start = std::chrono::steady_clock::now();
+            const auto deadline = start + budget;
+
+            // Add up how much collection work is owed, unless we're pausing
+            // between cycles.
+            const auto bytes = GetBytesInUse();
+            if (pausing_ && (bytes >= pauseThreshold_)) {
+                pausing_ = false;
+            } else if (!pausing_ && (bytes > lastBytes_)) {
+                owedKilobytes_ += (long)((bytes - lastBytes_) / 1024);
+            }
+
+            // Pay for it, one step at a time, until it's paid or time is up.
+            // When a cycle finishes, start pausing.
+            auto now = start;
+            while ((owedKilobytes_ > 0) && (now < deadline)) {
+                ++counters_.steps;
+                owedKilobytes_ -= options_.stepKilobytes;
+                const auto cycleFinished = (lua_gc(lua_, LUA_GCSTEP, options_.stepKilobytes) != 0);
+                now = std::chrono::steady_clock::now();
+                if (cycleFinished) {
+                    ++counters_.cycles;
+                    pauseThreshold_ = GetBytesInUse() / 100 * (size_t)pause_;
+                    pausing_ = true;
+                    owedKilobytes_ = 0;
+                }
+            }
+            if (owedKilobytes_ < 0) {
+                owedKilobytes_ = 0;
+            }
+
+            // Adapt the step multiplier and pause to the allocation rate.
+            if (owedKilobytes_ > 0) {
+                ++counters_.ticksOverBudget;
+                stepMultiplier_ = std::min(options_.maxStepMultiplier, stepMultiplier_ * 5 / 4);
+                pause_ = std::min(options_.maxPause, pause_ + 10);
+            } else if (now - start < budget / 2) {
+                stepMultiplier_ = std::max(options_.minStepMultiplier, stepMultiplier_ * 9 / 10);
+                pause_ = std::max(options_.minPause, pause_ - 1);
+            }
+            (void)lua_gc(lua_, LUA_GCSETSTEPMUL, stepMultiplier_);
+
+            // Update the counters.
+            lastBytes_ = GetBytesInUse();
+            const auto tickTime = std::chrono::duration_cast< std::chrono::nanoseconds >(now - start);
+            ++counters_.ticks;
+            counters_.lastTickTime = tickTime;
+            counters_.maxTickTime = std::max(counters_.maxTickTime, tickTime);
+            counters_.totalTime += tickTime;
+        }
+
+        const Counters& GetCounters() const {
+            return counters_;
+        }
+
+        int StepMultiplier() const {
+            return stepMultiplier_;
+        }
+
+        int Pause() const {
+            return pause_;
+        }
+
+    private:
+        size_t GetBytesInUse() const {
+            return (
+                (size_t)lua_gc(lua_, LUA_GCCOUNT, 0) * 1024
+                + (size_t)lua_gc(lua_, LUA_GCCOUNTB, 0)
+            );
+        }
+
+        lua_State* lua_;
+        Options options_;
+        bool running_ = false;
+        int stepMultiplier_;
+        int originalStepMultiplier_ = 200;
+        int pause_;
+        bool pausing_ = false;
+        size_t pauseThreshold_ = 0;
+        size_t lastBytes_ = 0;
+        long owedKilobytes_ = 0;
+        Counters counters_;
+    };
+
+    // This script defines a request handler which allocates lots of
+    // short-lived tables and strings, with a cache that keeps some of them
+    // alive for a while, so the collector has plenty of work to do.
+    const char* const HANDLER_SCRIPT = R"lua(
+        local cache = {}
+        local nextSlot = 1
+        function handle(n)
+            local records = {}
+            for i = 1, 50 do
+                records[i] = {id = n * 100 + i, name = "record" .. i, tags = {"a", "b", "c"}}
+            end
+            local parts = {}
+            for i, record in ipairs(records) do
+                parts[i] = record.name .. "=" .. record.id
+            end
+            cache[nextSlot] = table.concat(parts, ";")
+            nextSlot = nextSlot % 1000 + 1
+            return #records
+        end
+    )lua";
+
+    // This holds the latency percentiles measured in one benchmark run.
+    struct LatencyReport {
+        double p50;
+        double p99;
+        double p999;
+        double max;
+        size_t peakKilobytes;
+    };
+
+    // Run many requests, calling the given function between requests,
+    // and report the latencies of the requests themselves, in microseconds.
+    template< typename BetweenRequests > LatencyReport MeasureRequests(
+        lua_State* lua,
+        int numRequests,
+        BetweenRequests betweenRequests
+    ) {
+        std::vector< double > latencies;
+        latencies.reserve((size_t)numRequests);
+        size_t peakKilobytes = 0;
+        for (int i = 0; i < numRequests; ++i) {
+            const auto start = std::chrono::steady_clock::now();
+            lua_getglobal(lua, "handle");
+            lua_pushinteger(lua, i);
+            lua_call(lua, 1, 0);
+            const auto end = std::chrono::steady_clock::now();
+            latencies.push_back(std::chrono::duration< double, std::micro >(end - start).count());
+            peakKilobytes = std::max(peakKilobytes, (size_t)lua_gc(lua, LUA_GCCOUNT, 0));
+            betweenRequests();
+        }
+        std::sort(latencies.begin(), latencies.end());
+        const auto percentile = [&latencies](double p) {
+            return latencies[(size_t)(p * (latencies.size() - 1))];
+        };
+        LatencyReport report;
+        report.p50 = percentile(0.50);
+        report.p99 = percentile(0.99);
+        report.p999 = percentile(0.999);
+        report.max = latencies.back();
+        report.peakKilobytes = peakKilobytes;
+        return report;
+    }
+
+    void PrintLatencyReport(const char* label, const LatencyReport& report) {
+        (void)printf(
+            "%-12s p50 %7.1f us  p99 %7.1f us  p99.9 %7.1f us  max %8.1f us  peak %6zu KB\n",
+            label,
+            report.p50,
+            report.p99,
+            report.p999,
+            report.max,
+            report.peakKilobytes
+        );
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Create the Lua instance.
+    const auto lua = luaL_newstate();
+
+    // Load standard Lua libraries.
+    //
+    // Temporarily disable the garbage collector as we load the
+    // libraries, to improve performance
+    // (http://lua-users.org/lists/lua-l/2008-07/msg00690.html).
+    lua_gc(lua, LUA_GCSTOP, 0);
+    luaL_openlibs(lua);
+    lua_gc(lua, LUA_GCRESTART, 0);
+
+    // Define the request handler, and warm it up.
+    (void)luaL_dostring(lua, HANDLER_SCRIPT);
+    const int numRequests = 100000;
+    (void)MeasureRequests(lua, 1000, []{});
+
+    // Run the requests with the collector running automatically, so that
+    // some requests are interrupted to do collection work.
+    lua_gc(lua, LUA_GCCOLLECT, 0);
+    const auto automatic = MeasureRequests(lua, numRequests, []{});
+
+    // Run the requests again with the pacer doing collection work between
+    // requests instead.
+    lua_gc(lua, LUA_GCCOLLECT, 0);
+    GcPacer pacer(lua, GcPacer::Options());
+    pacer.Start();
+    const auto paced = MeasureRequests(
+        lua,
+        numRequests,
+        [&pacer]{ pacer.Tick(); }
+    );
+    pacer.Stop();
+
+    PrintLatencyReport("Automatic GC", automatic);
+    PrintLatencyReport("Paced GC", paced);
+    const auto& counters = pacer.GetCounters();
+    (void)printf(
+        "Pacer: %zu ticks, %zu steps, %zu cycles, GC time per tick avg %.1f us max %.1f us, "
+        "%zu ticks over budget, final step multiplier %d pause %d\n",
+        counters.ticks,
+        counters.steps,
+        counters.cycles,
+        std::chrono::duration< double, std::micro >(counters.totalTime).count() / counters.ticks,
+        std::chrono::duration< double, std::micro >(counters.maxTickTime).count(),
+        counters.ticksOverBudget,
+        pacer.StepMultiplier(),
+        pacer.Pause()
+    );
+
+    // Destroy the Lua instance.
+    lua_close(lua);
+
+    // All done!
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,75 @@
+-- A small inventory module, of the kind a program might load at startup.
+local inventory = {}
+
+local items = {}
+local byCategory = {}
+
+function inventory.add(name, category, quantity, price)
+    assert(type(name) == "string", "item name must be a string")
+    local item = items[name]
+    if item then
+        item.quantity = item.quantity + quantity
+        return item
+    end
+    item = {
+        name = name,
+        category = category,
+        quantity = quantity,
+        price = price,
+    }
+    items[name] = item
+    local list = byCategory[category]
+    if not list then
+        list = {}
+        byCategory[category] = list
+    end
+    list[#list + 1] = item
+    return item
+end
+
+function inventory.remove(name, quantity)
+    local item = items[name]
+    if not item then
+        return nil, "no such item: " .. name
+    end
+    if item.quantity < quantity then
+        return nil, "not enough " .. name
+    end
+    item.quantity = item.quantity - quantity
+    return item
+end
+
+function inventory.value(category)
+    local total = 0
+    local list = category and byCategory[category] or nil
+    if list then
+        for _, item in ipairs(list) do
+            total = total + item.quantity * item.price
+        end
+    else
+        for _, item in pairs(items) do
+            total = total + item.quantity * item.price
+        end
+    end
+    return total
+end
+
+function inventory.report()
+    local categories = {}
+    for category in pairs(byCategory) do
+        categories[#categories + 1] = category
+    end
+    table.sort(categories)
+    local lines = {}
+    for _, category in ipairs(categories) do
+        local list = byCategory[category]
+        table.sort(list, function(a, b) return a.name < b.name end)
+        lines[#lines + 1] = string.format("%s (%.2f)", category, inventory.value(category))
+        for _, item in ipairs(list) do
+            lines[#lines + 1] = string.format("  %-12s %5d x %8.2f", item.name, item.quantity, item.price)
+        end
+    end
+    return table.concat(lines, "\n")
+end
+
+return inventory
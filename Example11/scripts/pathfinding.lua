@@ -0,0 +1,87 @@
+-- Breadth-first and A* path finding on a grid, of the kind a program might
+-- load at startup.
+local pathfinding = {}
+
+local function key(x, y)
+    return y * 65536 + x
+end
+
+local function neighbors(grid, x, y)
+    local result = {}
+    local offsets = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}}
+    for _, offset in ipairs(offsets) do
+        local nx, ny = x + offset[1], y + offset[2]
+        local row = grid[ny]
+        if row and row[nx] == 0 then
+            result[#result + 1] = {nx, ny}
+        end
+    end
+    return result
+end
+
+local function reconstruct(cameFrom, goal)
+    local path = {}
+    local current = goal
+    while current do
+        table.insert(path, 1, current)
+        current = cameFrom[key(current[1], current[2])]
+    end
+    return path
+end
+
+function pathfinding.breadthFirst(grid, start, goal)
+    local frontier = {start}
+    local head = 1
+    local cameFrom = {[key(start[1], start[2])] = false}
+    while frontier[head] do
+        local current = frontier[head]
+        head = head + 1
+        if current[1] == goal[1] and current[2] == goal[2] then
+            return reconstruct(cameFrom, current)
+        end
+        for _, nextCell in ipairs(neighbors(grid, current[1], current[2])) do
+            local k = key(nextCell[1], nextCell[2])
+            if cameFrom[k] == nil then
+                cameFrom[k] = current
+                frontier[#frontier + 1] = nextCell
+            end
+        end
+    end
+    return nil
+end
+
+local function heuristic(a, b)
+    return math.abs(a[1] - b[1]) + math.abs(a[2] - b[2])
+end
+
+function pathfinding.aStar(grid, start, goal)
+    local open = {start}
+    local cameFrom = {[key(start[1], start[2])] = false}
+    local cost = {[key(start[1], start[2])] = 0}
+    while #open > 0 do
+        local best, bestIndex = nil, nil
+        for i, cell in ipairs(open) do
+            local score = cost[key(cell[1], cell[2])] + heuristic(cell, goal)
+            if not best or score < best then
+                best, bestIndex = score, i
+            end
+        end
+        local current = table.remove(open, bestIndex)
+        if current[1] == goal[1] and current[2] == goal[2] then
+            return reconstruct(cameFrom, current)
+        end
+        local currentCost = cost[key(current[1], current[2])]
+        for _, nextCell in ipairs(neighbors(grid, current[1], current[2])) do
+            local k = key(nextCell[1], nextCell[2])
+            local newCost = currentCost + 1
+            if cost[k] == nil or newCost < cost[k] then
+                cost[k] = newCost
+                cameFrom[k] = current
+                open[#open + 1] = nextCell
+            end
+        end
+    end
+    return nil
+end
+
+return pathfinding
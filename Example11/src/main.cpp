@@ -0,0 +1,227 @@
+#include <chrono>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "EmbeddedLuaScripts.h"
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    struct LuaReaderState {
+        const char* chunk = nullptr;
+        size_t size = 0;
+        bool read = false;
+    };
+
+    const char* LuaReader(lua_State* lua, void* data, size_t* size) {
+        LuaReaderState* state = (LuaReaderState*)data;
+        if (state->read) {
+            return NULL;
+        } else {
+            state->read = true;
+            *size = state->size;
+            return state->chunk;
+        }
+    }
+
+    // Load one of the scripts compiled at build time and embedded in the
+    // program.  Since the script is already compiled, Lua only needs to
+    // read in the bytecode, rather than parsing and compiling the script.
+    //
+    // The chunk is loaded in "b" mode, which only accepts bytecode, so that
+    // if the build somehow embedded source text instead, loading fails
+    // rather than quietly compiling it at run time.
+    int LoadEmbeddedScript(lua_State* lua, const EmbeddedLuaScript& script) {
+        LuaReaderState luaReaderState;
+        luaReaderState.chunk = (const char*)script.bytecode;
+        luaReaderState.size = script.size;
+        const auto chunkName = std::string("=") + script.name;
+        return lua_load(lua, LuaReader, &luaReaderState, chunkName.c_str(), "b");
+    }
+
+    // This is how scripts are loaded when they aren't compiled in advance:
+    // from source text, parsing and compiling it each time.
+    int LoadScriptText(lua_State* lua, const std::string& text, const char* name) {
+        LuaReaderState luaReaderState;
+        luaReaderState.chunk = text.data();
+        luaReaderState.size = text.length();
+        const auto chunkName = std::string("=") + name;
+        return lua_load(lua, LuaReader, &luaReaderState, chunkName.c_str(), "t");
+    }
+
+    // Return the embedded script with the given name, or null if there
+    // isn't one.
+    const EmbeddedLuaScript* FindEmbeddedScript(const char* name) {
+        for (size_t i = 0; i < NUM_EMBEDDED_LUA_SCRIPTS; ++i) {
+            if (strcmp(EMBEDDED_LUA_SCRIPTS[i].name, name) == 0) {
+                return &EMBEDDED_LUA_SCRIPTS[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // Load the named embedded script and run it, leaving its result on the
+    // Lua stack.
+    bool RunEmbeddedScript(lua_State* lua, const char* name) {
+        const auto script = FindEmbeddedScript(name);
+        if (script == nullptr) {
+            (void)fprintf(stderr, "No embedded script named '%s'\n", name);
+            return false;
+        }
+        if (
+            (LoadEmbeddedScript(lua, *script) != LUA_OK)
+            || (lua_pcall(lua, 0, 1, 0) != LUA_OK)
+        ) {
+            (void)fprintf(stderr, "Script '%s' failed: %s\n", name, lua_tostring(lua, -1));
+            lua_pop(lua, 1);
+            return false;
+        }
+        return true;
+    }
+
+    // Read the whole file at the given path into `contents`, returning
+    // false if the file can't be opened or read.
+    bool ReadFile(const char* path, std::string& contents) {
+        contents.clear();
+        const auto file = fopen(path, "rb");
+        if (file == NULL) {
+            return false;
+        }
+        char buffer[4096];
+        size_t amount;
+        while ((amount = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            contents.append(buffer, amount);
+        }
+        const auto failed = (ferror(file) != 0);
+        (void)fclose(file);
+        return !failed;
+    }
+
+    // Simulate starting up a program which ships many scripts, by making
+    // a new Lua instance and loading every embedded script into it many
+    // times, either from source text or from the embedded bytecode.
+    //
+    // The source text is read from where the scripts were when the program
+    // was built.  If any of them can't be read there, only the bytecode is
+    // measured.
+    void MeasureStartup(int copiesOfEachScript) {
+        // Read the source text of the scripts ahead of time, so that reading
+        // files isn't part of what's measured.
+        std::vector< std::string > texts(NUM_EMBEDDED_LUA_SCRIPTS);
+        auto haveTexts = true;
+        size_t textBytes = 0;
+        size_t bytecodeBytes = 0;
+        for (size_t i = 0; i < NUM_EMBEDDED_LUA_SCRIPTS; ++i) {
+            const auto& script = EMBEDDED_LUA_SCRIPTS[i];
+            if (!ReadFile(script.path, texts[i])) {
+                (void)fprintf(
+                    stderr,
+                    "Unable to read '%s'; measuring bytecode only\n",
+                    script.path
+                );
+                haveTexts = false;
+            }
+            textBytes += texts[i].length();
+            bytecodeBytes += script.size;
+        }
+        const auto numLoads = (int)NUM_EMBEDDED_LUA_SCRIPTS * copiesOfEachScript;
+        if (haveTexts) {
+            (void)printf(
+                "%zu scripts: %zu bytes of text, %zu bytes of bytecode\n",
+                NUM_EMBEDDED_LUA_SCRIPTS,
+                textBytes,
+                bytecodeBytes
+            );
+        } else {
+            (void)printf(
+                "%zu scripts: %zu bytes of bytecode\n",
+                NUM_EMBEDDED_LUA_SCRIPTS,
+                bytecodeBytes
+            );
+        }
+        for (int useBytecode = (haveTexts ? 0 : 1); useBytecode < 2; ++useBytecode) {
+            const auto start = std::chrono::steady_clock::now();
+            const auto lua = luaL_newstate();
+            lua_gc(lua, LUA_GCSTOP, 0);
+            luaL_openlibs(lua);
+            lua_gc(lua, LUA_GCRESTART, 0);
+            const auto loadStart = std::chrono::steady_clock::now();
+            for (int copy = 0; copy < copiesOfEachScript; ++copy) {
+                for (size_t i = 0; i < NUM_EMBEDDED_LUA_SCRIPTS; ++i) {
+                    const auto& script = EMBEDDED_LUA_SCRIPTS[i];
+                    const auto loadResult = (
+                        useBytecode
+                        ? LoadEmbeddedScript(lua, script)
+                        : LoadScriptText(lua, texts[i], script.name)
+                    );
+                    if (loadResult != LUA_OK) {
+                        (void)fprintf(stderr, "Unable to load '%s': %s\n", script.name, lua_tostring(lua, -1));
+                    }
+                    lua_pop(lua, 1);
+                }
+            }
+            const auto end = std::chrono::steady_clock::now();
+            lua_close(lua);
+            (void)printf(
+                "%-9s startup with %d scripts: %7.2f ms (%.1f us/script)\n",
+                (useBytecode ? "Bytecode" : "Text"),
+                numLoads,
+                std::chrono::duration< double, std::milli >(end - start).count(),
+                std::chrono::duration< double, std::micro >(end - loadStart).count() / numLoads
+            );
+        }
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Create the Lua instance.
+    const auto lua = luaL_newstate();
+
+    // Load standard Lua libraries.
+    //
+    // Temporarily disable the garbage collector as we load the
+    // libraries, to improve performance
+    // (http://lua-users.org/lists/lua-l/2008-07/msg00690.html).
+    lua_gc(lua, LUA_GCSTOP, 0);
+    luaL_openlibs(lua);
+    lua_gc(lua, LUA_GCRESTART, 0);
+
+    // Run the example script, compiled at build time.
+    if (RunEmbeddedScript(lua, "example")) {
+        lua_pop(lua, 1);
+    }
+
+    // Load a module compiled at build time and use it.
+    if (RunEmbeddedScript(lua, "inventory")) {
+        lua_setglobal(lua, "inventory");
+        if (luaL_dostring(lua, R"lua(
+            inventory.add("hammer", "tools", 3, 12.5)
+            inventory.add("wrench", "tools", 5, 8.25)
+            inventory.add("apple", "food", 40, 0.35)
+            print(inventory.report())
+        )lua") != LUA_OK) {
+            (void)fprintf(stderr, "Inventory demo failed: %s\n", lua_tostring(lua, -1));
+            lua_pop(lua, 1);
+        }
+    }
+
+    // Destroy the Lua instance.
+    lua_close(lua);
+
+    // Compare starting up with scripts compiled at run time and at build
+    // time, pretending we ship a few hundred scripts.
+    MeasureStartup(100);
+
+    // All done!
+    return EXIT_SUCCESS;
+}
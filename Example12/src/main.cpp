@@ -0,0 +1,336 @@
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // This is the loader API: functions which load a Lua chunk from
+    // somewhere other than a single in-memory string, without first reading
+    // the whole thing into memory.
+    //
+    // Like `lua_load`, each takes a chunk name, used in error messages, and
+    // a mode: "t" to accept only source text, "b" to accept only precompiled
+    // bytecode, or "bt" to accept either.  Each returns the status code from
+    // `lua_load`, leaving either the loaded chunk or an error message on the
+    // Lua stack.  If the file can't be read, they return LUA_ERRFILE, like
+    // `luaL_loadfilex` does.
+
+    // This is how much of a memory-mapped file `LoadMappedFile` gives to Lua
+    // at a time.
+    constexpr size_t MAPPED_WINDOW_SIZE = 1024 * 1024;
+
+    // This is the default size of the buffer `LoadStream` reads into.
+    constexpr size_t DEFAULT_STREAM_BUFFER_SIZE = 64 * 1024;
+
+    int PushFileError(lua_State* lua, const char* what, const char* chunkName) {
+        (void)lua_pushfstring(lua, "cannot %s %s: %s", what, chunkName, strerror(errno));
+        return LUA_ERRFILE;
+    }
+
+    struct MappedFileReaderState {
+        const char* data = nullptr;
+        size_t size = 0;
+        size_t offset = 0;
+    };
+
+    // Give Lua the next window of the mapped file.  Lua is done with the
+    // previous window by the time it asks for the next one, so tell the
+    // operating system it can drop those pages from our memory, keeping
+    // the memory we use small however large the file is.  The pages are
+    // only dropped from this process, not from the file or the operating
+    // system's file cache.
+    const char* MappedFileReader(lua_State* lua, void* data, size_t* size) {
+        const auto state = (MappedFileReaderState*)data;
+        if (state->offset > 0) {
+            const auto previous = state->offset - MAPPED_WINDOW_SIZE;
+            (void)madvise((void*)(state->data + previous), MAPPED_WINDOW_SIZE, MADV_DONTNEED);
+        }
+        if (state->offset >= state->size) {
+            return NULL;
+        }
+        const auto chunk = state->data + state->offset;
+        *size = std::min(MAPPED_WINDOW_SIZE, state->size - state->offset);
+        state->offset += MAPPED_WINDOW_SIZE;
+        return chunk;
+    }
+
+    // Load a chunk from a file by mapping the file into memory, so Lua reads
+    // it straight from the operating system's file cache, with no copies.
+    int LoadMappedFile(lua_State* lua, const char* path, const char* chunkName, const char* mode) {
+        const auto fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return PushFileError(lua, "open", chunkName);
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            (void)close(fd);
+            return PushFileError(lua, "stat", chunkName);
+        }
+        MappedFileReaderState state;
+        state.size = (size_t)info.st_size;
+        void* mapping = nullptr;
+        if (state.size > 0) {
+            mapping = mmap(NULL, state.size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                (void)close(fd);
+                return PushFileError(lua, "map", chunkName);
+            }
+            (void)madvise(mapping, state.size, MADV_SEQUENTIAL);
+            state.data = (const char*)mapping;
+        }
+        (void)close(fd);
+        const auto loadResult = lua_load(lua, MappedFileReader, &state, chunkName, mode);
+        if (mapping != nullptr) {
+            (void)munmap(mapping, state.size);
+        }
+        return loadResult;
+    }
+
+    struct StreamReaderState {
+        int fd = -1;
+        std::vector< char > buffer;
+        bool failed = false;
+        int error = 0;
+    };
+
+    // Read the next piece of the stream into the buffer and give it to Lua.
+    const char* StreamReader(lua_State* lua, void* data, size_t* size) {
+        const auto state = (StreamReaderState*)data;
+        for (;;) {
+            const auto amount = read(state->fd, state->buffer.data(), state->buffer.size());
+            if (amount > 0) {
+                *size = (size_t)amount;
+                return state->buffer.data();
+            } else if (amount == 0) {
+                return NULL;
+            } else if (errno != EINTR) {
+                state->failed = true;
+                state->error = errno;
+                return NULL;
+            }
+        }
+    }
+
+    // Load a chunk from a file descriptor, reading it a buffer at a time.
+    // This works for pipes, sockets, and anything else which can't be mapped
+    // into memory, using a fixed amount of memory however long the chunk is.
+    int LoadStream(
+        lua_State* lua,
+        int fd,
+        const char* chunkName,
+        const char* mode,
+        size_t bufferSize = DEFAULT_STREAM_BUFFER_SIZE
+    ) {
+        StreamReaderState state;
+        state.fd = fd;
+        state.buffer.resize(bufferSize);
+        const auto loadResult = lua_load(lua, StreamReader, &state, chunkName, mode);
+        if (state.failed) {
+            lua_pop(lua, 1);
+            errno = state.error;
+            return PushFileError(lua, "read", chunkName);
+        }
+        return loadResult;
+    }
+
+    // This is the way chunks were loaded before: read the whole file into
+    // a string, and give that to Lua in one piece.  It's only here to compare
+    // against.
+    struct LuaReaderState {
+        const std::string* chunk = nullptr;
+        bool read = false;
+    };
+
+    const char* LuaReader(lua_State* lua, void* data, size_t* size) {
+        LuaReaderState* state = (LuaReaderState*)data;
+        if (state->read) {
+            return NULL;
+        } else {
+            state->read = true;
+            *size = state->chunk->length();
+            return state->chunk->c_str();
+        }
+    }
+
+    int LoadWholeFile(lua_State* lua, const char* path, const char* chunkName, const char* mode) {
+        const auto file = fopen(path, "rb");
+        if (file == NULL) {
+            return PushFileError(lua, "open", chunkName);
+        }
+        std::string contents;
+        char buffer[65536];
+        size_t amount;
+        while ((amount = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            contents.append(buffer, amount);
+        }
+        (void)fclose(file);
+        LuaReaderState luaReaderState;
+        luaReaderState.chunk = &contents;
+        return lua_load(lua, LuaReader, &luaReaderState, chunkName, mode);
+    }
+
+    // Write a large generated script to the given file, returning how many
+    // lines it counts up to when run.
+    lua_Integer GenerateScript(FILE* file, size_t targetBytes) {
+        const char* const line = "count = count + 1 -- this line was generated to make the script larger\n";
+        const auto lineLength = strlen(line);
+        (void)fputs("local count = 0\n", file);
+        lua_Integer lines = 0;
+        for (size_t written = 0; written < targetBytes; written += lineLength) {
+            (void)fputs(line, file);
+            ++lines;
+        }
+        (void)fputs("return count\n", file);
+        return lines;
+    }
+
+    enum class LoadMethod {
+        WholeFile,
+        MappedFile,
+        StreamFile,
+        StreamPipe,
+    };
+
+    // Load and run the script at the given path using the given method,
+    // returning how long the load took, in milliseconds, or a negative
+    // number if something went wrong.
+    double LoadAndRun(LoadMethod method, const char* path, lua_Integer expectedCount) {
+        const auto lua = luaL_newstate();
+        luaL_openlibs(lua);
+        const auto chunkName = std::string("@") + path;
+        const auto start = std::chrono::steady_clock::now();
+        int loadResult = LUA_ERRFILE;
+        switch (method) {
+            case LoadMethod::WholeFile: {
+                loadResult = LoadWholeFile(lua, path, chunkName.c_str(), "t");
+            } break;
+
+            case LoadMethod::MappedFile: {
+                loadResult = LoadMappedFile(lua, path, chunkName.c_str(), "t");
+            } break;
+
+            case LoadMethod::StreamFile: {
+                const auto fd = open(path, O_RDONLY | O_CLOEXEC);
+                loadResult = LoadStream(lua, fd, chunkName.c_str(), "t");
+                (void)close(fd);
+            } break;
+
+            case LoadMethod::StreamPipe: {
+                const auto command = std::string("cat '") + path + "'";
+                const auto pipe = popen(command.c_str(), "r");
+                loadResult = LoadStream(lua, fileno(pipe), "=pipe", "t");
+                (void)pclose(pipe);
+            } break;
+        }
+        const auto end = std::chrono::steady_clock::now();
+        auto milliseconds = std::chrono::duration< double, std::milli >(end - start).count();
+        if (loadResult != LUA_OK) {
+            (void)fprintf(stderr, "Load failed: %s\n", lua_tostring(lua, -1));
+            milliseconds = -1.0;
+        } else if (
+            (lua_pcall(lua, 0, 1, 0) != LUA_OK)
+            || (lua_tointeger(lua, -1) != expectedCount)
+        ) {
+            (void)fprintf(stderr, "Script didn't run correctly\n");
+            milliseconds = -1.0;
+        }
+        lua_close(lua);
+        return milliseconds;
+    }
+
+    // Measure loading the script at the given path with the given method,
+    // in a child process, so that the peak memory use of each method can be
+    // measured separately.
+    void MeasureLoad(
+        const char* what,
+        LoadMethod method,
+        const char* path,
+        lua_Integer expectedCount
+    ) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            return;
+        }
+        (void)fflush(stdout);
+        const auto child = fork();
+        if (child == 0) {
+            (void)close(fds[0]);
+            const auto milliseconds = LoadAndRun(method, path, expectedCount);
+            (void)write(fds[1], &milliseconds, sizeof(milliseconds));
+            _exit(0);
+        }
+        (void)close(fds[1]);
+        double milliseconds = -1.0;
+        (void)read(fds[0], &milliseconds, sizeof(milliseconds));
+        (void)close(fds[0]);
+        int status;
+        struct rusage usage;
+        (void)wait4(child, &status, 0, &usage);
+        if (milliseconds < 0.0) {
+            (void)printf("%-24s failed\n", what);
+        } else {
+            (void)printf(
+                "%-24s load %8.1f ms, peak RSS %7.1f MB\n",
+                what,
+                milliseconds,
+                usage.ru_maxrss / 1024.0
+            );
+        }
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Generate a large script to load.
+    char path[] = "/tmp/Example12-XXXXXX";
+    const auto fd = mkstemp(path);
+    if (fd < 0) {
+        (void)fprintf(stderr, "Unable to create temporary file\n");
+        return EXIT_FAILURE;
+    }
+    const auto file = fdopen(fd, "w");
+    const auto expectedCount = GenerateScript(file, 120 * 1024 * 1024);
+    (void)fclose(file);
+    struct stat info;
+    (void)stat(path, &info);
+    (void)printf("Generated a %.1f MB script.\n", info.st_size / (1024.0 * 1024.0));
+
+    // Show that asking for bytecode only refuses to load source text.
+    const auto lua = luaL_newstate();
+    if (LoadMappedFile(lua, path, "=generated", "b") != LUA_OK) {
+        (void)printf("Loading the script as bytecode fails: %s\n", lua_tostring(lua, -1));
+    }
+    lua_close(lua);
+
+    // Load it each way, measuring how long it takes and how much memory
+    // is used.
+    MeasureLoad("Read into a string", LoadMethod::WholeFile, path, expectedCount);
+    MeasureLoad("Memory-mapped", LoadMethod::MappedFile, path, expectedCount);
+    MeasureLoad("Streamed from the file", LoadMethod::StreamFile, path, expectedCount);
+    MeasureLoad("Streamed from a pipe", LoadMethod::StreamPipe, path, expectedCount);
+
+    // Clean up.
+    (void)unlink(path);
+
+    // All done!
+    return EXIT_SUCCESS;
+}
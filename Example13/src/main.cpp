@@ -0,0 +1,336 @@
+#include <chrono>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // These are the Lua standard libraries, with the names of the global
+    // variables holding them and the functions which open them.
+    struct StandardLibrary {
+        const char* name;
+        lua_CFunction open;
+    };
+
+    const StandardLibrary STANDARD_LIBRARIES[] = {
+        {"_G", luaopen_base},
+        {LUA_LOADLIBNAME, luaopen_package},
+        {LUA_COLIBNAME, luaopen_coroutine},
+        {LUA_TABLIBNAME, luaopen_table},
+        {LUA_IOLIBNAME, luaopen_io},
+        {LUA_OSLIBNAME, luaopen_os},
+        {LUA_STRLIBNAME, luaopen_string},
+        {LUA_MATHLIBNAME, luaopen_math},
+        {LUA_UTF8LIBNAME, luaopen_utf8},
+        {LUA_DBLIBNAME, luaopen_debug},
+    };
+
+    const size_t NUM_STANDARD_LIBRARIES = sizeof(STANDARD_LIBRARIES) / sizeof(STANDARD_LIBRARIES[0]);
+
+    // This is the position of the string library in the list above.
+    const size_t STRING_LIBRARY = 6;
+
+    // Open the standard library at the given position in the list of
+    // standard libraries, unless it's already open, leaving it on the top
+    // of the Lua stack.
+    void RequireLibrary(lua_State* lua, size_t library) {
+        luaL_requiref(lua, STANDARD_LIBRARIES[library].name, STANDARD_LIBRARIES[library].open, 1);
+    }
+
+    // This is the position of the package library in the list above.
+    const size_t PACKAGE_LIBRARY = 1;
+
+    // Let `require` open the libraries in the given bit mask, by adding them
+    // to `package.preload`, using the package library at the top of the Lua
+    // stack.
+    void AddLibrariesToPreload(lua_State* lua, lua_Unsigned libraries) {
+        (void)lua_getfield(lua, -1, "preload");
+        for (size_t i = 0; i < NUM_STANDARD_LIBRARIES; ++i) {
+            if ((libraries & ((lua_Unsigned)1 << i)) != 0) {
+                lua_pushcfunction(lua, STANDARD_LIBRARIES[i].open);
+                lua_setfield(lua, -2, STANDARD_LIBRARIES[i].name);
+            }
+        }
+        lua_pop(lua, 1);
+    }
+
+    // This is the `__index` metamethod of the global table in a Lua instance
+    // with libraries set to open lazily.  Its upvalue holds a bit mask of
+    // the libraries not opened yet.  When a script looks up a global variable
+    // which doesn't exist, and it's the name of one of those libraries, open
+    // the library (which also sets the global variable, so this isn't called
+    // again for it) and return it.
+    int OpenLibraryOnAccess(lua_State* lua) {
+        auto pending = (lua_Unsigned)lua_tointeger(lua, lua_upvalueindex(1));
+        const auto name = lua_tostring(lua, 2);
+        if ((pending != 0) && (name != NULL)) {
+            // The package library also defines the global `require` function,
+            // so looking that up opens the package library too.
+            const auto isRequire = (strcmp(name, "require") == 0);
+            for (size_t i = 0; i < NUM_STANDARD_LIBRARIES; ++i) {
+                if (
+                    ((pending & ((lua_Unsigned)1 << i)) != 0)
+                    && (
+                        (strcmp(name, STANDARD_LIBRARIES[i].name) == 0)
+                        || (isRequire && (i == PACKAGE_LIBRARY))
+                    )
+                ) {
+                    pending &= ~((lua_Unsigned)1 << i);
+                    lua_pushinteger(lua, (lua_Integer)pending);
+                    lua_replace(lua, lua_upvalueindex(1));
+                    RequireLibrary(lua, i);
+                    if (i == PACKAGE_LIBRARY) {
+                        AddLibrariesToPreload(lua, pending);
+                    }
+                    if (isRequire) {
+                        lua_pop(lua, 1);
+                        (void)lua_rawget(lua, 1);
+                    }
+                    return 1;
+                }
+            }
+        }
+        lua_pushnil(lua);
+        return 1;
+    }
+
+    // This is the `__index` metamethod of strings in a Lua instance with the
+    // string library set to open lazily.  Scripts can call string functions
+    // as methods of strings (`("hello"):upper()`) without ever mentioning
+    // the `string` global variable, so the first time they do, open the
+    // string library, which replaces this metatable with the real one,
+    // and look up the method in it.
+    int OpenStringLibraryOnMethod(lua_State* lua) {
+        luaL_requiref(lua, LUA_STRLIBNAME, luaopen_string, 1);
+        lua_pushvalue(lua, 2);
+        (void)lua_gettable(lua, -2);
+        return 1;
+    }
+
+    // This makes Lua instances which only open the standard libraries they
+    // need.
+    //
+    // `luaL_openlibs` opens every standard library, building all of their
+    // tables, even though many scripts use only one or two of them.  For
+    // programs which make lots of short-lived Lua instances, that's wasted
+    // time and memory.  Instead, each factory is given a manifest listing
+    // the libraries to open right away, and the libraries to open only if
+    // and when a script uses them.  Libraries in neither list aren't
+    // available at all, which is also handy for sandboxing scripts.
+    //
+    // Libraries opened lazily are opened the first time a script refers to
+    // the global variable named after the library, or, if the `package`
+    // library is available, when the script calls `require` with the name
+    // of the library.
+    class StateFactory {
+    public:
+        struct Manifest {
+            // These are the names of libraries to open when making each
+            // Lua instance.  The base library ("_G") is needed by almost
+            // every script.
+            std::vector< std::string > eager;
+
+            // These are the names of libraries to open the first time
+            // a script uses them.
+            std::vector< std::string > lazy;
+        };
+
+        explicit StateFactory(const Manifest& manifest)
+            : eager_(ResolveLibraries(manifest.eager))
+            , lazy_(ResolveLibraries(manifest.lazy) & ~eager_)
+        {
+        }
+
+        // Make a new Lua instance, opening the libraries given in the
+        // manifest.
+        lua_State* Create() const {
+            const auto lua = luaL_newstate();
+            lua_gc(lua, LUA_GCSTOP, 0);
+            for (size_t i = 0; i < NUM_STANDARD_LIBRARIES; ++i) {
+                if ((eager_ & ((lua_Unsigned)1 << i)) != 0) {
+                    RequireLibrary(lua, i);
+                    lua_pop(lua, 1);
+                }
+            }
+            if (lazy_ != 0) {
+                SetUpLazyLibraries(lua);
+            }
+            lua_gc(lua, LUA_GCRESTART, 0);
+            return lua;
+        }
+
+    private:
+        static lua_Unsigned ResolveLibraries(const std::vector< std::string >& names) {
+            lua_Unsigned libraries = 0;
+            for (const auto& name: names) {
+                size_t i = 0;
+                while (
+                    (i < NUM_STANDARD_LIBRARIES)
+                    && (name != STANDARD_LIBRARIES[i].name)
+                ) {
+                    ++i;
+                }
+                if (i < NUM_STANDARD_LIBRARIES) {
+                    libraries |= ((lua_Unsigned)1 << i);
+                } else {
+                    (void)fprintf(stderr, "Unknown standard library '%s'\n", name.c_str());
+                }
+            }
+            return libraries;
+        }
+
+        void SetUpLazyLibraries(lua_State* lua) const {
+            // Give the global table a metatable which opens libraries when
+            // their global variables are first looked up.
+            lua_pushglobaltable(lua);
+            lua_createtable(lua, 0, 1);
+            lua_pushinteger(lua, (lua_Integer)lazy_);
+            lua_pushcclosure(lua, OpenLibraryOnAccess, 1);
+            lua_setfield(lua, -2, "__index");
+            lua_setmetatable(lua, -2);
+            lua_pop(lua, 1);
+
+            // If `require` is available, let it open the libraries too.
+            // If the package library is itself opened lazily, this is done
+            // when it's opened.
+            if ((eager_ & ((lua_Unsigned)1 << PACKAGE_LIBRARY)) != 0) {
+                (void)lua_getglobal(lua, LUA_LOADLIBNAME);
+                AddLibrariesToPreload(lua, lazy_);
+                lua_pop(lua, 1);
+            }
+
+            // Let strings find their methods before the string library
+            // is opened.
+            if ((lazy_ & ((lua_Unsigned)1 << STRING_LIBRARY)) != 0) {
+                lua_pushliteral(lua, "");
+                lua_createtable(lua, 0, 1);
+                lua_pushcfunction(lua, OpenStringLibraryOnMethod);
+                lua_setfield(lua, -2, "__index");
+                (void)lua_setmetatable(lua, -2);
+                lua_pop(lua, 1);
+            }
+        }
+
+        const lua_Unsigned eager_;
+        const lua_Unsigned lazy_;
+    };
+
+    // This is a typical short script which only needs the base, `math`,
+    // and `string` libraries.
+    const char* const SANDBOXED_SCRIPT = R"lua(
+        local total = 0
+        for i = 1, 10 do
+            total = total + math.floor(math.sqrt(i * 100))
+        end
+        return ("total=%d"):format(total)
+    )lua";
+
+    size_t GetBytesInUse(lua_State* lua) {
+        return (
+            (size_t)lua_gc(lua, LUA_GCCOUNT, 0) * 1024
+            + (size_t)lua_gc(lua, LUA_GCCOUNTB, 0)
+        );
+    }
+
+    lua_State* CreateWithAllLibraries() {
+        const auto lua = luaL_newstate();
+        lua_gc(lua, LUA_GCSTOP, 0);
+        luaL_openlibs(lua);
+        lua_gc(lua, LUA_GCRESTART, 0);
+        return lua;
+    }
+
+    // Measure making and destroying many Lua instances in the given way,
+    // optionally running the sandboxed script in each one.
+    template< typename Create > void MeasureCreation(
+        const char* what,
+        Create create,
+        bool runScript
+    ) {
+        const int numStates = 20000;
+        size_t bytes = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < numStates; ++i) {
+            const auto lua = create();
+            if (runScript) {
+                (void)luaL_loadstring(lua, SANDBOXED_SCRIPT);
+                lua_call(lua, 0, 1);
+                lua_pop(lua, 1);
+            }
+            bytes = GetBytesInUse(lua);
+            lua_close(lua);
+        }
+        const auto end = std::chrono::steady_clock::now();
+        (void)printf(
+            "%-36s %7.2f us/state %7.1f KB/state\n",
+            what,
+            std::chrono::duration< double, std::micro >(end - start).count() / numStates,
+            bytes / 1024.0
+        );
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Make a factory for Lua instances which opens the base library right
+    // away, and the `math`, `string`, and `io` libraries only when scripts
+    // use them.  No other libraries are available.
+    StateFactory::Manifest manifest;
+    manifest.eager = {"_G"};
+    manifest.lazy = {LUA_MATHLIBNAME, LUA_STRLIBNAME, LUA_IOLIBNAME};
+    const StateFactory factory(manifest);
+
+    // Create the Lua instance.
+    const auto lua = factory.Create();
+
+    // Run a script which uses libraries opened lazily, and one which tries
+    // to use a library which isn't available.
+    (void)luaL_dostring(lua, R"lua(
+        print("Before: math is " .. type(rawget(_G, "math")) .. ", io is " .. type(rawget(_G, "io")))
+        print(("The square root of 2 is %.4f"):format(math.sqrt(2)))
+        print("After: math is " .. type(rawget(_G, "math")) .. ", io is " .. type(rawget(_G, "io")))
+        print("os is " .. type(os))
+    )lua");
+
+    // Destroy the Lua instance.
+    lua_close(lua);
+
+    // Compare making Lua instances with every library against making them
+    // with only the libraries needed, opened right away or lazily.
+    StateFactory::Manifest sandboxManifest;
+    sandboxManifest.eager = {"_G", LUA_MATHLIBNAME, LUA_STRLIBNAME};
+    const StateFactory sandboxFactory(sandboxManifest);
+    StateFactory::Manifest lazyManifest;
+    lazyManifest.eager = {"_G"};
+    lazyManifest.lazy = {
+        LUA_LOADLIBNAME, LUA_COLIBNAME, LUA_TABLIBNAME, LUA_IOLIBNAME, LUA_OSLIBNAME,
+        LUA_STRLIBNAME, LUA_MATHLIBNAME, LUA_UTF8LIBNAME, LUA_DBLIBNAME
+    };
+    const StateFactory lazyFactory(lazyManifest);
+    for (int runScript = 0; runScript < 2; ++runScript) {
+        (void)printf(runScript ? "Creating and running a script:\n" : "Creating only:\n");
+        MeasureCreation("  luaL_openlibs", CreateWithAllLibraries, runScript != 0);
+        MeasureCreation(
+            "  base, math, string",
+            [&sandboxFactory]{ return sandboxFactory.Create(); },
+            runScript != 0
+        );
+        MeasureCreation(
+            "  base, everything else lazily",
+            [&lazyFactory]{ return lazyFactory.Create(); },
+            runScript != 0
+        );
+    }
+
+    // All done!
+    return EXIT_SUCCESS;
+}
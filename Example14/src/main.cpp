@@ -0,0 +1,422 @@
+#include <chrono>
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "EmbeddedLuaScripts.h"
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // These say how to convert between each type of C++ element and a Lua
+    // value.  `To` returns false, rather than converting, if the Lua value
+    // isn't of the matching type; in particular, numbers aren't turned into
+    // strings, since `lua_tolstring` would change a key in the middle of
+    // a `lua_next` traversal.
+    template< typename T > struct TableElement;
+
+    template<> struct TableElement< double > {
+        static void Push(lua_State* lua, double value) {
+            lua_pushnumber(lua, value);
+        }
+
+        static bool To(lua_State* lua, int index, double& value) {
+            int isNumber;
+            value = lua_tonumberx(lua, index, &isNumber);
+            return (isNumber != 0);
+        }
+    };
+
+    template<> struct TableElement< int64_t > {
+        static void Push(lua_State* lua, int64_t value) {
+            lua_pushinteger(lua, (lua_Integer)value);
+        }
+
+        static bool To(lua_State* lua, int index, int64_t& value) {
+            int isInteger;
+            value = (int64_t)lua_tointegerx(lua, index, &isInteger);
+            return (isInteger != 0);
+        }
+    };
+
+    template<> struct TableElement< std::string > {
+        static void Push(lua_State* lua, const std::string& value) {
+            (void)lua_pushlstring(lua, value.data(), value.length());
+        }
+
+        static bool To(lua_State* lua, int index, std::string& value) {
+            if (lua_type(lua, index) != LUA_TSTRING) {
+                return false;
+            }
+            size_t length;
+            const auto chars = lua_tolstring(lua, index, &length);
+            value.assign(chars, length);
+            return true;
+        }
+    };
+
+    // Copy the elements of the sequence table at the given index of the Lua
+    // stack, from 1 up to its length as given by the `#` operator, into the
+    // given vector.  Any other keys in the table are ignored.  Return false
+    // (leaving the vector with whatever was copied so far) if any element
+    // isn't of the vector's element type.
+    //
+    // The vector is sized once, and each element is read with `lua_rawgeti`,
+    // which for a sequence is a direct read of the table's "array part",
+    // skipping metamethods and never looking in the "hash part".
+    template< typename T > bool ToVector(lua_State* lua, int index, std::vector< T >& values) {
+        index = lua_absindex(lua, index);
+        const auto length = (lua_Integer)lua_rawlen(lua, index);
+        values.resize((size_t)length);
+        for (lua_Integer i = 1; i <= length; ++i) {
+            (void)lua_rawgeti(lua, index, i);
+            const auto converted = TableElement< T >::To(lua, -1, values[(size_t)(i - 1)]);
+            lua_pop(lua, 1);
+            if (!converted) {
+                values.resize((size_t)(i - 1));
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Copy every key and value of the table at the given index of the Lua
+    // stack into the given map, returning false if any key or value isn't
+    // of the map's key or value type.
+    //
+    // The table is traversed with `lua_next`, which visits the array part and
+    // then the hash part, each in storage order, so no key is ever looked up.
+    template< typename K, typename V > bool ToMap(lua_State* lua, int index, std::map< K, V >& values) {
+        index = lua_absindex(lua, index);
+        values.clear();
+        lua_pushnil(lua);
+        while (lua_next(lua, index) != 0) {
+            K key;
+            V value;
+            if (
+                !TableElement< K >::To(lua, -2, key)
+                || !TableElement< V >::To(lua, -1, value)
+            ) {
+                lua_pop(lua, 2);
+                return false;
+            }
+            values.emplace(std::move(key), std::move(value));
+            lua_pop(lua, 1);
+        }
+        return true;
+    }
+
+    // Push onto the Lua stack a new sequence table holding the elements of
+    // the given vector.
+    //
+    // The table is made with `lua_createtable`, giving the number of
+    // elements in advance, so that it allocates its array part only once,
+    // rather than growing it (and moving every element) over and over.
+    template< typename T > void PushVector(lua_State* lua, const std::vector< T >& values) {
+        lua_createtable(lua, (int)values.size(), 0);
+        for (size_t i = 0; i < values.size(); ++i) {
+            TableElement< T >::Push(lua, values[i]);
+            lua_rawseti(lua, -2, (lua_Integer)(i + 1));
+        }
+    }
+
+    // Push onto the Lua stack a new table holding the keys and values of
+    // the given map, with its hash part sized for them in advance.
+    template< typename K, typename V > void PushMap(lua_State* lua, const std::map< K, V >& values) {
+        lua_createtable(lua, 0, (int)values.size());
+        for (const auto& entry: values) {
+            TableElement< K >::Push(lua, entry.first);
+            TableElement< V >::Push(lua, entry.second);
+            lua_rawset(lua, -3);
+        }
+    }
+
+    // These are how a table would be converted one element at a time, going
+    // through `lua_gettable` and `lua_settable`, and without sizing the table
+    // in advance.  They're only here to measure the difference.
+    template< typename T > bool ToVectorOneByOne(lua_State* lua, int index, std::vector< T >& values) {
+        index = lua_absindex(lua, index);
+        values.clear();
+        const auto length = luaL_len(lua, index);
+        for (lua_Integer i = 1; i <= length; ++i) {
+            lua_pushinteger(lua, i);
+            (void)lua_gettable(lua, index);
+            T value;
+            const auto converted = TableElement< T >::To(lua, -1, value);
+            lua_pop(lua, 1);
+            if (!converted) {
+                return false;
+            }
+            values.push_back(value);
+        }
+        return true;
+    }
+
+    template< typename T > void PushVectorOneByOne(lua_State* lua, const std::vector< T >& values) {
+        lua_newtable(lua);
+        for (size_t i = 0; i < values.size(); ++i) {
+            lua_pushinteger(lua, (lua_Integer)(i + 1));
+            TableElement< T >::Push(lua, values[i]);
+            lua_settable(lua, -3);
+        }
+    }
+
+    template< typename K, typename V > bool ToMapOneByOne(lua_State* lua, int index, std::map< K, V >& values) {
+        index = lua_absindex(lua, index);
+        values.clear();
+        lua_pushnil(lua);
+        while (lua_next(lua, index) != 0) {
+            K key;
+            V value;
+            lua_pushvalue(lua, -2);
+            (void)lua_gettable(lua, index);
+            if (
+                !TableElement< K >::To(lua, -3, key)
+                || !TableElement< V >::To(lua, -1, value)
+            ) {
+                lua_pop(lua, 3);
+                return false;
+            }
+            values[key] = value;
+            lua_pop(lua, 2);
+        }
+        return true;
+    }
+
+    template< typename K, typename V > void PushMapOneByOne(lua_State* lua, const std::map< K, V >& values) {
+        lua_newtable(lua);
+        for (const auto& entry: values) {
+            TableElement< K >::Push(lua, entry.first);
+            TableElement< V >::Push(lua, entry.second);
+            lua_settable(lua, -3);
+        }
+    }
+
+    // Load the named script embedded in the program at build time and run
+    // it.
+    bool RunEmbeddedScript(lua_State* lua, const char* name) {
+        for (size_t i = 0; i < NUM_EMBEDDED_LUA_SCRIPTS; ++i) {
+            const auto& script = EMBEDDED_LUA_SCRIPTS[i];
+            if (std::string(script.name) == name) {
+                if (
+                    (luaL_loadbufferx(lua, (const char*)script.bytecode, script.size, name, "b") != LUA_OK)
+                    || (lua_pcall(lua, 0, 0, 0) != LUA_OK)
+                ) {
+                    (void)fprintf(stderr, "Script '%s' failed: %s\n", name, lua_tostring(lua, -1));
+                    lua_pop(lua, 1);
+                    return false;
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    double MillionsPerSecond(
+        size_t count,
+        std::chrono::steady_clock::time_point start,
+        std::chrono::steady_clock::time_point end
+    ) {
+        return (double)count / std::chrono::duration< double, std::micro >(end - start).count();
+    }
+
+    // Measure how many elements per second are copied from a sequence table
+    // into a vector of numbers, and back into a new table, one element at
+    // a time and in bulk.  Each conversion is repeated until it has copied
+    // at least `minElements` elements, so small tables are timed over many
+    // conversions.
+    template< typename T > void MeasureSequences(lua_State* lua, const char* what, size_t count) {
+        const size_t minElements = 10000000;
+        const auto repeats = (minElements + count - 1) / count;
+        std::vector< T > values(count);
+        for (size_t i = 0; i < count; ++i) {
+            values[i] = (T)(i * 3 + 1);
+        }
+        PushVector(lua, values);
+        double toVector[2];
+        double pushVector[2];
+        for (int bulk = 0; bulk < 2; ++bulk) {
+            std::vector< T > copy;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t repeat = 0; repeat < repeats; ++repeat) {
+                const auto converted = (
+                    bulk
+                    ? ToVector(lua, -1, copy)
+                    : ToVectorOneByOne(lua, -1, copy)
+                );
+                if (!converted || (copy.size() != count)) {
+                    (void)fprintf(stderr, "Conversion failed\n");
+                }
+            }
+            auto end = std::chrono::steady_clock::now();
+            toVector[bulk] = MillionsPerSecond(count * repeats, start, end);
+            start = std::chrono::steady_clock::now();
+            for (size_t repeat = 0; repeat < repeats; ++repeat) {
+                if (bulk) {
+                    PushVector(lua, copy);
+                } else {
+                    PushVectorOneByOne(lua, copy);
+                }
+                lua_pop(lua, 1);
+            }
+            end = std::chrono::steady_clock::now();
+            pushVector[bulk] = MillionsPerSecond(count * repeats, start, end);
+        }
+        lua_pop(lua, 1);
+        lua_gc(lua, LUA_GCCOLLECT, 0);
+        (void)printf(
+            "%-8s %9zu %12.1f %12.1f %12.1f %12.1f\n",
+            what,
+            count,
+            toVector[0],
+            toVector[1],
+            pushVector[0],
+            pushVector[1]
+        );
+    }
+
+    // Measure the same for a table with string keys and a map.
+    void MeasureMaps(lua_State* lua, size_t count) {
+        const size_t minElements = 2000000;
+        const auto repeats = (minElements + count - 1) / count;
+        std::map< std::string, int64_t > values;
+        for (size_t i = 0; i < count; ++i) {
+            values.emplace("key" + std::to_string(i), (int64_t)i);
+        }
+        PushMap(lua, values);
+        double toMap[2];
+        double pushMap[2];
+        for (int bulk = 0; bulk < 2; ++bulk) {
+            std::map< std::string, int64_t > copy;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t repeat = 0; repeat < repeats; ++repeat) {
+                const auto converted = (
+                    bulk
+                    ? ToMap(lua, -1, copy)
+                    : ToMapOneByOne(lua, -1, copy)
+                );
+                if (!converted || (copy.size() != count)) {
+                    (void)fprintf(stderr, "Conversion failed\n");
+                }
+            }
+            auto end = std::chrono::steady_clock::now();
+            toMap[bulk] = MillionsPerSecond(count * repeats, start, end);
+            start = std::chrono::steady_clock::now();
+            for (size_t repeat = 0; repeat < repeats; ++repeat) {
+                if (bulk) {
+                    PushMap(lua, copy);
+                } else {
+                    PushMapOneByOne(lua, copy);
+                }
+                lua_pop(lua, 1);
+            }
+            end = std::chrono::steady_clock::now();
+            pushMap[bulk] = MillionsPerSecond(count * repeats, start, end);
+        }
+        lua_pop(lua, 1);
+        lua_gc(lua, LUA_GCCOLLECT, 0);
+        (void)printf(
+            "%-8s %9zu %12.1f %12.1f %12.1f %12.1f\n",
+            "map",
+            count,
+            toMap[0],
+            toMap[1],
+            pushMap[0],
+            pushMap[1]
+        );
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Create the Lua instance.
+    const auto lua = luaL_newstate();
+
+    // Load standard Lua libraries.
+    //
+    // Temporarily disable the garbage collector as we load the
+    // libraries, to improve performance
+    // (http://lua-users.org/lists/lua-l/2008-07/msg00690.html).
+    lua_gc(lua, LUA_GCSTOP, 0);
+    luaL_openlibs(lua);
+    lua_gc(lua, LUA_GCRESTART, 0);
+
+    // Run the example script, and pull the tables it makes into C++.
+    if (RunEmbeddedScript(lua, "example")) {
+        (void)lua_getglobal(lua, "primes");
+        std::vector< int64_t > primes;
+        if (ToVector(lua, -1, primes)) {
+            (void)printf("The primes in C++:");
+            for (const auto prime: primes) {
+                (void)printf(" %lld", (long long)prime);
+            }
+            (void)printf("\n");
+        }
+        lua_pop(lua, 1);
+
+        // The record table has a number and a table among its keys, so it
+        // can't be copied into a map with string keys.
+        (void)lua_getglobal(lua, "record");
+        std::map< std::string, std::string > record;
+        if (!ToMap(lua, -1, record)) {
+            (void)printf("The record doesn't fit in a map of strings to strings.\n");
+        }
+        lua_pop(lua, 1);
+    }
+
+    // Copy a map into Lua, let a script change it, and copy it back.
+    std::map< std::string, int64_t > scores;
+    scores["alice"] = 3;
+    scores["bob"] = 5;
+    PushMap(lua, scores);
+    lua_setglobal(lua, "scores");
+    (void)luaL_dostring(lua, R"lua(
+        scores.alice = scores.alice + 10
+        scores.carol = 7
+    )lua");
+    (void)lua_getglobal(lua, "scores");
+    if (ToMap(lua, -1, scores)) {
+        for (const auto& score: scores) {
+            (void)printf("%s scored %lld.\n", score.first.c_str(), (long long)score.second);
+        }
+    }
+    lua_pop(lua, 1);
+
+    // Compare converting tables one element at a time and in bulk, in
+    // millions of elements per second.
+    (void)printf(
+        "%-8s %9s %12s %12s %12s %12s\n",
+        "",
+        "elements",
+        "to C++",
+        "bulk",
+        "to Lua",
+        "bulk"
+    );
+    const size_t counts[] = {1000, 1000000, 10000000};
+    for (const auto count: counts) {
+        MeasureSequences< double >(lua, "double", count);
+        MeasureSequences< int64_t >(lua, "int64_t", count);
+    }
+
+    // Maps of ten million strings would take gigabytes, so stop maps at
+    // a million.
+    for (size_t count = 1000; count <= 1000000; count *= 1000) {
+        MeasureMaps(lua, count);
+    }
+
+    // Destroy the Lua instance.
+    lua_close(lua);
+
+    // All done!
+    return EXIT_SUCCESS;
+}
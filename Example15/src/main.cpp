@@ -0,0 +1,475 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // This runs a "map" function and a "reduce" function, written in Lua,
+    // over a dataset of numbers on several threads at once.
+    //
+    // A Lua instance can only be used by one thread at a time, so each worker
+    // thread gets a Lua instance of its own, into which the two functions are
+    // loaded once, when the executor is constructed.
+    //
+    // To run a job, the dataset is split into "shards" of consecutive
+    // elements, and each worker starts with an equal share of the shards.
+    // Each worker maps every element of a shard and reduces the mapped
+    // values into a partial result for the shard.  The partial results of
+    // all the shards are then merged in C++, in shard order, so the result
+    // doesn't depend on which worker ran which shard.
+    //
+    // Some shards can take much longer than others, so a worker which runs
+    // out of shards "steals" from another worker: it takes the back half of
+    // the shards the other worker hasn't started yet.  Each worker takes its
+    // own shards from the front, so the two only meet when a worker's shards
+    // are nearly gone, keeping the lock on each worker's shards uncontended
+    // almost all the time.
+    class MapReduce {
+    public:
+        struct Options {
+            // This is the number of worker threads (and Lua instances),
+            // or zero for one per CPU core.
+            size_t numWorkers = 0;
+
+            // This is the number of elements in each shard.
+            size_t shardSize = 1024;
+
+            // This selects whether or not workers which run out of shards
+            // take shards from other workers.
+            bool workStealing = true;
+        };
+
+        // These are counters about the last job run.
+        struct Counters {
+            size_t shards = 0;
+            size_t steals = 0;
+            size_t shardsStolen = 0;
+        };
+
+        // Make the executor, loading the given scripts into each worker's
+        // Lua instance.  Each script is a chunk which returns a function.
+        // The map function is called with each element and returns a number.
+        // The reduce function is called with the partial result so far and
+        // a mapped value, and returns the new partial result.
+        MapReduce(
+            const char* mapScript,
+            const char* reduceScript,
+            const Options& options
+        )
+            : options_(options)
+        {
+            if (options_.numWorkers == 0) {
+                options_.numWorkers = std::max(std::thread::hardware_concurrency(), 1u);
+            }
+            options_.shardSize = std::max(options_.shardSize, (size_t)1);
+            for (size_t i = 0; i < options_.numWorkers; ++i) {
+                std::unique_ptr< Worker > worker(new Worker());
+                worker->lua = luaL_newstate();
+                lua_gc(worker->lua, LUA_GCSTOP, 0);
+                luaL_openlibs(worker->lua);
+                lua_gc(worker->lua, LUA_GCRESTART, 0);
+                if (
+                    !LoadFunction(worker->lua, mapScript, "=map")
+                    || !LoadFunction(worker->lua, reduceScript, "=reduce")
+                ) {
+                    ok_ = false;
+                }
+                workers_.push_back(std::move(worker));
+            }
+        }
+
+        ~MapReduce() {
+            for (const auto& worker: workers_) {
+                lua_close(worker->lua);
+            }
+        }
+
+        MapReduce(const MapReduce&) = delete;
+        MapReduce& operator=(const MapReduce&) = delete;
+
+        // Return whether or not both scripts loaded in every Lua instance.
+        bool IsOk() const {
+            return ok_;
+        }
+
+        size_t NumWorkers() const {
+            return workers_.size();
+        }
+
+        // Map and reduce the given elements, starting each shard's partial
+        // result at `initial`, which should be the value that changes nothing
+        // when reduced (such as zero for a sum), since it's also where the
+        // merge starts.  Merge the partial results of the shards,
+        // in order, with the given C++ function, which must combine two
+        // partial results the same way the Lua reduce function combines
+        // a partial result with a mapped value.
+        //
+        // Return false, with the first error raised by the Lua functions in
+        // `error`, if a Lua function failed.
+        template< typename Merge > bool Run(
+            const std::vector< double >& elements,
+            double initial,
+            Merge merge,
+            double& result,
+            std::string& error
+        ) {
+            if (!ok_) {
+                error = "scripts not loaded";
+                return false;
+            }
+
+            // Split the elements into shards, and give each worker an equal
+            // share of consecutive shards.
+            job_.elements = &elements;
+            job_.initial = initial;
+            const auto numShards = (elements.size() + options_.shardSize - 1) / options_.shardSize;
+            job_.partials.assign(numShards, initial);
+            job_.failed = false;
+            job_.error.clear();
+            const auto numWorkers = workers_.size();
+            for (size_t i = 0; i < numWorkers; ++i) {
+                workers_[i]->next = numShards * i / numWorkers;
+                workers_[i]->end = numShards * (i + 1) / numWorkers;
+            }
+            counters_ = Counters();
+            counters_.shards = numShards;
+
+            // Start a thread for each worker, and wait for them all to finish.
+            // Starting threads takes microseconds, while the jobs this is made
+            // for take milliseconds or more, so threads aren't kept between
+            // jobs.
+            std::vector< std::thread > threads;
+            for (size_t i = 1; i < numWorkers; ++i) {
+                threads.emplace_back([this, i]{ Work(i); });
+            }
+            Work(0);
+            for (auto& thread: threads) {
+                thread.join();
+            }
+            if (job_.failed) {
+                error = job_.error;
+                return false;
+            }
+
+            // Merge the partial results.
+            result = initial;
+            for (const auto partial: job_.partials) {
+                result = merge(result, partial);
+            }
+            return true;
+        }
+
+        Counters GetCounters() const {
+            return counters_;
+        }
+
+    private:
+        // These are the shards a worker has yet to start, numbered from
+        // `next` up to (but not including) `end`.
+        struct Worker {
+            lua_State* lua = nullptr;
+            std::mutex mutex;
+            size_t next = 0;
+            size_t end = 0;
+        };
+
+        struct Job {
+            const std::vector< double >* elements = nullptr;
+            double initial = 0.0;
+            std::vector< double > partials;
+            std::atomic< bool > failed{false};
+            std::mutex errorMutex;
+            std::string error;
+        };
+
+        struct ShardArguments {
+            const double* elements;
+            size_t count;
+            double initial;
+            double partial;
+        };
+
+        // Load a chunk which returns a function, and leave the function on
+        // the Lua stack.  The map function ends up at index 1, and the
+        // reduce function at index 2.
+        static bool LoadFunction(lua_State* lua, const char* script, const char* name) {
+            if (
+                (luaL_loadbuffer(lua, script, strlen(script), name) != LUA_OK)
+                || (lua_pcall(lua, 0, 1, 0) != LUA_OK)
+            ) {
+                (void)fprintf(stderr, "Unable to load %s: %s\n", name + 1, lua_tostring(lua, -1));
+                lua_pop(lua, 1);
+                lua_pushnil(lua);
+                return false;
+            }
+            if (lua_type(lua, -1) != LUA_TFUNCTION) {
+                (void)fprintf(stderr, "The %s script didn't return a function\n", name + 1);
+                return false;
+            }
+            return true;
+        }
+
+        // Map and reduce one shard.  This is called in protected mode, with
+        // the map function, the reduce function, and the shard's arguments
+        // (as a light userdata), so that any error raised by the Lua functions
+        // ends just this call, rather than the whole program.
+        //
+        // The same stack slots are reused for every element, and the partial
+        // result stays in C++ between calls.
+        static int RunShard(lua_State* lua) {
+            const auto shard = (ShardArguments*)lua_touserdata(lua, 3);
+            auto partial = shard->initial;
+            for (size_t i = 0; i < shard->count; ++i) {
+                lua_pushvalue(lua, 2);
+                lua_pushnumber(lua, partial);
+                lua_pushvalue(lua, 1);
+                lua_pushnumber(lua, shard->elements[i]);
+                lua_call(lua, 1, 1);
+                lua_call(lua, 2, 1);
+                int isNumber;
+                partial = lua_tonumberx(lua, -1, &isNumber);
+                if (!isNumber) {
+                    return luaL_error(lua, "reduce returned %s, not a number", luaL_typename(lua, -1));
+                }
+                lua_pop(lua, 1);
+            }
+            shard->partial = partial;
+            return 0;
+        }
+
+        // Take the next shard for the given worker, from its own shards if
+        // it has any left, or else by stealing from another worker.  Return
+        // false if there are no shards left anywhere.
+        bool TakeShard(size_t self, size_t& shard) {
+            auto& worker = *workers_[self];
+            {
+                std::lock_guard< std::mutex > lock(worker.mutex);
+                if (worker.next < worker.end) {
+                    shard = worker.next++;
+                    return true;
+                }
+            }
+            if (!options_.workStealing) {
+                return false;
+            }
+            const auto numWorkers = workers_.size();
+            for (size_t i = 1; i < numWorkers; ++i) {
+                auto& victim = *workers_[(self + i) % numWorkers];
+                size_t stolenBegin, stolenEnd;
+                {
+                    std::lock_guard< std::mutex > lock(victim.mutex);
+                    const auto remaining = victim.end - victim.next;
+                    if (remaining == 0) {
+                        continue;
+                    }
+                    stolenEnd = victim.end;
+                    stolenBegin = victim.end - (remaining + 1) / 2;
+                    victim.end = stolenBegin;
+                }
+                {
+                    std::lock_guard< std::mutex > lock(worker.mutex);
+                    worker.next = stolenBegin + 1;
+                    worker.end = stolenEnd;
+                }
+                {
+                    std::lock_guard< std::mutex > lock(countersMutex_);
+                    ++counters_.steals;
+                    counters_.shardsStolen += stolenEnd - stolenBegin;
+                }
+                shard = stolenBegin;
+                return true;
+            }
+            return false;
+        }
+
+        void Work(size_t self) {
+            const auto lua = workers_[self]->lua;
+            const auto& elements = *job_.elements;
+            size_t shard;
+            while (!job_.failed && TakeShard(self, shard)) {
+                ShardArguments arguments;
+                const auto begin = shard * options_.shardSize;
+                arguments.elements = elements.data() + begin;
+                arguments.count = std::min(options_.shardSize, elements.size() - begin);
+                arguments.initial = job_.initial;
+                lua_pushcfunction(lua, RunShard);
+                lua_pushvalue(lua, 1);
+                lua_pushvalue(lua, 2);
+                lua_pushlightuserdata(lua, &arguments);
+                if (lua_pcall(lua, 3, 0, 0) != LUA_OK) {
+                    std::lock_guard< std::mutex > lock(job_.errorMutex);
+                    if (!job_.failed) {
+                        job_.error = lua_tostring(lua, -1);
+                        job_.failed = true;
+                    }
+                    lua_pop(lua, 1);
+                    break;
+                }
+                job_.partials[shard] = arguments.partial;
+            }
+        }
+
+        Options options_;
+        std::vector< std::unique_ptr< Worker > > workers_;
+        bool ok_ = true;
+        Job job_;
+        std::mutex countersMutex_;
+        Counters counters_;
+    };
+
+    // This is like `AddAndRoundInLua` from the earlier examples: add a number
+    // to each element and round the sum to the nearest integer, with a little
+    // extra arithmetic to give each call some work to do.  The elements of the
+    // "skewed" dataset carry, in their fractional part, how much extra work
+    // they ask for.
+    const char* const MAP_SCRIPT = R"lua(
+        return function(x)
+            local work = math.floor((x % 1) * 100)
+            local y = x
+            for i = 1, 10 + work do
+                y = (y * 31 + i) % 1000003
+            end
+            return math.floor(x + 0.3 + 0.5) + y % 2
+        end
+    )lua";
+
+    const char* const REDUCE_SCRIPT = R"lua(
+        return function(sum, value)
+            return sum + value
+        end
+    )lua";
+
+    // Make a dataset of the given size.  In a uniform dataset, every element
+    // takes about the same time to map.  In a skewed dataset, the elements
+    // in the first eighth take many times longer than the rest, so without
+    // work stealing, the worker given them finishes long after the others.
+    std::vector< double > MakeDataset(size_t count, bool skewed) {
+        std::vector< double > elements(count);
+        for (size_t i = 0; i < count; ++i) {
+            elements[i] = (double)(i % 1000);
+            if (skewed && (i < count / 8)) {
+                elements[i] += 0.99;
+            }
+        }
+        return elements;
+    }
+
+    double Sum(double a, double b) {
+        return a + b;
+    }
+
+    // Run the job with 1 up to twice as many workers as there are CPU cores,
+    // and report how the time taken scales with the number of workers.
+    void MeasureScaling(const char* what, bool skewed) {
+        const auto elements = MakeDataset(2000000, skewed);
+        const auto numCores = std::max(std::thread::hardware_concurrency(), 1u);
+        (void)printf(
+            "%s dataset, %zu elements, %u CPU cores:\n",
+            what,
+            elements.size(),
+            numCores
+        );
+        (void)printf(
+            "%8s %14s %9s %14s %9s %8s\n",
+            "workers",
+            "no steal (ms)",
+            "speedup",
+            "stealing (ms)",
+            "speedup",
+            "steals"
+        );
+        double baseline[2] = {0.0, 0.0};
+        double expected = 0.0;
+        for (size_t numWorkers = 1; numWorkers <= 2 * numCores; numWorkers *= 2) {
+            double milliseconds[2];
+            size_t steals = 0;
+            for (int stealing = 0; stealing < 2; ++stealing) {
+                MapReduce::Options options;
+                options.numWorkers = numWorkers;
+                options.workStealing = (stealing != 0);
+                MapReduce mapReduce(MAP_SCRIPT, REDUCE_SCRIPT, options);
+                double result = 0.0;
+                std::string error;
+                const auto start = std::chrono::steady_clock::now();
+                const auto ok = mapReduce.Run(elements, 0.0, Sum, result, error);
+                const auto end = std::chrono::steady_clock::now();
+                if (!ok) {
+                    (void)fprintf(stderr, "Job failed: %s\n", error.c_str());
+                } else if ((numWorkers == 1) && (stealing == 0)) {
+                    expected = result;
+                } else if (result != expected) {
+                    (void)fprintf(stderr, "Job gave a different result: %f\n", result);
+                }
+                milliseconds[stealing] = std::chrono::duration< double, std::milli >(end - start).count();
+                if (numWorkers == 1) {
+                    baseline[stealing] = milliseconds[stealing];
+                }
+                if (stealing) {
+                    steals = mapReduce.GetCounters().steals;
+                }
+            }
+            (void)printf(
+                "%8zu %14.1f %8.2fx %14.1f %8.2fx %8zu\n",
+                numWorkers,
+                milliseconds[0],
+                baseline[0] / milliseconds[0],
+                milliseconds[1],
+                baseline[1] / milliseconds[1],
+                steals
+            );
+        }
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Make an executor with a worker for each CPU core, and use it to add
+    // up the rounded elements of a small dataset.
+    MapReduce mapReduce(MAP_SCRIPT, REDUCE_SCRIPT, MapReduce::Options());
+    std::vector< double > elements;
+    for (int i = 0; i < 10000; ++i) {
+        elements.push_back(i * 0.5);
+    }
+    double result = 0.0;
+    std::string error;
+    if (mapReduce.Run(elements, 0.0, Sum, result, error)) {
+        (void)printf(
+            "The answer from %zu workers is %.0f.\n",
+            mapReduce.NumWorkers(),
+            result
+        );
+    }
+
+    // Show what happens when a Lua function raises an error.
+    MapReduce broken(
+        "return function(x) if x > 1000 then error('too big') end return x end",
+        REDUCE_SCRIPT,
+        MapReduce::Options()
+    );
+    if (!broken.Run(elements, 0.0, Sum, result, error)) {
+        (void)printf("The job failed: %s\n", error.c_str());
+    }
+
+    // Measure how the time taken scales with the number of workers, with
+    // and without work stealing.
+    MeasureScaling("Uniform", false);
+    MeasureScaling("Skewed", true);
+
+    // All done!
+    return EXIT_SUCCESS;
+}
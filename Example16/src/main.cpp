@@ -0,0 +1,853 @@
+#include <chrono>
+#include <limits.h>
+#include <math.h>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // This is the name under which the metatable for shared buffer userdata
+    // is registered in the Lua registry.
+    const char* const SHARED_BUFFER_METATABLE = "SharedBuffer";
+
+    // This is the most deeply tables may be nested inside each other in
+    // a value being encoded or decoded, to keep the recursion from running
+    // out of C stack.
+    constexpr int MAX_DEPTH = 200;
+
+    // These are the tags which begin each encoded value.
+    enum class Tag: uint8_t {
+        Nil,
+        False,
+        True,
+        Integer,        // zigzag-encoded varint
+        Float,          // eight bytes, in the machine's byte order
+        String,         // varint length, then the bytes
+        SharedString,   // varint index into the message's shared buffers
+        Table,          // varint array count, varint hash count, then the
+                        // array values, then the hash keys and values
+        TableReference, // varint number of a table already encoded
+    };
+
+    // This is a value encoded in binary, ready to be decoded into any other
+    // Lua instance, on any thread.
+    //
+    // Strings at least as long as the encoder's threshold aren't copied
+    // into `data`.  Instead they're kept in immutable buffers shared by
+    // every copy of the message, and every Lua instance which decodes the
+    // message with `shareLargeStrings`, and every message made by encoding
+    // those again.
+    struct Message {
+        std::string data;
+        std::vector< std::shared_ptr< const std::string > > buffers;
+    };
+
+    struct EncodeOptions {
+        // This is the length at or above which strings go into shared
+        // buffers, or zero to always copy strings into the message.
+        size_t sharedStringThreshold = 64 * 1024;
+    };
+
+    struct DecodeOptions {
+        // This selects whether strings kept in shared buffers are given to
+        // Lua as "SharedBuffer" userdata, which refer to the buffer without
+        // copying it, rather than copied into Lua strings.
+        bool shareLargeStrings = false;
+    };
+
+    // Push onto the Lua stack a userdata holding a reference to the given
+    // shared buffer.
+    //
+    // Lua can find the length of a shared buffer with `#`, and make a Lua
+    // string copy of it with `tostring`.  Encoding one again only shares the
+    // buffer with the new message, so a large string can be passed along from
+    // one Lua instance to the next without ever being copied.
+    void PushSharedBuffer(lua_State* lua, const std::shared_ptr< const std::string >& buffer) {
+        typedef std::shared_ptr< const std::string > Buffer;
+        auto udata = (Buffer*)lua_newuserdata(lua, sizeof(Buffer));
+        new (udata) Buffer(buffer);
+        if (luaL_newmetatable(lua, SHARED_BUFFER_METATABLE)) {
+            lua_pushcfunction(lua, [](lua_State* lua){
+                ((Buffer*)lua_touserdata(lua, 1))->~Buffer();
+                return 0;
+            });
+            lua_setfield(lua, -2, "__gc");
+            lua_pushcfunction(lua, [](lua_State* lua){
+                const auto& buffer = **(Buffer*)lua_touserdata(lua, 1);
+                lua_pushinteger(lua, (lua_Integer)buffer.length());
+                return 1;
+            });
+            lua_setfield(lua, -2, "__len");
+            lua_pushcfunction(lua, [](lua_State* lua){
+                const auto& buffer = **(Buffer*)lua_touserdata(lua, 1);
+                (void)lua_pushlstring(lua, buffer.data(), buffer.length());
+                return 1;
+            });
+            lua_setfield(lua, -2, "__tostring");
+        }
+        lua_setmetatable(lua, -2);
+    }
+
+    void WriteVarint(std::string& data, uint64_t value) {
+        while (value >= 0x80) {
+            data.push_back((char)((value & 0x7F) | 0x80));
+            value >>= 7;
+        }
+        data.push_back((char)value);
+    }
+
+    // This encodes Lua values into a message.
+    //
+    // Tables are given numbers in the order they're first encoded, which
+    // are kept in a Lua table (mapping each table to its number) at a fixed
+    // index on the Lua stack.  When a table is reached again, whether
+    // because it's inside itself or just inside more than one other table,
+    // only its number is encoded, so cycles end, and the decoded value has
+    // the same shape as the original.
+    class Encoder {
+    public:
+        Encoder(lua_State* lua, Message& message, const EncodeOptions& options)
+            : lua_(lua)
+            , message_(message)
+            , options_(options)
+        {
+        }
+
+        // Encode the value at the given index of the Lua stack, returning
+        // false, with a description of the problem in `error`, if it (or
+        // anything inside it) can't be encoded.
+        //
+        // Like decoding, the encoding runs in a C function called with
+        // `lua_pcall`, so that if Lua raises an error while keeping track of
+        // the tables, such as running out of memory, it's caught there,
+        // rather than jumping out through the C++ code which called us.
+        bool Encode(int index, std::string& error) {
+            index = lua_absindex(lua_, index);
+            if (!lua_checkstack(lua_, 3)) {
+                error = "out of Lua stack space";
+                return false;
+            }
+            lua_pushcfunction(lua_, EncodeProtected);
+            lua_pushlightuserdata(lua_, this);
+            lua_pushvalue(lua_, index);
+            if (lua_pcall(lua_, 2, 0, 0) != LUA_OK) {
+                error = (
+                    (lua_type(lua_, -1) == LUA_TSTRING)
+                    ? lua_tostring(lua_, -1)
+                    : "error encoding the value"
+                );
+                lua_pop(lua_, 1);
+                return false;
+            }
+            if (!error_.empty()) {
+                error = error_;
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        // This is the C function called by `Encode`, with the encoder as
+        // a light userdata, and the value to encode.
+        static int EncodeProtected(lua_State* lua) {
+            const auto encoder = (Encoder*)lua_touserdata(lua, 1);
+            lua_newtable(lua);
+            encoder->tablesIndex_ = lua_gettop(lua);
+            (void)encoder->EncodeValue(2, 0);
+            return 0;
+        }
+
+        bool Fail(const char* what) {
+            error_ = what;
+            return false;
+        }
+
+        void WriteTag(Tag tag) {
+            message_.data.push_back((char)tag);
+        }
+
+        void WriteString(const char* chars, size_t length) {
+            if (
+                (options_.sharedStringThreshold > 0)
+                && (length >= options_.sharedStringThreshold)
+            ) {
+                WriteSharedString(std::make_shared< const std::string >(chars, length));
+            } else {
+                WriteTag(Tag::String);
+                WriteVarint(message_.data, length);
+                message_.data.append(chars, length);
+            }
+        }
+
+        void WriteSharedString(const std::shared_ptr< const std::string >& buffer) {
+            WriteTag(Tag::SharedString);
+            WriteVarint(message_.data, message_.buffers.size());
+            message_.buffers.push_back(buffer);
+        }
+
+        bool EncodeValue(int index, int depth) {
+            switch (lua_type(lua_, index)) {
+                case LUA_TNIL: {
+                    WriteTag(Tag::Nil);
+                } return true;
+
+                case LUA_TBOOLEAN: {
+                    WriteTag(lua_toboolean(lua_, index) ? Tag::True : Tag::False);
+                } return true;
+
+                case LUA_TNUMBER: {
+                    if (lua_isinteger(lua_, index)) {
+                        const auto value = (uint64_t)lua_tointeger(lua_, index);
+                        WriteTag(Tag::Integer);
+                        WriteVarint(message_.data, (value << 1) ^ (uint64_t)((int64_t)value >> 63));
+                    } else {
+                        const auto value = (double)lua_tonumber(lua_, index);
+                        char bytes[sizeof(value)];
+                        (void)memcpy(bytes, &value, sizeof(value));
+                        WriteTag(Tag::Float);
+                        message_.data.append(bytes, sizeof(bytes));
+                    }
+                } return true;
+
+                case LUA_TSTRING: {
+                    size_t length;
+                    const auto chars = lua_tolstring(lua_, index, &length);
+                    WriteString(chars, length);
+                } return true;
+
+                case LUA_TTABLE: {
+                    return EncodeTable(index, depth);
+                }
+
+                case LUA_TUSERDATA: {
+                    typedef std::shared_ptr< const std::string > Buffer;
+                    const auto buffer = (Buffer*)luaL_testudata(lua_, index, SHARED_BUFFER_METATABLE);
+                    if (buffer == nullptr) {
+                        return Fail("can't encode userdata");
+                    }
+                    WriteSharedString(*buffer);
+                } return true;
+
+                default: {
+                    return Fail((std::string("can't encode a ") + luaL_typename(lua_, index)).c_str());
+                }
+            }
+        }
+
+        bool EncodeTable(int index, int depth) {
+            if (depth >= MAX_DEPTH) {
+                return Fail("tables nested too deeply");
+            }
+            if (!lua_checkstack(lua_, 4)) {
+                return Fail("out of Lua stack space");
+            }
+
+            // If the table was encoded already, just refer to it.
+            lua_pushvalue(lua_, index);
+            if (lua_rawget(lua_, tablesIndex_) == LUA_TNUMBER) {
+                const auto number = (uint64_t)lua_tointeger(lua_, -1);
+                lua_pop(lua_, 1);
+                WriteTag(Tag::TableReference);
+                WriteVarint(message_.data, number);
+                return true;
+            }
+            lua_pop(lua_, 1);
+            lua_pushvalue(lua_, index);
+            lua_pushinteger(lua_, (lua_Integer)numTables_++);
+            lua_rawset(lua_, tablesIndex_);
+
+            // Count the elements of the sequence part, which are encoded
+            // without their keys, and the other keys.
+            const auto arrayCount = (lua_Integer)lua_rawlen(lua_, index);
+            uint64_t hashCount = 0;
+            lua_pushnil(lua_);
+            while (lua_next(lua_, index) != 0) {
+                lua_pop(lua_, 1);
+                if (!IsArrayKey(-1, arrayCount)) {
+                    ++hashCount;
+                }
+            }
+            WriteTag(Tag::Table);
+            WriteVarint(message_.data, (uint64_t)arrayCount);
+            WriteVarint(message_.data, hashCount);
+
+            // Encode the sequence part in order, and then everything else.
+            for (lua_Integer i = 1; i <= arrayCount; ++i) {
+                (void)lua_rawgeti(lua_, index, i);
+                const auto encoded = EncodeValue(lua_gettop(lua_), depth + 1);
+                lua_pop(lua_, 1);
+                if (!encoded) {
+                    return false;
+                }
+            }
+            lua_pushnil(lua_);
+            while (lua_next(lua_, index) != 0) {
+                if (!IsArrayKey(-2, arrayCount)) {
+                    const auto top = lua_gettop(lua_);
+                    if (
+                        !EncodeValue(top - 1, depth + 1)
+                        || !EncodeValue(top, depth + 1)
+                    ) {
+                        lua_pop(lua_, 2);
+                        return false;
+                    }
+                }
+                lua_pop(lua_, 1);
+            }
+            return true;
+        }
+
+        // Return whether or not the key at the given index of the Lua stack
+        // is one of the keys of the sequence part of a table.
+        bool IsArrayKey(int index, lua_Integer arrayCount) {
+            if (!lua_isinteger(lua_, index)) {
+                return false;
+            }
+            const auto key = lua_tointeger(lua_, index);
+            return ((key >= 1) && (key <= arrayCount));
+        }
+
+        lua_State* lua_;
+        Message& message_;
+        const EncodeOptions& options_;
+        int tablesIndex_ = 0;
+        uint64_t numTables_ = 0;
+        std::string error_;
+    };
+
+    // This decodes a message into Lua values.  Tables are kept, in the order
+    // they're decoded, in a Lua table at a fixed index on the Lua stack, so
+    // that references to them can be resolved.
+    class Decoder {
+    public:
+        Decoder(lua_State* lua, const Message& message, const DecodeOptions& options)
+            : lua_(lua)
+            , message_(message)
+            , options_(options)
+            , next_(message.data.data())
+            , end_(message.data.data() + message.data.length())
+            , presizeBudget_(message.data.length())
+        {
+        }
+
+        // Decode the message and push the value onto the Lua stack,
+        // returning false, with a description of the problem in `error`, and
+        // nothing pushed, if the message isn't valid.
+        //
+        // The decoding runs in a C function called with `lua_pcall`, so
+        // that if Lua raises an error while making the values, such as
+        // running out of memory, it's caught there, rather than jumping out
+        // through the C++ code which called us.
+        bool Decode(std::string& error) {
+            if (!lua_checkstack(lua_, 2)) {
+                error = "out of Lua stack space";
+                return false;
+            }
+            lua_pushcfunction(lua_, DecodeProtected);
+            lua_pushlightuserdata(lua_, this);
+            if (lua_pcall(lua_, 1, 1, 0) != LUA_OK) {
+                error = (
+                    (lua_type(lua_, -1) == LUA_TSTRING)
+                    ? lua_tostring(lua_, -1)
+                    : "error decoding the message"
+                );
+                lua_pop(lua_, 1);
+                return false;
+            }
+            if (!error_.empty()) {
+                lua_pop(lua_, 1);
+                error = error_;
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        // This is the C function called by `Decode`, with the decoder as
+        // a light userdata.  It returns the value, or nothing if the message
+        // isn't valid.
+        static int DecodeProtected(lua_State* lua) {
+            const auto decoder = (Decoder*)lua_touserdata(lua, 1);
+            lua_newtable(lua);
+            decoder->tablesIndex_ = lua_gettop(lua);
+            if (!decoder->DecodeValue(0)) {
+                return 0;
+            }
+            if (decoder->next_ != decoder->end_) {
+                (void)decoder->Fail("extra bytes after the value");
+                return 0;
+            }
+            return 1;
+        }
+
+        bool Fail(const char* what) {
+            error_ = what;
+            return false;
+        }
+
+        bool ReadVarint(uint64_t& value) {
+            value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (next_ == end_) {
+                    return Fail("message truncated");
+                }
+                const auto byte = (uint8_t)*next_++;
+                value |= (uint64_t)(byte & 0x7F) << shift;
+                if ((byte & 0x80) == 0) {
+                    return true;
+                }
+            }
+            return Fail("varint too long");
+        }
+
+        // Return a count read from the message, if there are at least that
+        // many bytes left, since every value takes at least one byte.
+        bool ReadCount(uint64_t& count) {
+            if (!ReadVarint(count)) {
+                return false;
+            }
+            if (count > (uint64_t)(end_ - next_)) {
+                return Fail("count larger than the message");
+            }
+            return true;
+        }
+
+        // Return how many elements to presize a table for, given how many
+        // it claims to have.  Every element of every table in the message
+        // takes at least one byte of it, so all the tables of a valid message
+        // together never have more elements than the message has bytes.
+        // Taking the sizes from one budget of that many elements keeps a
+        // corrupt message, with the same large counts repeated in tables
+        // nested inside each other, from making us presize far more than
+        // the message could fill.
+        int Presize(uint64_t count) {
+            if (count > presizeBudget_) {
+                count = presizeBudget_;
+            }
+            if (count > (uint64_t)INT_MAX) {
+                count = (uint64_t)INT_MAX;
+            }
+            presizeBudget_ -= count;
+            return (int)count;
+        }
+
+        bool DecodeValue(int depth) {
+            if (next_ == end_) {
+                return Fail("message truncated");
+            }
+            const auto tag = (Tag)*next_++;
+            switch (tag) {
+                case Tag::Nil: {
+                    lua_pushnil(lua_);
+                } return true;
+
+                case Tag::False:
+                case Tag::True: {
+                    lua_pushboolean(lua_, (tag == Tag::True) ? 1 : 0);
+                } return true;
+
+                case Tag::Integer: {
+                    uint64_t value;
+                    if (!ReadVarint(value)) {
+                        return false;
+                    }
+                    lua_pushinteger(lua_, (lua_Integer)((value >> 1) ^ (~(value & 1) + 1)));
+                } return true;
+
+                case Tag::Float: {
+                    double value;
+                    if ((size_t)(end_ - next_) < sizeof(value)) {
+                        return Fail("message truncated");
+                    }
+                    (void)memcpy(&value, next_, sizeof(value));
+                    next_ += sizeof(value);
+                    lua_pushnumber(lua_, (lua_Number)value);
+                } return true;
+
+                case Tag::String: {
+                    uint64_t length;
+                    if (!ReadVarint(length)) {
+                        return false;
+                    }
+                    if (length > (uint64_t)(end_ - next_)) {
+                        return Fail("message truncated");
+                    }
+                    (void)lua_pushlstring(lua_, next_, (size_t)length);
+                    next_ += length;
+                } return true;
+
+                case Tag::SharedString: {
+                    uint64_t bufferIndex;
+                    if (!ReadVarint(bufferIndex)) {
+                        return false;
+                    }
+                    if (bufferIndex >= message_.buffers.size()) {
+                        return Fail("no such shared buffer");
+                    }
+                    const auto& buffer = message_.buffers[(size_t)bufferIndex];
+                    if (options_.shareLargeStrings) {
+                        PushSharedBuffer(lua_, buffer);
+                    } else {
+                        (void)lua_pushlstring(lua_, buffer->data(), buffer->length());
+                    }
+                } return true;
+
+                case Tag::Table: {
+                    return DecodeTable(depth);
+                }
+
+                case Tag::TableReference: {
+                    uint64_t number;
+                    if (!ReadVarint(number)) {
+                        return false;
+                    }
+                    if (number >= numTables_) {
+                        return Fail("reference to a table not yet decoded");
+                    }
+                    (void)lua_rawgeti(lua_, tablesIndex_, (lua_Integer)number + 1);
+                } return true;
+
+                default: {
+                    return Fail("unknown tag");
+                }
+            }
+        }
+
+        // The table is made with `lua_createtable`, sized for all of its
+        // elements and keys, so it never needs to grow while being filled,
+        // unless the message is corrupt and runs over the presize budget.
+        bool DecodeTable(int depth) {
+            if (depth >= MAX_DEPTH) {
+                return Fail("tables nested too deeply");
+            }
+            uint64_t arrayCount, hashCount;
+            if (!ReadCount(arrayCount) || !ReadCount(hashCount)) {
+                return false;
+            }
+            if (!lua_checkstack(lua_, 4)) {
+                return Fail("out of Lua stack space");
+            }
+            const auto arrayPresize = Presize(arrayCount);
+            const auto hashPresize = Presize(hashCount);
+            lua_createtable(lua_, arrayPresize, hashPresize);
+            const auto table = lua_gettop(lua_);
+            lua_pushvalue(lua_, table);
+            lua_rawseti(lua_, tablesIndex_, (lua_Integer)++numTables_);
+            for (uint64_t i = 1; i <= arrayCount; ++i) {
+                if (!DecodeValue(depth + 1)) {
+                    return false;
+                }
+                lua_rawseti(lua_, table, (lua_Integer)i);
+            }
+            for (uint64_t i = 0; i < hashCount; ++i) {
+                if (!DecodeValue(depth + 1) || !DecodeValue(depth + 1)) {
+                    return false;
+                }
+                if (lua_isnil(lua_, -2) || ((lua_type(lua_, -2) == LUA_TNUMBER) && isnan(lua_tonumber(lua_, -2)))) {
+                    return Fail("invalid table key");
+                }
+                lua_rawset(lua_, table);
+            }
+            return true;
+        }
+
+        lua_State* lua_;
+        const Message& message_;
+        const DecodeOptions& options_;
+        const char* next_;
+        const char* end_;
+        uint64_t presizeBudget_;
+        int tablesIndex_ = 0;
+        uint64_t numTables_ = 0;
+        std::string error_;
+    };
+
+    bool EncodeValue(
+        lua_State* lua,
+        int index,
+        Message& message,
+        const EncodeOptions& options,
+        std::string& error
+    ) {
+        message.data.clear();
+        message.buffers.clear();
+        Encoder encoder(lua, message, options);
+        return encoder.Encode(index, error);
+    }
+
+    bool DecodeValue(
+        lua_State* lua,
+        const Message& message,
+        const DecodeOptions& options,
+        std::string& error
+    ) {
+        Decoder decoder(lua, message, options);
+        return decoder.Decode(error);
+    }
+
+    // This is the way values were moved between Lua instances before: turn
+    // the value into Lua source text, and then load and run that text in
+    // the other instance.  It doesn't handle cycles, or tables appearing
+    // more than once.  It's only here to compare against.
+    void AppendText(lua_State* lua, int index, std::string& text) {
+        char buffer[64];
+        switch (lua_type(lua, index)) {
+            case LUA_TBOOLEAN: {
+                text += (lua_toboolean(lua, index) ? "true" : "false");
+            } break;
+
+            case LUA_TNUMBER: {
+                if (lua_isinteger(lua, index)) {
+                    const auto value = lua_tointeger(lua, index);
+                    if (value == LUA_MININTEGER) {
+                        text += "math.mininteger";
+                    } else {
+                        (void)snprintf(buffer, sizeof(buffer), LUA_INTEGER_FMT, value);
+                        text += buffer;
+                    }
+                } else {
+                    const auto value = lua_tonumber(lua, index);
+                    if (isnan(value)) {
+                        text += "(0/0)";
+                    } else if (isinf(value)) {
+                        text += ((value < 0) ? "(-1/0)" : "(1/0)");
+                    } else {
+                        (void)snprintf(buffer, sizeof(buffer), "%a", (double)value);
+                        text += buffer;
+                    }
+                }
+            } break;
+
+            case LUA_TSTRING: {
+                size_t length;
+                const auto chars = lua_tolstring(lua, index, &length);
+                text += '"';
+                for (size_t i = 0; i < length; ++i) {
+                    const auto c = (unsigned char)chars[i];
+                    if ((c == '"') || (c == '\\') || (c < 32) || (c >= 127)) {
+                        (void)snprintf(buffer, sizeof(buffer), "\\%03u", c);
+                        text += buffer;
+                    } else {
+                        text += (char)c;
+                    }
+                }
+                text += '"';
+            } break;
+
+            case LUA_TTABLE: {
+                text += '{';
+                lua_pushnil(lua);
+                while (lua_next(lua, index) != 0) {
+                    text += '[';
+                    AppendText(lua, lua_gettop(lua) - 1, text);
+                    text += "]=";
+                    AppendText(lua, lua_gettop(lua), text);
+                    text += ',';
+                    lua_pop(lua, 1);
+                }
+                text += '}';
+            } break;
+
+            default: {
+                text += "nil";
+            } break;
+        }
+    }
+
+    // Make a Lua instance with the standard libraries.
+    lua_State* CreateState() {
+        const auto lua = luaL_newstate();
+        lua_gc(lua, LUA_GCSTOP, 0);
+        luaL_openlibs(lua);
+        lua_gc(lua, LUA_GCRESTART, 0);
+        return lua;
+    }
+
+    // Move the value made by the given script from one Lua instance into
+    // another, over and over, as binary messages and as text, measuring the
+    // time taken each way, and the size of what's passed between them.
+    void MeasureTransfer(const char* what, const char* script, int repeats) {
+        const auto source = CreateState();
+        const auto destination = CreateState();
+        (void)luaL_dostring(source, script);
+        const auto value = lua_gettop(source);
+        std::string error;
+
+        // Binary messages, with large strings copied into Lua strings.
+        Message message;
+        EncodeOptions encodeOptions;
+        DecodeOptions decodeOptions;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeats; ++i) {
+            (void)EncodeValue(source, value, message, encodeOptions, error);
+        }
+        auto end = std::chrono::steady_clock::now();
+        const auto encodeTime = std::chrono::duration< double, std::milli >(end - start).count() / repeats;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeats; ++i) {
+            if (!DecodeValue(destination, message, decodeOptions, error)) {
+                (void)fprintf(stderr, "Decode failed: %s\n", error.c_str());
+                break;
+            }
+            lua_pop(destination, 1);
+        }
+        end = std::chrono::steady_clock::now();
+        const auto decodeTime = std::chrono::duration< double, std::milli >(end - start).count() / repeats;
+        size_t sharedBytes = 0;
+        for (const auto& buffer: message.buffers) {
+            sharedBytes += buffer->length();
+        }
+
+        // Binary messages, with large strings left in shared buffers.
+        decodeOptions.shareLargeStrings = true;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeats; ++i) {
+            (void)DecodeValue(destination, message, decodeOptions, error);
+            lua_pop(destination, 1);
+        }
+        end = std::chrono::steady_clock::now();
+        const auto sharedDecodeTime = std::chrono::duration< double, std::milli >(end - start).count() / repeats;
+
+        // Text.
+        std::string text;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeats; ++i) {
+            text = "return ";
+            AppendText(source, value, text);
+        }
+        end = std::chrono::steady_clock::now();
+        const auto textEncodeTime = std::chrono::duration< double, std::milli >(end - start).count() / repeats;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeats; ++i) {
+            if (
+                (luaL_loadbuffer(destination, text.data(), text.length(), "=text") != LUA_OK)
+                || (lua_pcall(destination, 0, 1, 0) != LUA_OK)
+            ) {
+                (void)fprintf(stderr, "Text failed: %s\n", lua_tostring(destination, -1));
+                lua_pop(destination, 1);
+                break;
+            }
+            lua_pop(destination, 1);
+        }
+        end = std::chrono::steady_clock::now();
+        const auto textDecodeTime = std::chrono::duration< double, std::milli >(end - start).count() / repeats;
+        lua_close(source);
+        lua_close(destination);
+        (void)printf(
+            "%-12s binary %9zu+%-9zu bytes, encode %8.3f ms, decode %8.3f ms (shared %8.3f ms)\n"
+            "%-12s text   %19zu bytes, encode %8.3f ms, decode %8.3f ms\n",
+            what,
+            message.data.length(),
+            sharedBytes,
+            encodeTime,
+            decodeTime,
+            sharedDecodeTime,
+            "",
+            text.length(),
+            textEncodeTime,
+            textDecodeTime
+        );
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Create two Lua instances.
+    const auto source = CreateState();
+    const auto destination = CreateState();
+
+    // Make a value in one instance, with a table which contains itself, and
+    // another which appears twice, and move it to the other instance.
+    (void)luaL_dostring(source, R"lua(
+        local shared = {"shared"}
+        local value = {
+            name = "Rhymu",
+            primes = {2, 3, 5, 7, 11},
+            pi = 3.14159265,
+            nice = true,
+            first = shared,
+            second = shared,
+            large = string.rep("x", 100000),
+        }
+        value.self = value
+        return value
+    )lua");
+    Message message;
+    std::string error;
+    if (!EncodeValue(source, -1, message, EncodeOptions(), error)) {
+        (void)fprintf(stderr, "Unable to encode: %s\n", error.c_str());
+    }
+    (void)printf(
+        "Encoded into %zu bytes and %zu shared buffer(s).\n",
+        message.data.length(),
+        message.buffers.size()
+    );
+    DecodeOptions decodeOptions;
+    decodeOptions.shareLargeStrings = true;
+    if (DecodeValue(destination, message, decodeOptions, error)) {
+        lua_setglobal(destination, "value");
+        (void)luaL_dostring(destination, R"lua(
+            print("name = " .. value.name .. ", primes[5] = " .. value.primes[5])
+            print("pi = " .. value.pi .. ", nice = " .. tostring(value.nice))
+            print("value.self == value: " .. tostring(value.self == value))
+            print("value.first == value.second: " .. tostring(value.first == value.second))
+            print("#value.large = " .. #value.large .. " (" .. type(value.large) .. ")")
+        )lua");
+    } else {
+        (void)fprintf(stderr, "Unable to decode: %s\n", error.c_str());
+    }
+
+    // Show that values which can't be moved are refused.
+    (void)luaL_dostring(source, "return {print}");
+    if (!EncodeValue(source, -1, message, EncodeOptions(), error)) {
+        (void)printf("Can't encode a table holding a function: %s\n", error.c_str());
+    }
+
+    // Destroy the Lua instances.
+    lua_close(source);
+    lua_close(destination);
+
+    // Compare moving values between Lua instances in binary and as text.
+    MeasureTransfer("records", R"lua(
+        local records = {}
+        for i = 1, 10000 do
+            records[i] = {
+                id = i,
+                name = "item" .. i,
+                price = i * 1.25,
+                tags = {"new", "sale"},
+                active = (i % 2 == 0),
+            }
+        end
+        return records
+    )lua", 20);
+    MeasureTransfer("numbers", R"lua(
+        local numbers = {}
+        for i = 1, 1000000 do
+            numbers[i] = i * 0.5
+        end
+        return numbers
+    )lua", 5);
+    MeasureTransfer("big strings", R"lua(
+        local strings = {}
+        for i = 1, 64 do
+            strings[i] = string.rep(string.char(65 + i % 26), 256 * 1024)
+        end
+        return strings
+    )lua", 20);
+
+    // All done!
+    return EXIT_SUCCESS;
+}
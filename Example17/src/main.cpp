@@ -0,0 +1,500 @@
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // This is how many modules are in the generated script corpus, and how
+    // many functions are in each module.
+    constexpr int NUM_MODULES = 400;
+    constexpr int FUNCTIONS_PER_MODULE = 40;
+
+    // This is how many entries are in the generated lookup table.
+    constexpr int LOOKUP_TABLE_SIZE = 300000;
+
+    // This is a Lua instance ready to handle requests: its script corpus
+    // compiled and loaded, its lookup tables filled, and the function which
+    // handles requests kept in the Lua registry.
+    struct WarmState {
+        lua_State* lua = nullptr;
+        int handlerRef = LUA_NOREF;
+    };
+
+    // Generate the source text of one module of the corpus.
+    std::string GenerateModule(int module) {
+        std::string text = "local M = {}\n";
+        char line[128];
+        for (int i = 0; i < FUNCTIONS_PER_MODULE; ++i) {
+            (void)snprintf(
+                line, sizeof(line),
+                "function M.f%d(x) return (x * %d + %d) %% 1000003 end\n",
+                i, module + 1, i
+            );
+            text += line;
+        }
+        text += "return M\n";
+        return text;
+    }
+
+    const char* const SETUP_SCRIPT = R"lua(
+        local size = ...
+        lookup = {}
+        for i = 1, size do
+            lookup["key" .. i] = i * 7 % 1000
+        end
+    )lua";
+
+    // This is the function which handles each request.  A negative request
+    // makes the worker exit, standing in for a script which crashes.
+    const char* const HANDLER_SCRIPT = R"lua(
+        local size, numModules = ...
+        return function(n)
+            if n < 0 then
+                os.exit(1)
+            end
+            local module = package.loaded["module" .. (n % numModules)]
+            return module.f3(n) + lookup["key" .. (n % size + 1)]
+        end
+    )lua";
+
+    // Build a Lua instance from scratch, and warm it up: compile and load
+    // every module of the script corpus, and fill the lookup tables.
+    WarmState BuildWarmState() {
+        WarmState state;
+        const auto lua = luaL_newstate();
+        lua_gc(lua, LUA_GCSTOP, 0);
+        luaL_openlibs(lua);
+        (void)lua_getglobal(lua, LUA_LOADLIBNAME);
+        (void)lua_getfield(lua, -1, "loaded");
+        for (int module = 0; module < NUM_MODULES; ++module) {
+            const auto name = "module" + std::to_string(module);
+            const auto text = GenerateModule(module);
+            if (
+                (luaL_loadbuffer(lua, text.data(), text.length(), name.c_str()) != LUA_OK)
+                || (lua_pcall(lua, 0, 1, 0) != LUA_OK)
+            ) {
+                (void)fprintf(stderr, "Unable to load %s: %s\n", name.c_str(), lua_tostring(lua, -1));
+            }
+            lua_setfield(lua, -2, name.c_str());
+        }
+        lua_pop(lua, 2);
+        (void)luaL_loadstring(lua, SETUP_SCRIPT);
+        lua_pushinteger(lua, LOOKUP_TABLE_SIZE);
+        (void)lua_pcall(lua, 1, 0, 0);
+        (void)luaL_loadstring(lua, HANDLER_SCRIPT);
+        lua_pushinteger(lua, LOOKUP_TABLE_SIZE);
+        lua_pushinteger(lua, NUM_MODULES);
+        (void)lua_pcall(lua, 2, 1, 0);
+        state.handlerRef = luaL_ref(lua, LUA_REGISTRYINDEX);
+        lua_gc(lua, LUA_GCRESTART, 0);
+        state.lua = lua;
+        return state;
+    }
+
+    // Call the request handler of the given Lua instance.
+    lua_Integer HandleRequest(const WarmState& state, lua_Integer request) {
+        const auto lua = state.lua;
+        (void)lua_rawgeti(lua, LUA_REGISTRYINDEX, state.handlerRef);
+        lua_pushinteger(lua, request);
+        if (lua_pcall(lua, 1, 1, 0) != LUA_OK) {
+            (void)fprintf(stderr, "Request failed: %s\n", lua_tostring(lua, -1));
+            lua_pop(lua, 1);
+            return -1;
+        }
+        const auto response = lua_tointeger(lua, -1);
+        lua_pop(lua, 1);
+        return response;
+    }
+
+    bool ReadAll(int fd, void* buffer, size_t size) {
+        auto next = (char*)buffer;
+        while (size > 0) {
+            const auto amount = read(fd, next, size);
+            if (amount > 0) {
+                next += amount;
+                size -= (size_t)amount;
+            } else if ((amount == 0) || (errno != EINTR)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool WriteAll(int fd, const void* buffer, size_t size) {
+        auto next = (const char*)buffer;
+        while (size > 0) {
+            const auto amount = send(fd, next, size, MSG_NOSIGNAL);
+            if (amount > 0) {
+                next += amount;
+                size -= (size_t)amount;
+            } else if ((amount < 0) && (errno != EINTR)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // This is how much memory a process uses, in kilobytes, from the
+    // operating system's point of view.  `rss` counts every page the process
+    // has in memory, including pages shared with other processes.  `pss`
+    // counts each shared page divided by the number of processes sharing it.
+    // `privateKilobytes` counts only pages no other process shares.
+    struct MemoryUse {
+        size_t rss = 0;
+        size_t pss = 0;
+        size_t privateKilobytes = 0;
+    };
+
+    MemoryUse GetMemoryUse(pid_t pid) {
+        MemoryUse use;
+        const auto path = "/proc/" + std::to_string(pid) + "/smaps_rollup";
+        const auto file = fopen(path.c_str(), "r");
+        if (file == NULL) {
+            return use;
+        }
+        char line[256];
+        while (fgets(line, sizeof(line), file) != NULL) {
+            size_t kilobytes;
+            if (sscanf(line, "Rss: %zu kB", &kilobytes) == 1) {
+                use.rss = kilobytes;
+            } else if (sscanf(line, "Pss: %zu kB", &kilobytes) == 1) {
+                use.pss = kilobytes;
+            } else if (
+                (sscanf(line, "Private_Clean: %zu kB", &kilobytes) == 1)
+                || (sscanf(line, "Private_Dirty: %zu kB", &kilobytes) == 1)
+            ) {
+                use.privateKilobytes += kilobytes;
+            }
+        }
+        (void)fclose(file);
+        return use;
+    }
+
+    // This runs a set of worker processes, each with its own Lua instance,
+    // and hands requests to them, restarting any worker which exits.
+    //
+    // Building and warming up a Lua instance takes a long time, so instead
+    // the supervisor is given a "template" instance, already warmed up, and
+    // starts each worker with `fork`, which gives the worker a copy of the
+    // template in an instant.  The copy is "copy-on-write": the worker
+    // shares the template's memory with the supervisor and every other
+    // worker, and only gets its own copy of a page of memory when it writes
+    // to that page.  Since the script corpus and lookup tables are only read
+    // while handling requests, most of the memory stays shared.
+    //
+    // The one thing which writes all over the Lua instance's memory is the
+    // garbage collector, which marks every object it visits, and so would
+    // give each worker its own copy of nearly every page.  So by default
+    // workers don't run the garbage collector, and are instead retired and
+    // replaced with a fresh copy of the template after handling a number of
+    // requests, which also throws away anything a script left behind.
+    //
+    // Workers are only ever forked from the supervisor's thread, and the
+    // supervisor must not have other threads running at the time, since
+    // a forked child only gets a copy of the thread which forked it.
+    class Supervisor {
+    public:
+        struct Options {
+            // This is the number of worker processes to run.
+            size_t numWorkers = 4;
+
+            // This is the number of requests a worker handles before it's
+            // replaced, or zero to keep workers until they exit.
+            size_t maxRequestsPerWorker = 10000;
+
+            // This selects whether or not workers run Lua's garbage
+            // collector.
+            bool collectGarbageInWorkers = false;
+        };
+
+        // These are counters about the workers started so far.
+        struct Counters {
+            size_t workersStarted = 0;
+            size_t workersRestarted = 0;
+            size_t workersRetired = 0;
+            std::chrono::nanoseconds totalStartTime{0};
+            std::chrono::nanoseconds maxStartTime{0};
+        };
+
+        // Make a supervisor whose workers copy the given warmed-up Lua
+        // instance, or, if it has none, build one from scratch each.
+        Supervisor(const WarmState& templateState, const Options& options)
+            : templateState_(templateState)
+            , options_(options)
+            , workers_(options.numWorkers)
+        {
+        }
+
+        ~Supervisor() {
+            for (auto& worker: workers_) {
+                Stop(worker);
+            }
+        }
+
+        Supervisor(const Supervisor&) = delete;
+        Supervisor& operator=(const Supervisor&) = delete;
+
+        // Start all the workers, returning false if any couldn't be started.
+        bool Start() {
+            for (auto& worker: workers_) {
+                if (!Spawn(worker)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Hand the given request to the next worker, and wait for its
+        // response.  If the worker is gone, or exits while handling the
+        // request, start a new worker in its place, and return false.
+        bool Call(lua_Integer request, lua_Integer& response) {
+            auto& worker = workers_[nextWorker_];
+            nextWorker_ = (nextWorker_ + 1) % workers_.size();
+            if (
+                !WriteAll(worker.fd, &request, sizeof(request))
+                || !ReadAll(worker.fd, &response, sizeof(response))
+            ) {
+                Stop(worker);
+                ++counters_.workersRestarted;
+                (void)Spawn(worker);
+                return false;
+            }
+            ++worker.requests;
+            if (
+                (options_.maxRequestsPerWorker > 0)
+                && (worker.requests >= options_.maxRequestsPerWorker)
+            ) {
+                Stop(worker);
+                ++counters_.workersRetired;
+                (void)Spawn(worker);
+            }
+            return true;
+        }
+
+        // Return the process IDs of the workers.
+        std::vector< pid_t > GetWorkerPids() const {
+            std::vector< pid_t > pids;
+            for (const auto& worker: workers_) {
+                pids.push_back(worker.pid);
+            }
+            return pids;
+        }
+
+        Counters GetCounters() const {
+            return counters_;
+        }
+
+    private:
+        struct Worker {
+            pid_t pid = -1;
+            int fd = -1;
+            size_t requests = 0;
+        };
+
+        // Start a worker process, and wait until it says it's ready.
+        bool Spawn(Worker& worker) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+                return false;
+            }
+            (void)fflush(stdout);
+            (void)fflush(stderr);
+            const auto start = std::chrono::steady_clock::now();
+            const auto pid = fork();
+            if (pid < 0) {
+                (void)close(fds[0]);
+                (void)close(fds[1]);
+                return false;
+            }
+            if (pid == 0) {
+                (void)close(fds[0]);
+                for (const auto& other: workers_) {
+                    if (other.fd >= 0) {
+                        (void)close(other.fd);
+                    }
+                }
+                RunWorker(fds[1]);
+                _exit(0);
+            }
+            (void)close(fds[1]);
+            worker.pid = pid;
+            worker.fd = fds[0];
+            worker.requests = 0;
+            char ready;
+            if (!ReadAll(worker.fd, &ready, sizeof(ready))) {
+                Stop(worker);
+                return false;
+            }
+            const auto startTime = std::chrono::duration_cast< std::chrono::nanoseconds >(
+                std::chrono::steady_clock::now() - start
+            );
+            ++counters_.workersStarted;
+            counters_.totalStartTime += startTime;
+            counters_.maxStartTime = std::max(counters_.maxStartTime, startTime);
+            return true;
+        }
+
+        // Stop a worker, by closing its connection, which tells it to exit,
+        // and wait for it to exit.
+        void Stop(Worker& worker) {
+            if (worker.fd >= 0) {
+                (void)close(worker.fd);
+                worker.fd = -1;
+            }
+            if (worker.pid > 0) {
+                int status;
+                while ((waitpid(worker.pid, &status, 0) < 0) && (errno == EINTR)) {
+                }
+                worker.pid = -1;
+            }
+        }
+
+        // This runs in the worker process.  Handle requests until the
+        // supervisor closes the connection.
+        void RunWorker(int fd) {
+            auto state = templateState_;
+            if (state.lua == nullptr) {
+                state = BuildWarmState();
+            }
+            if (!options_.collectGarbageInWorkers) {
+                lua_gc(state.lua, LUA_GCSTOP, 0);
+            }
+            const char ready = 1;
+            if (!WriteAll(fd, &ready, sizeof(ready))) {
+                return;
+            }
+            lua_Integer request;
+            while (ReadAll(fd, &request, sizeof(request))) {
+                const auto response = HandleRequest(state, request);
+                if (!WriteAll(fd, &response, sizeof(response))) {
+                    break;
+                }
+            }
+        }
+
+        const WarmState templateState_;
+        const Options options_;
+        std::vector< Worker > workers_;
+        size_t nextWorker_ = 0;
+        Counters counters_;
+    };
+
+    // Start workers either from a template or from scratch, have them
+    // handle some requests, and report how long each took to start, and how
+    // much memory each uses.
+    void MeasureWorkers(const char* what, const WarmState& templateState, size_t numWorkers) {
+        Supervisor::Options options;
+        options.numWorkers = numWorkers;
+        options.maxRequestsPerWorker = 0;
+        Supervisor supervisor(templateState, options);
+        if (!supervisor.Start()) {
+            (void)fprintf(stderr, "Unable to start workers\n");
+            return;
+        }
+        lua_Integer response;
+        for (lua_Integer request = 0; request < 20000; ++request) {
+            (void)supervisor.Call(request, response);
+        }
+        MemoryUse total;
+        for (const auto pid: supervisor.GetWorkerPids()) {
+            const auto use = GetMemoryUse(pid);
+            total.rss += use.rss;
+            total.pss += use.pss;
+            total.privateKilobytes += use.privateKilobytes;
+        }
+        const auto counters = supervisor.GetCounters();
+        (void)printf(
+            "%-13s start %9.3f ms avg %9.3f ms max; per worker: RSS %6.1f MB, PSS %6.1f MB, private %6.1f MB\n",
+            what,
+            std::chrono::duration< double, std::milli >(counters.totalStartTime).count()
+            / counters.workersStarted,
+            std::chrono::duration< double, std::milli >(counters.maxStartTime).count(),
+            total.rss / 1024.0 / numWorkers,
+            total.pss / 1024.0 / numWorkers,
+            total.privateKilobytes / 1024.0 / numWorkers
+        );
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Measure workers which each build their own Lua instance from scratch.
+    const size_t numWorkers = 4;
+    MeasureWorkers("From scratch", WarmState(), numWorkers);
+
+    // Build and warm up the template Lua instance, then collect all the
+    // garbage left over, so that workers don't start with any.
+    auto start = std::chrono::steady_clock::now();
+    const auto templateState = BuildWarmState();
+    lua_gc(templateState.lua, LUA_GCCOLLECT, 0);
+    lua_gc(templateState.lua, LUA_GCCOLLECT, 0);
+    auto end = std::chrono::steady_clock::now();
+    (void)printf(
+        "Building the template took %.1f ms, and it uses %d KB.\n",
+        std::chrono::duration< double, std::milli >(end - start).count(),
+        lua_gc(templateState.lua, LUA_GCCOUNT, 0)
+    );
+
+    // Measure workers forked from the template.
+    MeasureWorkers("From template", templateState, numWorkers);
+
+    // Run a supervisor, and show that it replaces workers which exit,
+    // whether because a script brought one down or because it was killed.
+    // The supervisor is kept in its own scope, so that its workers are
+    // stopped before the template is destroyed.
+    {
+        Supervisor supervisor(templateState, Supervisor::Options());
+        if (!supervisor.Start()) {
+            (void)fprintf(stderr, "Unable to start workers\n");
+            lua_close(templateState.lua);
+            return EXIT_FAILURE;
+        }
+        lua_Integer response;
+        if (supervisor.Call(42, response)) {
+            (void)printf("The answer is %lld.\n", (long long)response);
+        }
+        if (!supervisor.Call(-1, response)) {
+            (void)printf("A script brought down its worker.\n");
+        }
+        const auto pids = supervisor.GetWorkerPids();
+        (void)kill(pids[2], SIGKILL);
+        (void)printf("Killed worker %d.\n", (int)pids[2]);
+        size_t failures = 0;
+        for (lua_Integer request = 0; request < 100; ++request) {
+            if (!supervisor.Call(request, response)) {
+                ++failures;
+            }
+        }
+        const auto counters = supervisor.GetCounters();
+        (void)printf(
+            "%zu request(s) failed; %zu worker(s) restarted, %zu started in all.\n",
+            failures,
+            counters.workersRestarted,
+            counters.workersStarted
+        );
+    }
+
+    // Destroy the template Lua instance.
+    lua_close(templateState.lua);
+
+    // All done!
+    return EXIT_SUCCESS;
+}
@@ -1,5 +1,7 @@
+#include <chrono>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
 
 extern "C" {
@@ -19,6 +21,210 @@ namespace {
         }
     }
 
+    // This is a custom allocator which is faster than the one above for the
+    // many tiny blocks Lua allocates for strings, tables, closures, etc.
+    //
+    // Small blocks are rounded up to one of a number of "size classes".
+    // Each size class has a list of free blocks, and when that runs out,
+    // new blocks are carved out of large "slabs" obtained from the system
+    // allocator.  Freed small blocks go back on the free list of their
+    // size class rather than back to the system.  Large blocks just use the
+    // system allocator directly.
+    //
+    // Lua always tells the allocator the size of the block being freed or
+    // resized (`osize`), so we don't need to store any per-block header to
+    // know which size class a block came from.
+    //
+    // The pool also keeps track of how much memory its Lua instance uses,
+    // and can enforce a limit on it.  Once the limit is reached, Lua is told
+    // it's out of memory, which it reports as a LUA_ERRMEM error from the
+    // function which was running, rather than letting one runaway script
+    // take all the memory of the whole program.
+    //
+    // Each Lua instance should get its own pool (passed as the `ud` argument
+    // of `lua_newstate`), which must outlive the Lua instance.  A pool is not
+    // thread-safe, but it doesn't need to be, since a Lua instance is only
+    // ever used by one thread at a time.
+    class PoolAllocator {
+    public:
+        static constexpr size_t GRANULARITY = 16;
+        static constexpr size_t MAX_SMALL_SIZE = 256;
+        static constexpr size_t NUM_SIZE_CLASSES = MAX_SMALL_SIZE / GRANULARITY;
+        static constexpr size_t SLAB_SIZE = 64 * 1024;
+
+        PoolAllocator() = default;
+
+        ~PoolAllocator() {
+            while (slabs_ != nullptr) {
+                const auto slab = slabs_;
+                slabs_ = slab->next;
+                free(slab);
+            }
+        }
+
+        PoolAllocator(const PoolAllocator&) = delete;
+        PoolAllocator& operator=(const PoolAllocator&) = delete;
+
+        // Set the maximum number of bytes the Lua instance may have
+        // allocated at any one time.  Zero means there is no limit.
+        void SetLimit(size_t limit) {
+            limit_ = limit;
+        }
+
+        // Return the number of bytes currently allocated.
+        size_t LiveBytes() const {
+            return liveBytes_;
+        }
+
+        // Return the highest number of bytes ever allocated at one time.
+        size_t PeakBytes() const {
+            return peakBytes_;
+        }
+
+        // Return the number of blocks allocated so far.
+        size_t Allocations() const {
+            return allocations_;
+        }
+
+        // Return the number of allocations refused because of the limit.
+        size_t FailedAllocations() const {
+            return failedAllocations_;
+        }
+
+        // This is the function to give to `lua_newstate`, along with
+        // a pointer to the pool.
+        static void* LuaAlloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+            const auto self = (PoolAllocator*)ud;
+
+            // When `ptr` is NULL, `osize` doesn't hold a block size (it holds
+            // the type of object being allocated), so pretend it's zero.
+            if (ptr == NULL) {
+                osize = 0;
+            }
+            if (nsize == 0) {
+                self->Free(ptr, osize);
+                self->liveBytes_ -= osize;
+                return NULL;
+            }
+
+            // Refuse to grow past the limit.  Shrinking is always allowed,
+            // since Lua assumes it can never fail.
+            if (
+                (nsize > osize)
+                && (self->limit_ != 0)
+                && (self->liveBytes_ + (nsize - osize) > self->limit_)
+            ) {
+                ++self->failedAllocations_;
+                return NULL;
+            }
+            const auto newPtr = self->Reallocate(ptr, osize, nsize);
+            if (newPtr != NULL) {
+                self->liveBytes_ = self->liveBytes_ - osize + nsize;
+                if (self->liveBytes_ > self->peakBytes_) {
+                    self->peakBytes_ = self->liveBytes_;
+                }
+                if (ptr == NULL) {
+                    ++self->allocations_;
+                }
+            }
+            return newPtr;
+        }
+
+    private:
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        // Each slab starts with a header linking it to the slab allocated
+        // before it, so we can free them all when the pool is destroyed.
+        // The header is padded so that blocks carved out of the slab keep the
+        // alignment of memory provided by the system allocator.
+        struct alignas(GRANULARITY) Slab {
+            Slab* next;
+        };
+
+        struct SizeClassState {
+            FreeBlock* freeList = nullptr;
+            char* nextUnused = nullptr;
+            char* endUnused = nullptr;
+        };
+
+        static size_t SizeClass(size_t size) {
+            return (size + GRANULARITY - 1) / GRANULARITY - 1;
+        }
+
+        void* Reallocate(void* ptr, size_t osize, size_t nsize) {
+            const bool wasSmall = (ptr != NULL) && (osize <= MAX_SMALL_SIZE);
+            const bool isSmall = (nsize <= MAX_SMALL_SIZE);
+            if (!wasSmall && !isSmall) {
+                return realloc(ptr, nsize);
+            }
+            if (wasSmall && isSmall && (SizeClass(osize) == SizeClass(nsize))) {
+                return ptr;
+            }
+            void* newPtr = (isSmall ? AllocateSmall(nsize) : malloc(nsize));
+            if (newPtr == NULL) {
+                // Lua assumes shrinking a block never fails.  The old block
+                // is big enough, so keep it.  If it came from the system
+                // allocator, it's simply recycled as a small block from now
+                // on, and only returned to the system when the process exits.
+                return ((nsize <= osize) ? ptr : NULL);
+            }
+            if (ptr != NULL) {
+                (void)memcpy(newPtr, ptr, ((osize < nsize) ? osize : nsize));
+                Free(ptr, osize);
+            }
+            return newPtr;
+        }
+
+        void* AllocateSmall(size_t size) {
+            const auto sizeClass = SizeClass(size);
+            auto& state = sizeClasses_[sizeClass];
+            if (state.freeList != nullptr) {
+                const auto block = state.freeList;
+                state.freeList = block->next;
+                return block;
+            }
+            const auto blockSize = (sizeClass + 1) * GRANULARITY;
+            if (state.nextUnused == state.endUnused) {
+                const auto slab = (Slab*)malloc(SLAB_SIZE);
+                if (slab == NULL) {
+                    return NULL;
+                }
+                slab->next = slabs_;
+                slabs_ = slab;
+                state.nextUnused = (char*)(slab + 1);
+                const auto numBlocks = (SLAB_SIZE - sizeof(Slab)) / blockSize;
+                state.endUnused = state.nextUnused + numBlocks * blockSize;
+            }
+            const auto block = state.nextUnused;
+            state.nextUnused += blockSize;
+            return block;
+        }
+
+        void Free(void* ptr, size_t size) {
+            if (ptr == NULL) {
+                return;
+            }
+            if (size > MAX_SMALL_SIZE) {
+                free(ptr);
+                return;
+            }
+            auto& state = sizeClasses_[SizeClass(size)];
+            const auto block = (FreeBlock*)ptr;
+            block->next = state.freeList;
+            state.freeList = block;
+        }
+
+        SizeClassState sizeClasses_[NUM_SIZE_CLASSES];
+        Slab* slabs_ = nullptr;
+        size_t limit_ = 0;
+        size_t liveBytes_ = 0;
+        size_t peakBytes_ = 0;
+        size_t allocations_ = 0;
+        size_t failedAllocations_ = 0;
+    };
+
     struct LuaReaderState {
         const std::string* chunk = nullptr;
         bool read = false;
@@ -68,13 +274,13 @@ namespace {
         lua_pop(lua, 1);
     }
 
-    void DemonstrateCallError(lua_State* lua) {
+    void DemonstrateCallError(lua_State* lua, const std::string& script) {
         // Push a custom message delegate onto the Lua stack that we
         // will use to process runtime errors.
         lua_pushcfunction(lua, LuaTraceback);
 
         // Load (compile) Lua script.
-        (void)LoadScript(lua, "foobar()");
+        (void)LoadScript(lua, script);
 
         // Call the chunk to execute it, but make it a "protected" call,
         // meaning we catch runtime errors if they happen.
@@ -100,9 +306,12 @@ namespace {
                 break;
 
             case LUA_ERRMEM:
-                (void)fprintf(
-                    stderr,
-                    "This only happens if a memory allocation error occurs!\n"
+                // Note that our custom message delegate isn't called
+                // for memory allocation errors.
+                (void)printf(
+                    "Calling a script which runs out of memory, we catch the "
+                    "error which yields this string: %s\n",
+                    lua_tostring(lua, -1)
                 );
                 lua_pop(lua, 1);
                 break;
@@ -138,6 +347,49 @@ namespace {
         lua_pop(lua, 1);
     }
 
+    void PrintMemoryUsage(const char* what, const PoolAllocator& pool) {
+        (void)printf(
+            "%s: %zu bytes in use, %zu bytes at peak, "
+            "%zu allocations, %zu refused\n",
+            what,
+            pool.LiveBytes(),
+            pool.PeakBytes(),
+            pool.Allocations(),
+            pool.FailedAllocations()
+        );
+    }
+
+    void DemonstrateMemoryLimit() {
+        // Create a separate Lua instance which may only use up to
+        // one megabyte of memory.
+        PoolAllocator pool;
+        pool.SetLimit(1024 * 1024);
+        const auto lua = lua_newstate(PoolAllocator::LuaAlloc, &pool);
+        lua_gc(lua, LUA_GCSTOP, 0);
+        luaL_openlibs(lua);
+        lua_gc(lua, LUA_GCRESTART, 0);
+
+        // Run a script which would use up all our memory if we let it.
+        // The allocator stops it once it reaches the limit, and we
+        // catch the error just like any other.
+        DemonstrateCallError(
+            lua,
+            R"(
+                local hoard = {}
+                while true do
+                    hoard[#hoard + 1] = string.rep("x", 1000) .. #hoard
+                end
+            )"
+        );
+        PrintMemoryUsage("Limited Lua instance", pool);
+
+        // The Lua instance is still usable after the error, and the
+        // memory held by the runaway script is reclaimed once it's garbage.
+        lua_gc(lua, LUA_GCCOLLECT, 0);
+        PrintMemoryUsage("After garbage collection", pool);
+        lua_close(lua);
+    }
+
     int AddAndRoundInLua(lua_State* lua, double a, double b) {
         // Load (compile) Lua script.
         //
@@ -173,14 +425,56 @@ namespace {
         return result;
     }
 
+    double MeasureAllocationHeavyScript(lua_Alloc allocator, void* ud) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto lua = lua_newstate(allocator, ud);
+        lua_gc(lua, LUA_GCSTOP, 0);
+        luaL_openlibs(lua);
+        lua_gc(lua, LUA_GCRESTART, 0);
+
+        // This script churns through lots of small strings and tables,
+        // which is where most of Lua's allocations typically come from.
+        (void)LoadScript(
+            lua,
+            R"(
+                local keep = {}
+                for i = 1, 500000 do
+                    keep[i % 1000 + 1] = {
+                        i,
+                        "item" .. i,
+                        { x = i, y = -i },
+                    }
+                end
+            )"
+        );
+        (void)lua_call(lua, 0, 0);
+        lua_close(lua);
+        const auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration< double, std::milli >(end - start).count();
+    }
+
+    void CompareAllocators() {
+        const auto systemMilliseconds = MeasureAllocationHeavyScript(LuaAllocator, NULL);
+        PoolAllocator pool;
+        const auto poolMilliseconds = MeasureAllocationHeavyScript(PoolAllocator::LuaAlloc, &pool);
+        (void)printf(
+            "Allocation-heavy script with realloc/free allocator: %.1f ms\n"
+            "Allocation-heavy script with pool allocator:         %.1f ms\n",
+            systemMilliseconds,
+            poolMilliseconds
+        );
+    }
+
 }
 
 int main(int argc, char* argv[]) {
     // Create the Lua instance.
     //
     // Here we use a custom allocator, giving us complete control over
-    // the dynamic memory allocated by Lua.
-    const auto lua = lua_newstate(LuaAllocator, NULL);
+    // the dynamic memory allocated by Lua.  The pool holds the memory
+    // for this one Lua instance, and so it must outlive the instance.
+    PoolAllocator pool;
+    const auto lua = lua_newstate(PoolAllocator::LuaAlloc, &pool);
 
     // Load standard Lua libraries.
     //
@@ -197,15 +491,24 @@ int main(int argc, char* argv[]) {
 
     // This will intentionally run a script which generates a runtime error, to
     // demonstrate how to handle it.
-    DemonstrateCallError(lua);
+    DemonstrateCallError(lua, "foobar()");
+
+    // This will intentionally run a script which uses too much memory, to
+    // demonstrate how to limit the memory a Lua instance can use.
+    DemonstrateMemoryLimit();
 
     // Use Lua to perform a slightly more difficult calculation.
     const auto answer = AddAndRoundInLua(lua, 14.9, 27.3);
     (void)printf("The answer is %d.\n", answer);
+    PrintMemoryUsage("Main Lua instance", pool);
 
     // Destroy the Lua instance.
     lua_close(lua);
 
+    // Compare how long an allocation-heavy script takes to run with
+    // each of the two custom allocators.
+    CompareAllocators();
+
     // All done!
     return EXIT_SUCCESS;
 }
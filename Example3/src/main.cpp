@@ -1,7 +1,13 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 extern "C" {
 #include <lua.h>
@@ -11,6 +17,470 @@ extern "C" {
 
 namespace {
 
+    // These are the names under which the metatables for each kind of
+    // userdata are registered in the Lua registry.
+    const char* const SIMPLE_VALUE_METATABLE = "SimpleValue";
+    const char* const SIMPLE_STRUCT_METATABLE = "SimpleStruct";
+    const char* const OWNED_OBJECT_METATABLE = "OwnedTestObject";
+    const char* const SHARED_OBJECT_METATABLE = "SharedTestObject";
+    const char* const UNCACHED_OBJECT_METATABLE = "UncachedTestObject";
+    const char* const LARGE_OBJECT_METATABLE = "LargeObject";
+
+    // This is the key of the Lua registry entry holding the deferred
+    // finalizer, if deferred finalization is enabled.  We use the address of
+    // this variable as the key, since it's unique and can't collide with
+    // anything else.
+    const char DEFERRED_FINALIZER_KEY = 0;
+
+    // This is the key of the Lua registry entry holding the cache of userdata
+    // made for shared objects.
+    const char SHARED_OBJECT_CACHE_KEY = 0;
+
+    // This is a string field whose Lua string is cached by each userdata
+    // which gives Lua access to it, so that reading the field over and over
+    // doesn't push a new copy of the string each time.  Every change to its
+    // value, including copying or moving another one into it, gives it a new
+    // version, which tells the caches their copy is out of date.  Versions
+    // come from one counter shared by all cached strings, so no two values
+    // ever have the same version, even in different objects.
+    class CachedString {
+    public:
+        CachedString()
+            : version_(NewVersion())
+        {
+        }
+
+        CachedString(const CachedString& other)
+            : value_(other.value_)
+            , version_(NewVersion())
+        {
+        }
+
+        CachedString(CachedString&& other)
+            : value_(std::move(other.value_))
+            , version_(NewVersion())
+        {
+            other.version_ = NewVersion();
+        }
+
+        CachedString& operator=(const CachedString& other) {
+            value_ = other.value_;
+            version_ = NewVersion();
+            return *this;
+        }
+
+        CachedString& operator=(CachedString&& other) {
+            value_ = std::move(other.value_);
+            version_ = NewVersion();
+            other.version_ = NewVersion();
+            return *this;
+        }
+
+        CachedString& operator=(std::string value) {
+            value_ = std::move(value);
+            version_ = NewVersion();
+            return *this;
+        }
+
+        const std::string& Get() const {
+            return value_;
+        }
+
+        lua_Integer Version() const {
+            return version_;
+        }
+
+    private:
+        static lua_Integer NewVersion() {
+            static std::atomic< lua_Integer > nextVersion(1);
+            return nextVersion.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        std::string value_;
+        lua_Integer version_;
+    };
+
+    // These functions push onto the Lua stack the value of a field of
+    // a C++ object, choosing the right Lua type for the C++ type.
+    //
+    // They're called by the `__index` metamethod, with the userdata at
+    // index 1 of the Lua stack, and given the position of the field in the
+    // list of fields, which fields that cache their values in the userdata
+    // use to find their entry in the cache.
+    void PushField(lua_State* lua, int value, lua_Integer position) {
+        lua_pushinteger(lua, value);
+    }
+
+    void PushField(lua_State* lua, const std::string& value, lua_Integer position) {
+        lua_pushlstring(lua, value.c_str(), value.length());
+    }
+
+    // The cache of a userdata is a table kept as its "user value", so it
+    // lives exactly as long as the userdata.  For the field at position `p`,
+    // entry `2p + 1` holds the Lua string, and entry `2p + 2` the version of
+    // the field it was made from, all in the fast "array part" of the table.
+    //
+    // Push the cache of the userdata at index 1 of the Lua stack, making it
+    // first if it doesn't have one yet.
+    void PushFieldCache(lua_State* lua) {
+        if (lua_getuservalue(lua, 1) != LUA_TTABLE) {
+            lua_pop(lua, 1);
+            lua_createtable(lua, 2, 0);
+            lua_pushvalue(lua, -1);
+            lua_setuservalue(lua, 1);
+        }
+    }
+
+    // Store the string at the top of the Lua stack in the cache at the
+    // given index, as the given version of the field at the given position,
+    // leaving the string on the stack.
+    void CacheFieldValue(lua_State* lua, int cache, lua_Integer position, lua_Integer version) {
+        lua_pushvalue(lua, -1);
+        lua_rawseti(lua, cache, 2 * position + 1);
+        lua_pushinteger(lua, version);
+        lua_rawseti(lua, cache, 2 * position + 2);
+    }
+
+    void PushField(lua_State* lua, const CachedString& value, lua_Integer position) {
+        PushFieldCache(lua);
+        const auto cache = lua_gettop(lua);
+        if (
+            (lua_rawgeti(lua, cache, 2 * position + 2) == LUA_TNUMBER)
+            && (lua_tointeger(lua, -1) == value.Version())
+        ) {
+            lua_pop(lua, 1);
+            (void)lua_rawgeti(lua, cache, 2 * position + 1);
+        } else {
+            lua_pop(lua, 1);
+            lua_pushlstring(lua, value.Get().c_str(), value.Get().length());
+            CacheFieldValue(lua, cache, position, value.Version());
+        }
+        lua_remove(lua, cache);
+    }
+
+    // These functions assign to a field of a C++ object the value at the
+    // given index on the Lua stack, raising a Lua error if the value
+    // doesn't have the right type.  Like `PushField`, they're called with
+    // the userdata at index 1 of the Lua stack.
+    void AssignField(lua_State* lua, int index, int& value, lua_Integer position) {
+        value = (int)luaL_checkinteger(lua, index);
+    }
+
+    void AssignField(lua_State* lua, int index, std::string& value, lua_Integer position) {
+        size_t length;
+        const auto chars = luaL_checklstring(lua, index, &length);
+        value.assign(chars, length);
+    }
+
+    // When Lua assigns a cached string field, Lua already has the string,
+    // so put it straight into the cache as the new version of the field.
+    void AssignField(lua_State* lua, int index, CachedString& value, lua_Integer position) {
+        size_t length;
+        const auto chars = luaL_checklstring(lua, index, &length);
+        value = std::string(chars, length);
+        PushFieldCache(lua);
+        lua_pushvalue(lua, index);
+        CacheFieldValue(lua, lua_gettop(lua) - 1, position, value.Version());
+        lua_pop(lua, 2);
+    }
+
+    // This describes one field of a C++ structure we want Lua to be able to
+    // access, by way of a pointer to the member holding the field.  The
+    // BIND_FIELD macro below adds the name of the field.
+    template< typename T, typename M, M T::*member > struct Field {
+        static void Push(lua_State* lua, const T& object, lua_Integer position) {
+            PushField(lua, object.*member, position);
+        }
+
+        static void Assign(lua_State* lua, T& object, int index, lua_Integer position) {
+            AssignField(lua, index, object.*member, position);
+        }
+    };
+
+#define BIND_FIELD(T, member) \
+    struct member##Field: Field< T, decltype(T::member), &T::member > { \
+        static const char* Name() { return #member; } \
+    }
+
+    // This lists the fields of a C++ structure we want Lua to be able to
+    // access.
+    template< typename... Fields > struct FieldList {};
+
+    // This is specialized for each C++ structure we want Lua to be able to
+    // access, with a `Fields` type listing its fields.  For example:
+    //
+    //     template<> struct LuaBinding< Point > {
+    //         BIND_FIELD(Point, x);
+    //         BIND_FIELD(Point, y);
+    //         typedef FieldList< xField, yField > Fields;
+    //     };
+    template< typename T > struct LuaBinding;
+
+    // These describe how to find the C++ object held in a userdata.  The
+    // object is either stored directly in the userdata, or the userdata
+    // holds a `std::shared_ptr` to it.
+    template< typename T > struct StoredByValue {
+        static T& Get(void* udata) {
+            return *(T*)udata;
+        }
+    };
+
+    template< typename T > struct StoredBySharedPointer {
+        static T& Get(void* udata) {
+            return **(std::shared_ptr< T >*)udata;
+        }
+    };
+
+    // This generates, at compile time, the `__index` and `__newindex`
+    // metamethods for a C++ structure from the list of its fields.
+    //
+    // Looking up a field by comparing its name against each field name as
+    // a `std::string` would mean making a copy of the key on every access,
+    // and then a series of string comparisons.  Instead, when the metatable
+    // is constructed, we make a Lua table which maps each field name to the
+    // field's position in the list, and give it to both metamethods as an
+    // "upvalue".  Lua keeps only one copy of each short string, with its hash
+    // already computed, so looking up the key in that table is a quick hash
+    // table lookup which allocates nothing.  The position then selects the
+    // function, generated for that field, to push or assign the field's value.
+    template< typename T, typename Storage, typename Fields > struct FieldDispatch;
+
+    template< typename T, typename Storage, typename... Fields >
+    struct FieldDispatch< T, Storage, FieldList< Fields... > > {
+        // Set the `__index` and `__newindex` metamethods in the metatable at
+        // the top of the Lua stack.
+        static void SetMetamethods(lua_State* lua) {
+            static const char* const names[] = {Fields::Name()...};
+            lua_createtable(lua, 0, (int)sizeof...(Fields));
+            for (size_t i = 0; i < sizeof...(Fields); ++i) {
+                lua_pushinteger(lua, (lua_Integer)i);
+                lua_setfield(lua, -2, names[i]);
+            }
+            lua_pushvalue(lua, -1);
+            lua_pushcclosure(lua, Index, 1);
+            lua_setfield(lua, -3, "__index");
+            lua_pushcclosure(lua, NewIndex, 1);
+            lua_setfield(lua, -2, "__newindex");
+        }
+
+    private:
+        // Return the position of the field named by the key at index 2 of
+        // the Lua stack, or -1 if the key doesn't name any field.
+        static lua_Integer LookUpField(lua_State* lua) {
+            lua_pushvalue(lua, 2);
+            if (lua_rawget(lua, lua_upvalueindex(1)) == LUA_TNUMBER) {
+                const auto position = lua_tointeger(lua, -1);
+                lua_pop(lua, 1);
+                return position;
+            }
+            lua_pop(lua, 1);
+            return -1;
+        }
+
+        static int Index(lua_State* lua) {
+            typedef void (*Push)(lua_State* lua, const T& object, lua_Integer position);
+            static const Push pushers[] = {&Fields::Push...};
+            auto& object = Storage::Get(lua_touserdata(lua, 1));
+            const auto position = LookUpField(lua);
+            if (position < 0) {
+                lua_pushnil(lua);
+            } else {
+                pushers[position](lua, object, position);
+            }
+            return 1;
+        }
+
+        static int NewIndex(lua_State* lua) {
+            typedef void (*Assign)(lua_State* lua, T& object, int index, lua_Integer position);
+            static const Assign assigners[] = {&Fields::Assign...};
+            auto& object = Storage::Get(lua_touserdata(lua, 1));
+            const auto position = LookUpField(lua);
+            if (position < 0) {
+                return luaL_error(lua, "no field named '%s'", luaL_tolstring(lua, 2, NULL));
+            }
+            assigners[position](lua, object, 3, position);
+            return 0;
+        }
+    };
+
+    // Set the `__index` and `__newindex` metamethods in the metatable at the
+    // top of the Lua stack, to allow Lua to access the fields of a C++ object
+    // of the given type held in the given way by a userdata.
+    template< typename T, template< typename > class Storage > void SetFieldMetamethods(lua_State* lua) {
+        FieldDispatch< T, Storage< T >, typename LuaBinding< T >::Fields >::SetMetamethods(lua);
+    }
+
+    // This takes C++ objects whose userdata have been garbage-collected, and
+    // destroys them later, away from the garbage collector.
+    //
+    // Destroying an object can be expensive; it may own large buffers or
+    // operating system handles, or be the last reference to a shared object
+    // with a chain of deleters.  A finalizer which does all of that while
+    // the garbage collector is running holds up the Lua script which
+    // happened to trigger the collection.  Instead, with deferred
+    // finalization enabled, finalizers just move the object into a queue,
+    // and the host program destroys the queued objects in batches when it's
+    // convenient, either by calling `Drain` itself, or by having a background
+    // thread do it.
+    //
+    // The queue is a lock-free linked list: finalizers push onto it with
+    // an atomic compare-and-swap, and draining takes the whole list at once
+    // with an atomic exchange, so neither ever waits for the other.
+    class DeferredFinalizer {
+    public:
+        // These are counters the finalizer keeps about its work.
+        struct Counters {
+            size_t depth = 0;
+            size_t peakDepth = 0;
+            size_t deferred = 0;
+            size_t destroyed = 0;
+            std::chrono::nanoseconds lastDrainTime = std::chrono::nanoseconds(0);
+            std::chrono::nanoseconds totalDrainTime = std::chrono::nanoseconds(0);
+        };
+
+        DeferredFinalizer() = default;
+
+        ~DeferredFinalizer() {
+            StopBackgroundThread();
+            (void)Drain();
+        }
+
+        DeferredFinalizer(const DeferredFinalizer&) = delete;
+        DeferredFinalizer& operator=(const DeferredFinalizer&) = delete;
+
+        // Take ownership of the given object, to destroy it later.
+        template< typename T > void Defer(T&& object) {
+            const auto node = new Holder< typename std::decay< T >::type >(std::forward< T >(object));
+            node->next = head_.load(std::memory_order_relaxed);
+            while (
+                !head_.compare_exchange_weak(
+                    node->next,
+                    node,
+                    std::memory_order_release,
+                    std::memory_order_relaxed
+                )
+            ) {
+            }
+            const auto depth = depth_.fetch_add(1, std::memory_order_relaxed) + 1;
+            auto peakDepth = peakDepth_.load(std::memory_order_relaxed);
+            while (
+                (depth > peakDepth)
+                && !peakDepth_.compare_exchange_weak(peakDepth, depth, std::memory_order_relaxed)
+            ) {
+            }
+            (void)deferred_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Destroy all the objects in the queue, in the order they were
+        // queued, returning how many were destroyed.
+        size_t Drain() {
+            const auto start = std::chrono::steady_clock::now();
+            auto node = head_.exchange(nullptr, std::memory_order_acquire);
+            Node* oldestFirst = nullptr;
+            while (node != nullptr) {
+                const auto next = node->next;
+                node->next = oldestFirst;
+                oldestFirst = node;
+                node = next;
+            }
+            size_t destroyed = 0;
+            while (oldestFirst != nullptr) {
+                const auto next = oldestFirst->next;
+                delete oldestFirst;
+                oldestFirst = next;
+                ++destroyed;
+            }
+            const auto drainTime = std::chrono::duration_cast< std::chrono::nanoseconds >(
+                std::chrono::steady_clock::now() - start
+            ).count();
+            (void)depth_.fetch_sub(destroyed, std::memory_order_relaxed);
+            (void)destroyed_.fetch_add(destroyed, std::memory_order_relaxed);
+            lastDrainTime_.store(drainTime, std::memory_order_relaxed);
+            (void)totalDrainTime_.fetch_add(drainTime, std::memory_order_relaxed);
+            return destroyed;
+        }
+
+        // Start a thread which drains the queue every `interval`.
+        void StartBackgroundThread(std::chrono::milliseconds interval) {
+            StopBackgroundThread();
+            stopping_ = false;
+            drainer_ = std::thread([this, interval]{
+                while (!stopping_) {
+                    std::this_thread::sleep_for(interval);
+                    (void)Drain();
+                }
+            });
+        }
+
+        void StopBackgroundThread() {
+            if (drainer_.joinable()) {
+                stopping_ = true;
+                drainer_.join();
+            }
+        }
+
+        Counters GetCounters() const {
+            Counters counters;
+            counters.depth = depth_.load(std::memory_order_relaxed);
+            counters.peakDepth = peakDepth_.load(std::memory_order_relaxed);
+            counters.deferred = deferred_.load(std::memory_order_relaxed);
+            counters.destroyed = destroyed_.load(std::memory_order_relaxed);
+            counters.lastDrainTime = std::chrono::nanoseconds(lastDrainTime_.load(std::memory_order_relaxed));
+            counters.totalDrainTime = std::chrono::nanoseconds(totalDrainTime_.load(std::memory_order_relaxed));
+            return counters;
+        }
+
+    private:
+        // This is one queued object, of any type.  Deleting the node
+        // destroys the object.
+        struct Node {
+            Node* next = nullptr;
+            virtual ~Node() = default;
+        };
+
+        template< typename T > struct Holder: Node {
+            explicit Holder(T&& object)
+                : object(std::move(object))
+            {
+            }
+
+            T object;
+        };
+
+        std::atomic< Node* > head_{nullptr};
+        std::atomic< size_t > depth_{0};
+        std::atomic< size_t > peakDepth_{0};
+        std::atomic< size_t > deferred_{0};
+        std::atomic< size_t > destroyed_{0};
+        std::atomic< long long > lastDrainTime_{0};
+        std::atomic< long long > totalDrainTime_{0};
+        std::atomic< bool > stopping_{false};
+        std::thread drainer_;
+    };
+
+    // Turn on deferred finalization of C++ objects owned by userdata, handing
+    // them to the given finalizer, or turn it off if the finalizer is null.
+    // Turn it off before destroying the finalizer.
+    void SetDeferredFinalizer(lua_State* lua, DeferredFinalizer* finalizer) {
+        lua_pushlightuserdata(lua, finalizer);
+        lua_rawsetp(lua, LUA_REGISTRYINDEX, &DEFERRED_FINALIZER_KEY);
+    }
+
+    // Clean up the C++ object held in a userdata being garbage-collected.
+    // If deferred finalization is enabled, move the object to the deferred
+    // finalizer; otherwise destroy it right away.  Either way, the object
+    // left in the userdata is destroyed, which for a moved-from object is
+    // cheap.
+    template< typename T > void Finalize(lua_State* lua, T* udata) {
+        (void)lua_rawgetp(lua, LUA_REGISTRYINDEX, &DEFERRED_FINALIZER_KEY);
+        const auto finalizer = (DeferredFinalizer*)lua_touserdata(lua, -1);
+        lua_pop(lua, 1);
+        if (finalizer != nullptr) {
+            finalizer->Defer(std::move(*udata));
+        }
+        udata->~T();
+    }
+
     void PushSimpleValue(lua_State* lua, int value) {
         // Create userdata value, which is essentially a pointer to
         // memory allocated by Lua that is shared between C++ and Lua.
@@ -20,17 +490,24 @@ namespace {
         // with values.  Since this is a simple value, just copy into it.
         udata = value;
 
-        // Construct a simple metatable for the userdata which allows Lua
-        // to call the userdata like a function, returning the value
-        // stored inside the userdata.
-        lua_newtable(lua);
-        lua_pushstring(lua, "__call");
-        lua_pushcfunction(lua, [](lua_State* lua){
-            auto& udata = *(int*)lua_touserdata(lua, 1);
-            lua_pushinteger(lua, udata);
-            return 1;
-        });
-        lua_settable(lua, -3);
+        // Give the userdata a simple metatable which allows Lua to call the
+        // userdata like a function, returning the value stored inside the
+        // userdata.
+        //
+        // All userdata of the same kind can share the same metatable, so
+        // rather than making a new one each time, we construct it only once
+        // and keep it in the Lua registry.  `luaL_newmetatable` pushes the
+        // metatable already registered under the given name, or creates,
+        // registers, and pushes a new empty one (returning 1) if there isn't
+        // one yet, in which case we need to fill it in.
+        if (luaL_newmetatable(lua, SIMPLE_VALUE_METATABLE)) {
+            lua_pushcfunction(lua, [](lua_State* lua){
+                auto& udata = *(int*)lua_touserdata(lua, 1);
+                lua_pushinteger(lua, udata);
+                return 1;
+            });
+            lua_setfield(lua, -2, "__call");
+        }
         lua_setmetatable(lua, -2);
     }
 
@@ -39,6 +516,12 @@ namespace {
         int y = 0;
     };
 
+    template<> struct LuaBinding< SimpleStruct > {
+        BIND_FIELD(SimpleStruct, x);
+        BIND_FIELD(SimpleStruct, y);
+        typedef FieldList< xField, yField > Fields;
+    };
+
     void PushSimpleStruct(lua_State* lua, const SimpleStruct& simpleStruct) {
         // Create userdata value, which is essentially a pointer to
         // memory allocated by Lua that is shared between C++ and Lua.
@@ -48,30 +531,25 @@ namespace {
         // with values.  Since this is a simple structure, just copy into it.
         udata = simpleStruct;
 
-        // Construct a simple metatable for the userdata which allows Lua
-        // to index the userdata like a table, returning the values
-        // of the fields stored inside the structure.
-        lua_newtable(lua);
-        lua_pushstring(lua, "__index");
-        lua_pushcfunction(lua, [](lua_State* lua){
-            auto& udata = *(SimpleStruct*)lua_touserdata(lua, 1);
-            const std::string key = lua_tostring(lua, 2);
-            if (key == "x") {
-                lua_pushinteger(lua, udata.x);
-            } else if (key == "y") {
-                lua_pushinteger(lua, udata.y);
-            } else {
-                lua_pushnil(lua);
-            }
-            return 1;
-        });
-        lua_settable(lua, -3);
+        // Give the userdata a simple metatable which allows Lua to index
+        // the userdata like a table, reading and writing the fields
+        // stored inside the structure.  As before, the metatable is
+        // constructed only once and shared by all userdata of this kind.
+        if (luaL_newmetatable(lua, SIMPLE_STRUCT_METATABLE)) {
+            SetFieldMetamethods< SimpleStruct, StoredByValue >(lua);
+        }
         lua_setmetatable(lua, -2);
     }
 
     struct TestObject {
         int v;
-        std::string s;
+        CachedString s;
+    };
+
+    template<> struct LuaBinding< TestObject > {
+        BIND_FIELD(TestObject, v);
+        BIND_FIELD(TestObject, s);
+        typedef FieldList< vField, sField > Fields;
     };
 
     void PushOwnedObject(lua_State* lua, TestObject&& testObject) {
@@ -91,42 +569,29 @@ namespace {
         // the userdata.
         new (udata) TestObject(std::move(testObject));
 
-        // Construct a metatable for the userdata which allows
-        // Lua to interact with the object in two ways:
+        // Give the userdata a metatable (constructed only once and shared by
+        // all userdata of this kind) which allows Lua to interact with the
+        // object in two ways:
         // 1) The `__gc` metamethod tells Lua that this object has a
         //    "finalizer" or function which needs to be called to clean up the
         //    object before its memory is garbage-collected.  In our finalizer,
-        //    destroy the owned C++ object by calling its destructor explicitly.
-        // 2) The `__index` metamethod allows Lua to index the userdata like a
-        //    table, returning the values of the fields stored inside the
-        //    structure.
-        lua_newtable(lua);
-        lua_pushstring(lua, "__gc");
-        lua_pushcfunction(lua, [](lua_State* lua){
-            (void)printf("Releasing shared object.\n");
-            auto udata = (TestObject*)lua_touserdata(lua, 1);
-            udata->~TestObject();
-            return 0;
-        });
-        lua_settable(lua, -3);
-        lua_pushstring(lua, "__index");
-        lua_pushcfunction(lua, [](lua_State* lua){
-            auto& udata = *(TestObject*)lua_touserdata(lua, 1);
-            const std::string key = lua_tostring(lua, 2);
-            if (key == "v") {
-                lua_pushinteger(lua, udata.v);
-            } else if (key == "s") {
-                lua_pushlstring(lua, udata.s.c_str(), udata.s.length());
-            } else {
-                lua_pushnil(lua);
-            }
-            return 1;
-        });
-        lua_settable(lua, -3);
+        //    destroy the owned C++ object by calling its destructor explicitly,
+        //    or hand it off to be destroyed later (see `Finalize`).
+        // 2) The `__index` and `__newindex` metamethods allow Lua to index
+        //    the userdata like a table, reading and writing the fields stored
+        //    inside the structure.
+        if (luaL_newmetatable(lua, OWNED_OBJECT_METATABLE)) {
+            lua_pushcfunction(lua, [](lua_State* lua){
+                Finalize(lua, (TestObject*)lua_touserdata(lua, 1));
+                return 0;
+            });
+            lua_setfield(lua, -2, "__gc");
+            SetFieldMetamethods< TestObject, StoredByValue >(lua);
+        }
         lua_setmetatable(lua, -2);
     }
 
-    void PushSharedObject(lua_State* lua, const std::shared_ptr< TestObject >& testObject) {
+    void PushNewSharedObject(lua_State* lua, const std::shared_ptr< TestObject >& testObject) {
         // Create userdata value, which is essentially a pointer to
         // memory allocated by Lua that is shared between C++ and Lua.
         //
@@ -145,39 +610,106 @@ namespace {
         // the reference inside the userdata.
         new (udata) std::shared_ptr< TestObject >(testObject);
 
-        // Construct a metatable for the userdata which allows
-        // Lua to interact with the object in two ways:
+        // Give the userdata a metatable (constructed only once and shared by
+        // all userdata of this kind) which allows Lua to interact with the
+        // object in two ways:
         // 1) The `__gc` metamethod tells Lua that this object has a
         //    "finalizer" or function which needs to be called to clean up the
         //    object before its memory is garbage-collected.  In our finalizer,
         //    destroy Lua's reference to the shared C++ object by calling the
-        //    shared-pointer destructor explicitly.
-        // 2) The `__index` metamethod allows Lua to index the userdata like a
-        //    table, returning the values of the fields stored inside the
-        //    structure.
-        lua_newtable(lua);
-        lua_pushstring(lua, "__gc");
-        lua_pushcfunction(lua, [](lua_State* lua){
-            (void)printf("Releasing shared object.\n");
-            auto udata = (std::shared_ptr< TestObject >*)lua_touserdata(lua, 1);
-            udata->~shared_ptr< TestObject >();
-            return 0;
-        });
-        lua_settable(lua, -3);
-        lua_pushstring(lua, "__index");
-        lua_pushcfunction(lua, [](lua_State* lua){
-            auto& udata = **(std::shared_ptr< TestObject >*)lua_touserdata(lua, 1);
-            const std::string key = lua_tostring(lua, 2);
-            if (key == "v") {
-                lua_pushinteger(lua, udata.v);
-            } else if (key == "s") {
-                lua_pushlstring(lua, udata.s.c_str(), udata.s.length());
-            } else {
-                lua_pushnil(lua);
-            }
-            return 1;
-        });
-        lua_settable(lua, -3);
+        //    shared-pointer destructor explicitly, or hand the reference off
+        //    to be released later (see `Finalize`).
+        // 2) The `__index` and `__newindex` metamethods allow Lua to index
+        //    the userdata like a table, reading and writing the fields stored
+        //    inside the structure.
+        if (luaL_newmetatable(lua, SHARED_OBJECT_METATABLE)) {
+            lua_pushcfunction(lua, [](lua_State* lua){
+                Finalize(lua, (std::shared_ptr< TestObject >*)lua_touserdata(lua, 1));
+                return 0;
+            });
+            lua_setfield(lua, -2, "__gc");
+            SetFieldMetamethods< TestObject, StoredBySharedPointer >(lua);
+        }
+        lua_setmetatable(lua, -2);
+    }
+
+    void PushSharedObject(lua_State* lua, const std::shared_ptr< TestObject >& testObject) {
+        // Keep a cache of the userdata made for shared objects, so that
+        // pushing the same object again gives Lua the same userdata, rather
+        // than making a new one and another `std::shared_ptr` to go in it.
+        // Besides saving time, this means Lua sees the object as one value,
+        // so comparing two pushes of it with `==` gives `true`.
+        //
+        // The cache is a table in the Lua registry mapping the address of each
+        // object (as a "light userdata") to its userdata.  It has "weak"
+        // values, so it doesn't keep the userdata alive by itself; once
+        // nothing else in Lua refers to a userdata, the garbage collector
+        // removes it from the cache, and then finalizes it as usual.
+        if (lua_rawgetp(lua, LUA_REGISTRYINDEX, &SHARED_OBJECT_CACHE_KEY) != LUA_TTABLE) {
+            lua_pop(lua, 1);
+            lua_newtable(lua);
+            lua_createtable(lua, 0, 1);
+            lua_pushliteral(lua, "v");
+            lua_setfield(lua, -2, "__mode");
+            lua_setmetatable(lua, -2);
+            lua_pushvalue(lua, -1);
+            lua_rawsetp(lua, LUA_REGISTRYINDEX, &SHARED_OBJECT_CACHE_KEY);
+        }
+        if (lua_rawgetp(lua, -1, testObject.get()) == LUA_TUSERDATA) {
+            lua_remove(lua, -2);
+            return;
+        }
+        lua_pop(lua, 1);
+        PushNewSharedObject(lua, testObject);
+        lua_pushvalue(lua, -1);
+        lua_rawsetp(lua, -3, testObject.get());
+        lua_remove(lua, -2);
+    }
+
+    // This is how `TestObject` would look if its string field weren't
+    // cached, so every read of the field pushes a new copy of the string.
+    // It's only here to measure the difference.
+    struct UncachedTestObject {
+        int v;
+        std::string s;
+    };
+
+    template<> struct LuaBinding< UncachedTestObject > {
+        BIND_FIELD(UncachedTestObject, v);
+        BIND_FIELD(UncachedTestObject, s);
+        typedef FieldList< vField, sField > Fields;
+    };
+
+    void PushUncachedObject(lua_State* lua, UncachedTestObject&& testObject) {
+        auto udata = (UncachedTestObject*)lua_newuserdata(lua, sizeof(UncachedTestObject));
+        new (udata) UncachedTestObject(std::move(testObject));
+        if (luaL_newmetatable(lua, UNCACHED_OBJECT_METATABLE)) {
+            lua_pushcfunction(lua, [](lua_State* lua){
+                Finalize(lua, (UncachedTestObject*)lua_touserdata(lua, 1));
+                return 0;
+            });
+            lua_setfield(lua, -2, "__gc");
+            SetFieldMetamethods< UncachedTestObject, StoredByValue >(lua);
+        }
+        lua_setmetatable(lua, -2);
+    }
+
+    // This is an object which owns a large buffer, making it expensive to
+    // destroy.
+    struct LargeObject {
+        std::vector< char > buffer;
+    };
+
+    void PushLargeObject(lua_State* lua, LargeObject&& largeObject) {
+        auto udata = (LargeObject*)lua_newuserdata(lua, sizeof(LargeObject));
+        new (udata) LargeObject(std::move(largeObject));
+        if (luaL_newmetatable(lua, LARGE_OBJECT_METATABLE)) {
+            lua_pushcfunction(lua, [](lua_State* lua){
+                Finalize(lua, (LargeObject*)lua_touserdata(lua, 1));
+                return 0;
+            });
+            lua_setfield(lua, -2, "__gc");
+        }
         lua_setmetatable(lua, -2);
     }
 
@@ -197,6 +729,281 @@ namespace {
         (void)lua_call(lua, nargs, 0);
     }
 
+    // This is how `PushSimpleStruct` would work if it constructed a new
+    // metatable for every userdata, rather than sharing one, and looked up
+    // fields by comparing the key against each field name as a `std::string`.
+    // It's only here to measure the difference.
+    void PushSimpleStructWithOwnMetatable(lua_State* lua, const SimpleStruct& simpleStruct) {
+        auto& udata = *(SimpleStruct*)lua_newuserdata(lua, sizeof(SimpleStruct));
+        udata = simpleStruct;
+        lua_newtable(lua);
+        lua_pushcfunction(lua, [](lua_State* lua){
+            auto& udata = *(SimpleStruct*)lua_touserdata(lua, 1);
+            const std::string key = lua_tostring(lua, 2);
+            if (key == "x") {
+                lua_pushinteger(lua, udata.x);
+            } else if (key == "y") {
+                lua_pushinteger(lua, udata.y);
+            } else {
+                lua_pushnil(lua);
+            }
+            return 1;
+        });
+        lua_setfield(lua, -2, "__index");
+        lua_setmetatable(lua, -2);
+    }
+
+    size_t GetBytesInUse(lua_State* lua) {
+        return (
+            (size_t)lua_gc(lua, LUA_GCCOUNT, 0) * 1024
+            + (size_t)lua_gc(lua, LUA_GCCOUNTB, 0)
+        );
+    }
+
+    void MeasurePushes(
+        lua_State* lua,
+        const char* what,
+        void (*push)(lua_State* lua, const SimpleStruct& simpleStruct)
+    ) {
+        SimpleStruct xy;
+        xy.x = 4;
+        xy.y = -7;
+
+        // Measure how much memory each push allocates, which is memory the
+        // garbage collector will later have to reclaim.  Stop the collector
+        // while doing this so it doesn't reclaim any of it while we measure.
+        const size_t numPushesForMemory = 1000;
+        lua_gc(lua, LUA_GCCOLLECT, 0);
+        lua_gc(lua, LUA_GCSTOP, 0);
+        const auto bytesBefore = GetBytesInUse(lua);
+        for (size_t i = 0; i < numPushesForMemory; ++i) {
+            push(lua, xy);
+            lua_pop(lua, 1);
+        }
+        const auto bytesAfter = GetBytesInUse(lua);
+        lua_gc(lua, LUA_GCRESTART, 0);
+        lua_gc(lua, LUA_GCCOLLECT, 0);
+
+        // Measure how long each push takes, including the time the
+        // garbage collector spends reclaiming the memory.
+        const size_t numPushesForTime = 200000;
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < numPushesForTime; ++i) {
+            push(lua, xy);
+            lua_pop(lua, 1);
+        }
+        const auto end = std::chrono::steady_clock::now();
+        (void)printf(
+            "%s: %.0f ns/push, %.0f bytes/push\n",
+            what,
+            std::chrono::duration< double, std::nano >(end - start).count()
+            / (double)numPushesForTime,
+            (double)(bytesAfter - bytesBefore) / (double)numPushesForMemory
+        );
+    }
+
+    // Measure how long it takes to push shared objects Lua already has,
+    // over and over, and how much memory each push allocates.
+    void MeasureSharedPushes(
+        lua_State* lua,
+        const char* what,
+        void (*push)(lua_State* lua, const std::shared_ptr< TestObject >& testObject)
+    ) {
+        const size_t numObjects = 2000;
+        const size_t numRounds = 100;
+        std::vector< std::shared_ptr< TestObject > > objects;
+        for (size_t i = 0; i < numObjects; ++i) {
+            objects.push_back(std::make_shared< TestObject >());
+        }
+
+        // Have Lua hold on to each object, as a script keeping track of
+        // long-lived objects would.
+        lua_createtable(lua, (int)numObjects, 0);
+        for (size_t i = 0; i < numObjects; ++i) {
+            push(lua, objects[i]);
+            lua_rawseti(lua, -2, (lua_Integer)i + 1);
+        }
+
+        // Measure memory with the collector stopped, and then time.
+        lua_gc(lua, LUA_GCCOLLECT, 0);
+        lua_gc(lua, LUA_GCSTOP, 0);
+        const auto bytesBefore = GetBytesInUse(lua);
+        for (size_t i = 0; i < numObjects; ++i) {
+            push(lua, objects[i]);
+            lua_pop(lua, 1);
+        }
+        const auto bytesAfter = GetBytesInUse(lua);
+        lua_gc(lua, LUA_GCRESTART, 0);
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t round = 0; round < numRounds; ++round) {
+            for (size_t i = 0; i < numObjects; ++i) {
+                push(lua, objects[i]);
+                lua_pop(lua, 1);
+            }
+        }
+        const auto end = std::chrono::steady_clock::now();
+        lua_pop(lua, 1);
+        lua_gc(lua, LUA_GCCOLLECT, 0);
+        (void)printf(
+            "%s: %.0f ns/push, %.0f bytes/push\n",
+            what,
+            std::chrono::duration< double, std::nano >(end - start).count()
+            / (double)(numObjects * numRounds),
+            (double)(bytesAfter - bytesBefore) / (double)numObjects
+        );
+    }
+
+    // Measure how long the garbage collector takes to collect a batch of
+    // userdata owning large objects, either destroying the objects itself or
+    // deferring their destruction to the given finalizer (if not null).
+    // The deferred objects are destroyed after each collection, unless the
+    // finalizer's background thread is doing that.
+    void MeasureFinalization(
+        lua_State* lua,
+        const char* what,
+        DeferredFinalizer* finalizer,
+        bool drainInBackground = false
+    ) {
+        const int numRounds = 10;
+        const int numObjects = 200;
+        const size_t bufferSize = 512 * 1024;
+        SetDeferredFinalizer(lua, finalizer);
+        std::chrono::nanoseconds totalCollectTime(0);
+        std::chrono::nanoseconds maxCollectTime(0);
+        for (int round = 0; round < numRounds; ++round) {
+            // Make a batch of userdata and then drop them all.
+            lua_createtable(lua, numObjects, 0);
+            for (int i = 0; i < numObjects; ++i) {
+                LargeObject largeObject;
+                largeObject.buffer.resize(bufferSize, (char)i);
+                PushLargeObject(lua, std::move(largeObject));
+                lua_rawseti(lua, -2, i + 1);
+            }
+            lua_pop(lua, 1);
+
+            // Measure how long it takes to collect them.
+            const auto start = std::chrono::steady_clock::now();
+            lua_gc(lua, LUA_GCCOLLECT, 0);
+            const auto collectTime = std::chrono::duration_cast< std::chrono::nanoseconds >(
+                std::chrono::steady_clock::now() - start
+            );
+            totalCollectTime += collectTime;
+            maxCollectTime = std::max(maxCollectTime, collectTime);
+            if ((finalizer != nullptr) && !drainInBackground) {
+                (void)finalizer->Drain();
+            }
+        }
+        SetDeferredFinalizer(lua, nullptr);
+        if (drainInBackground) {
+            finalizer->StopBackgroundThread();
+            (void)finalizer->Drain();
+        }
+        (void)printf(
+            "%s: collection pause avg %.2f ms max %.2f ms",
+            what,
+            std::chrono::duration< double, std::milli >(totalCollectTime).count() / numRounds,
+            std::chrono::duration< double, std::milli >(maxCollectTime).count()
+        );
+        if (finalizer == nullptr) {
+            (void)printf("\n");
+        } else {
+            const auto counters = finalizer->GetCounters();
+            (void)printf(
+                "; %zu deferred, peak queue depth %zu, %.2f ms draining\n",
+                counters.deferred,
+                counters.peakDepth,
+                std::chrono::duration< double, std::milli >(counters.totalDrainTime).count()
+            );
+        }
+    }
+
+    // Measure how long it takes Lua to read a string field of an owned
+    // object over and over, with strings of the given length, and how much
+    // memory the reads allocate.
+    template< typename T > void MeasureStringFieldReads(
+        lua_State* lua,
+        const char* what,
+        void (*push)(lua_State* lua, T&& testObject),
+        size_t length
+    ) {
+        (void)luaL_loadstring(lua, R"lua(
+            local udata, n = ...
+            local total = 0
+            for i = 1, n do
+                total = total + #udata.s
+            end
+            return total
+        )lua");
+        T testObject;
+        testObject.v = 0;
+        testObject.s = std::string(length, 'x');
+        push(lua, std::move(testObject));
+
+        // Measure how much memory the reads allocate, with the garbage
+        // collector stopped so it doesn't reclaim any of it while we measure.
+        const int numReadsForMemory = 1000;
+        lua_pushvalue(lua, -2);
+        lua_pushvalue(lua, -2);
+        lua_pushinteger(lua, numReadsForMemory);
+        lua_gc(lua, LUA_GCCOLLECT, 0);
+        lua_gc(lua, LUA_GCSTOP, 0);
+        const auto bytesBefore = GetBytesInUse(lua);
+        (void)lua_call(lua, 2, 1);
+        const auto bytesAfter = GetBytesInUse(lua);
+        lua_gc(lua, LUA_GCRESTART, 0);
+        lua_pop(lua, 1);
+
+        // Measure how long the reads take, including the time the garbage
+        // collector spends reclaiming the memory.
+        const int numReadsForTime = 200000;
+        lua_pushinteger(lua, numReadsForTime);
+        const auto start = std::chrono::steady_clock::now();
+        (void)lua_call(lua, 2, 1);
+        const auto end = std::chrono::steady_clock::now();
+        lua_pop(lua, 1);
+        lua_gc(lua, LUA_GCCOLLECT, 0);
+        (void)printf(
+            "%s, %5zu-byte string: %7.1f ns/read, %7.1f bytes/read\n",
+            what,
+            length,
+            std::chrono::duration< double, std::nano >(end - start).count()
+            / (double)numReadsForTime,
+            (double)(bytesAfter - bytesBefore) / (double)numReadsForMemory
+        );
+    }
+
+    void MeasureFieldAccess(
+        lua_State* lua,
+        const char* what,
+        void (*push)(lua_State* lua, const SimpleStruct& simpleStruct)
+    ) {
+        // Have Lua read two fields of the same userdata over and over.
+        const int numLoops = 1000000;
+        (void)luaL_loadstring(lua, R"lua(
+            local udata, n = ...
+            local sum = 0
+            for i = 1, n do
+                sum = sum + udata.x + udata.y
+            end
+            return sum
+        )lua");
+        SimpleStruct xy;
+        xy.x = 4;
+        xy.y = -7;
+        push(lua, xy);
+        lua_pushinteger(lua, numLoops);
+        const auto start = std::chrono::steady_clock::now();
+        (void)lua_call(lua, 2, 1);
+        const auto end = std::chrono::steady_clock::now();
+        lua_pop(lua, 1);
+        (void)printf(
+            "%s: %.1f ns/field access\n",
+            what,
+            std::chrono::duration< double, std::nano >(end - start).count()
+            / (2.0 * numLoops)
+        );
+    }
+
 }
 
 int main(int argc, char* argv[]) {
@@ -229,6 +1036,8 @@ int main(int argc, char* argv[]) {
     WithLua(lua, R"lua(
         local udata = ...
         print("Simple struct: (x=" .. udata.x .. ", y=" .. udata.y .. ")")
+        udata.x = udata.x * 10
+        print("Simple struct after update: (x=" .. udata.x .. ", y=" .. udata.y .. ")")
     )lua", 1);
 
     // Move an object into Lua as a "userdata" which takes ownership
@@ -269,6 +1078,71 @@ int main(int argc, char* argv[]) {
         print("Shared object: (v=" .. udata.v .. ", s='" .. udata.s .. "')")
     )lua", 1);
 
+    // Push another shared object twice, and verify Lua sees both as the
+    // same value, because the second push reuses the userdata made by the
+    // first.
+    const auto obj3 = std::make_shared< TestObject >();
+    PushSharedObject(lua, obj3);
+    PushSharedObject(lua, obj3);
+    WithLua(lua, R"lua(
+        local a, b = ...
+        print("Same shared object pushed twice is one value: " .. tostring(a == b))
+    )lua", 2);
+
+    // Have Lua read a string field of the shared object, which caches the
+    // Lua string in the userdata.  Then change the field from C++, and
+    // verify that Lua sees the new value, because the change marked the
+    // cached string as out of date.
+    obj3->s = "before";
+    PushSharedObject(lua, obj3);
+    WithLua(lua, R"lua(
+        local udata = ...
+        print("Shared object string: '" .. udata.s .. "'")
+    )lua", 1);
+    obj3->s = "after";
+    PushSharedObject(lua, obj3);
+    WithLua(lua, R"lua(
+        local udata = ...
+        print("Shared object string after C++ changed it: '" .. udata.s .. "'")
+        udata.s = "changed by Lua"
+    )lua", 1);
+    (void)printf("Shared object string after Lua changed it: '%s'\n", obj3->s.Get().c_str());
+
+    // Compare the cost of pushing shared objects Lua already has, with and
+    // without the cache of userdata made for them.
+    MeasureSharedPushes(lua, "Shared object, no cache", PushNewSharedObject);
+    MeasureSharedPushes(lua, "Shared object, cached  ", PushSharedObject);
+
+    // Compare the cost of reading string fields over and over, with and
+    // without the strings cached in the userdata.
+    for (size_t length = 16; length <= 16384; length *= 32) {
+        MeasureStringFieldReads(lua, "Uncached", PushUncachedObject, length);
+        MeasureStringFieldReads(lua, "Cached  ", PushOwnedObject, length);
+    }
+
+    // Compare the cost of accessing the fields of a userdata by comparing
+    // strings against looking them up in a table of field names.
+    MeasureFieldAccess(lua, "String comparisons", PushSimpleStructWithOwnMetatable);
+    MeasureFieldAccess(lua, "Field name table  ", PushSimpleStruct);
+
+    // Compare the cost of pushing userdata which share one metatable
+    // against userdata which each get their own metatable.
+    MeasurePushes(lua, "Metatable per push", PushSimpleStructWithOwnMetatable);
+    MeasurePushes(lua, "Shared metatable  ", PushSimpleStruct);
+
+    // Compare the garbage collection pauses when finalizers destroy large
+    // objects themselves against when they defer that work.
+    MeasureFinalization(lua, "Inline finalization    ", nullptr);
+    {
+        DeferredFinalizer finalizer;
+        MeasureFinalization(lua, "Deferred, host drains  ", &finalizer);
+    }
+    {
+        DeferredFinalizer finalizer;
+        finalizer.StartBackgroundThread(std::chrono::milliseconds(1));
+        MeasureFinalization(lua, "Deferred, thread drains", &finalizer, true);
+    }
+
     // Destroy the Lua instance.
     //
     // Note that since Lua finalizes objects during garbage collection,
@@ -1,7 +1,14 @@
+#include <algorithm>
+#include <chrono>
 #include <memory>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 extern "C" {
 #include <lua.h>
@@ -27,6 +34,761 @@ namespace {
         (void)lua_call(lua, nargs, nresults);
     }
 
+    // This holds references from C++ to Lua values, like the Lua registry
+    // does with `luaL_ref`, but in a table of its own, giving out references
+    // as `Handle` objects which release their references when destroyed.
+    //
+    // Using a dedicated table, rather than the registry, makes references
+    // cheaper to use in two ways:
+    // 1) References are numbered densely from 1, reusing released numbers
+    //    first, so all the values fit in the "array part" of the table,
+    //    where looking one up is just indexing an array.
+    // 2) The list of released numbers is kept in C++, rather than in the
+    //    table itself as `luaL_ref` does, so taking and releasing a reference
+    //    each take a single operation on the table.
+    //
+    // The table itself is anchored in the Lua registry by its own registry
+    // reference, which only keeps it alive; it's never kept at a fixed
+    // position on the stack.  To get the full benefit, push the table once
+    // with `Push` for a run of work, and pass its stack index to the
+    // functions taking one, so each fetch is a single `lua_rawgeti` on the
+    // table.  The functions without a stack index fetch the table from the
+    // registry first, which is simpler but costs a second lookup each time.
+    // The reference table can be used at any level of the Lua stack,
+    // including from C functions called by Lua, and must be destroyed before
+    // the Lua instance is closed.
+    class RefTable {
+    public:
+        struct Pinned;
+
+        // This owns one reference held by a reference table.  It can be
+        // moved but not copied, and releases its reference when destroyed.
+        class Handle {
+        public:
+            Handle() = default;
+
+            ~Handle() {
+                Release();
+            }
+
+            Handle(Handle&& other)
+                : table_(other.table_)
+                , slot_(other.slot_)
+            {
+                other.table_ = nullptr;
+            }
+
+            Handle& operator=(Handle&& other) {
+                if (this != &other) {
+                    Release();
+                    table_ = other.table_;
+                    slot_ = other.slot_;
+                    other.table_ = nullptr;
+                }
+                return *this;
+            }
+
+            Handle(const Handle&) = delete;
+            Handle& operator=(const Handle&) = delete;
+
+            explicit operator bool() const {
+                return (table_ != nullptr);
+            }
+
+            // Push the referenced value onto the Lua stack, taking it from
+            // the table pushed by `RefTable::Push` at the given (absolute)
+            // stack index.
+            void Push(int tableIndex) const {
+                (void)lua_rawgeti(table_->lua_, tableIndex, slot_);
+            }
+
+            // Push the referenced value onto the Lua stack, fetching the
+            // table from the registry first.  This briefly uses one more
+            // stack slot.
+            void Push() const {
+                const auto lua = table_->lua_;
+                const auto tableIndex = table_->Push();
+                Push(tableIndex);
+                lua_remove(lua, tableIndex);
+            }
+
+            // Pair this handle with the stack index of its table, for
+            // passing to `Call`.
+            RefTable::Pinned Pin(int tableIndex) const;
+
+            // Release the reference early.
+            void Release() {
+                if (table_ != nullptr) {
+                    table_->Release(slot_);
+                    table_ = nullptr;
+                }
+            }
+
+        private:
+            friend class RefTable;
+
+            Handle(RefTable* table, int slot)
+                : table_(table)
+                , slot_(slot)
+            {
+            }
+
+            RefTable* table_ = nullptr;
+            int slot_ = 0;
+        };
+
+        explicit RefTable(lua_State* lua)
+            : lua_(lua)
+        {
+            lua_newtable(lua);
+            tableRef_ = luaL_ref(lua, LUA_REGISTRYINDEX);
+        }
+
+        ~RefTable() {
+            luaL_unref(lua_, LUA_REGISTRYINDEX, tableRef_);
+        }
+
+        RefTable(const RefTable&) = delete;
+        RefTable& operator=(const RefTable&) = delete;
+
+        // Push the table itself onto the Lua stack, and return its absolute
+        // stack index.  The caller pops it when done.
+        int Push() const {
+            (void)lua_rawgeti(lua_, LUA_REGISTRYINDEX, tableRef_);
+            return lua_gettop(lua_);
+        }
+
+        // Pop the value at the top of the Lua stack, and return a handle
+        // holding a reference to it, storing it in the table pushed by
+        // `Push` at the given (absolute) stack index.
+        Handle Acquire(int tableIndex) {
+            int slot;
+            if (freeSlots_.empty()) {
+                slot = ++size_;
+            } else {
+                slot = freeSlots_.back();
+                freeSlots_.pop_back();
+            }
+            lua_rawseti(lua_, tableIndex, slot);
+            return Handle(this, slot);
+        }
+
+        // Pop the value at the top of the Lua stack, and return a handle
+        // holding a reference to it, fetching the table from the registry
+        // first.
+        Handle Acquire() {
+            const auto tableIndex = Push();
+            lua_insert(lua_, -2);
+            auto handle = Acquire(tableIndex - 1);
+            lua_pop(lua_, 1);
+            return handle;
+        }
+
+        // Release all the given handles at once, fetching the table only
+        // once for all of them.
+        void Release(std::vector< Handle >& handles) {
+            freeSlots_.reserve(freeSlots_.size() + handles.size());
+            (void)Push();
+            for (auto& handle: handles) {
+                if (handle.table_ == this) {
+                    lua_pushnil(lua_);
+                    lua_rawseti(lua_, -2, handle.slot_);
+                    freeSlots_.push_back(handle.slot_);
+                    handle.table_ = nullptr;
+                }
+            }
+            lua_pop(lua_, 1);
+            handles.clear();
+        }
+
+        // Return how many references are held.
+        size_t Size() const {
+            return (size_t)size_ - freeSlots_.size();
+        }
+
+    private:
+        void Release(int slot) {
+            (void)Push();
+            lua_pushnil(lua_);
+            lua_rawseti(lua_, -2, slot);
+            lua_pop(lua_, 1);
+            freeSlots_.push_back(slot);
+        }
+
+        lua_State* lua_;
+        int tableRef_ = LUA_NOREF;
+        int size_ = 0;
+        std::vector< int > freeSlots_;
+    };
+
+    // This is a reference table handle paired with the stack index where its
+    // table has been pushed, so that `Call` can fetch the function with
+    // a single `lua_rawgeti`.
+    struct RefTable::Pinned {
+        int tableIndex;
+        int slot;
+    };
+
+    inline RefTable::Pinned RefTable::Handle::Pin(int tableIndex) const {
+        return RefTable::Pinned{tableIndex, slot_};
+    }
+
+    // These say how to push each type of C++ value onto the Lua stack, and
+    // how to read one back from the stack, for `Call`.  Reading a value of
+    // the wrong type returns false, rather than quietly giving zero or
+    // an empty string as `lua_tointeger` and friends do.  It never raises a
+    // Lua error, since that would jump over the destructors of any C++
+    // objects on the way back to `lua_pcall`.
+    template< typename T, typename Enable = void > struct LuaValue;
+
+    template< typename T > struct LuaValue<
+        T,
+        typename std::enable_if<
+            std::is_integral< T >::value
+            && !std::is_same< T, bool >::value
+        >::type
+    > {
+        static void Push(lua_State* lua, T value) {
+            lua_pushinteger(lua, (lua_Integer)value);
+        }
+
+        static bool To(lua_State* lua, int index, T& value) {
+            int isInteger;
+            const auto integer = lua_tointegerx(lua, index, &isInteger);
+            if (!isInteger) {
+                return false;
+            }
+            value = (T)integer;
+            return true;
+        }
+    };
+
+    template< typename T > struct LuaValue<
+        T,
+        typename std::enable_if< std::is_floating_point< T >::value >::type
+    > {
+        static void Push(lua_State* lua, T value) {
+            lua_pushnumber(lua, (lua_Number)value);
+        }
+
+        static bool To(lua_State* lua, int index, T& value) {
+            int isNumber;
+            const auto number = lua_tonumberx(lua, index, &isNumber);
+            if (!isNumber) {
+                return false;
+            }
+            value = (T)number;
+            return true;
+        }
+    };
+
+    template<> struct LuaValue< bool > {
+        static void Push(lua_State* lua, bool value) {
+            lua_pushboolean(lua, value ? 1 : 0);
+        }
+
+        static bool To(lua_State* lua, int index, bool& value) {
+            value = (lua_toboolean(lua, index) != 0);
+            return true;
+        }
+    };
+
+    // Strings can be passed as C strings, but are only returned as
+    // `std::string`, since a C string taken from the Lua stack is only valid
+    // while the value stays on the stack.
+    template<> struct LuaValue< const char* > {
+        static void Push(lua_State* lua, const char* value) {
+            (void)lua_pushstring(lua, value);
+        }
+    };
+
+    template<> struct LuaValue< char* >: LuaValue< const char* > {
+    };
+
+    template<> struct LuaValue< std::string > {
+        static void Push(lua_State* lua, const std::string& value) {
+            (void)lua_pushlstring(lua, value.data(), value.length());
+        }
+
+        // Only actual strings are accepted, since converting a number to a
+        // string with `lua_tolstring` allocates memory, which could raise a
+        // Lua error.
+        static bool To(lua_State* lua, int index, std::string& value) {
+            if (lua_type(lua, index) != LUA_TSTRING) {
+                return false;
+            }
+            size_t length;
+            const auto data = lua_tolstring(lua, index, &length);
+            value.assign(data, length);
+            return true;
+        }
+    };
+
+    // C++11 has no `std::index_sequence`, so this is a minimal version of it,
+    // used to read each element of a tuple of results from the stack.
+    template< size_t... I > struct Indices {
+    };
+
+    template< size_t N, size_t... I > struct MakeIndices: MakeIndices< N - 1, N - 1, I... > {
+    };
+
+    template< size_t... I > struct MakeIndices< 0, I... > {
+        using Type = Indices< I... >;
+    };
+
+    // This is what `Call` returns: whether the call worked, the results
+    // converted to `R` if it did, and an error message if it didn't.
+    template< typename R > struct CallResult {
+        bool ok = false;
+        R value = R();
+        std::string error;
+
+        explicit operator bool() const {
+            return ok;
+        }
+    };
+
+    template<> struct CallResult< void > {
+        bool ok = false;
+        std::string error;
+
+        explicit operator bool() const {
+            return ok;
+        }
+    };
+
+    // These say how many results a call returning `R` asks Lua for, and how
+    // to read them from the stack, given the stack index of the first one.
+    // A `void` call asks for no results, a `std::tuple` asks for one result
+    // per element, and anything else asks for one result.  Reading them
+    // gives zero if every result was converted, or else the position of the
+    // first result which couldn't be.
+    template< typename R > struct LuaResults {
+        static constexpr int COUNT = 1;
+
+        static int Get(lua_State* lua, int first, CallResult< R >& result) {
+            return LuaValue< R >::To(lua, first, result.value) ? 0 : 1;
+        }
+    };
+
+    template<> struct LuaResults< void > {
+        static constexpr int COUNT = 0;
+
+        static int Get(lua_State* lua, int first, CallResult< void >& result) {
+            return 0;
+        }
+    };
+
+    template< typename... R > struct LuaResults< std::tuple< R... > > {
+        static constexpr int COUNT = (int)sizeof...(R);
+
+        static int Get(
+            lua_State* lua,
+            int first,
+            CallResult< std::tuple< R... > >& result
+        ) {
+            return Get(lua, first, result.value, typename MakeIndices< sizeof...(R) >::Type());
+        }
+
+        template< size_t... I > static int Get(
+            lua_State* lua,
+            int first,
+            std::tuple< R... >& values,
+            Indices< I... >
+        ) {
+            const bool converted[] = {
+                true,
+                LuaValue< R >::To(lua, first + (int)I, std::get< I >(values))...
+            };
+            for (size_t i = 1; i <= sizeof...(R); ++i) {
+                if (!converted[i]) {
+                    return (int)i;
+                }
+            }
+            return 0;
+        }
+    };
+
+    inline void PushFunction(lua_State* lua, const RefTable::Handle& function) {
+        function.Push();
+    }
+
+    inline void PushFunction(lua_State* lua, const RefTable::Pinned& function) {
+        (void)lua_rawgeti(lua, function.tableIndex, function.slot);
+    }
+
+    inline void PushFunction(lua_State* lua, int registryRef) {
+        (void)lua_rawgeti(lua, LUA_REGISTRYINDEX, registryRef);
+    }
+
+    // Call a Lua function held by a reference table handle, either alone or
+    // pinned to where its table is on the stack, or by a Lua registry
+    // reference, passing it the given arguments, and return its
+    // results converted to `R`: nothing for `void`, a single value, or a
+    // `std::tuple` of several values.
+    //
+    // The types of the arguments and results pick the functions used to push
+    // and read each value when this is compiled, so there's no run-time
+    // dispatch on types.  What a call does at run time is what a careful
+    // hand-written call would do: `lua_pcall`, checked conversions such as
+    // `lua_tointegerx`, and restoring the top of the stack, plus filling in
+    // the returned `CallResult`.  Enough stack space for the whole call is reserved up front, and the
+    // results are read relative to where the stack was before the call,
+    // so this works no matter what else is already on the stack.
+    //
+    // The function is called with `lua_pcall`, so an error raised by the
+    // function comes back in the returned `CallResult` instead of unwinding
+    // through the caller, as does a result of the wrong type.  Either way,
+    // the stack is left as it was.
+    template< typename R, typename F, typename... Args > CallResult< R > Call(
+        lua_State* lua,
+        const F& function,
+        Args&&... args
+    ) {
+        constexpr int numArgs = (int)sizeof...(Args);
+        constexpr int numResults = LuaResults< R >::COUNT;
+        // One extra slot is needed while fetching the function from a
+        // reference table.
+        constexpr int stackNeeded = (
+            (numArgs + 1 > numResults)
+            ? (numArgs + 1)
+            : numResults
+        ) + 1;
+        CallResult< R > result;
+        if (!lua_checkstack(lua, stackNeeded)) {
+            result.error = "stack overflow (call)";
+            return result;
+        }
+        const auto base = lua_gettop(lua);
+        PushFunction(lua, function);
+        const int pushed[] = {
+            0,
+            (
+                LuaValue< typename std::decay< Args >::type >::Push(
+                    lua,
+                    std::forward< Args >(args)
+                ),
+                0
+            )...
+        };
+        (void)pushed;
+        if (lua_pcall(lua, numArgs, numResults, 0) != LUA_OK) {
+            if (lua_type(lua, -1) == LUA_TSTRING) {
+                result.error = lua_tostring(lua, -1);
+            } else {
+                result.error = std::string("error object is a ") + luaL_typename(lua, -1) + " value";
+            }
+        } else {
+            const auto position = LuaResults< R >::Get(lua, base + 1, result);
+            if (position == 0) {
+                result.ok = true;
+            } else {
+                result.error = (
+                    "result #" + std::to_string(position) + " has the wrong type ("
+                    + luaL_typename(lua, base + position) + ")"
+                );
+            }
+        }
+        lua_settop(lua, base);
+        return result;
+    }
+
+    // Call the referenced function once for each pair of numbers taken from
+    // `x` and `y`, storing the integer result of each call in `results`.
+    // All three arrays have `count` elements.
+    //
+    // This does the same work as calling the function the usual way over
+    // and over, but avoids repeating what doesn't need to be repeated:
+    // the function is fetched only once, the stack space
+    // needed is reserved only once, and every call reuses the same
+    // stack slots.
+    void CallForEach(
+        lua_State* lua,
+        const RefTable::Handle& function,
+        const double* x,
+        const double* y,
+        lua_Integer* results,
+        size_t count
+    ) {
+        luaL_checkstack(lua, 4, "batch call");
+        function.Push();
+        const auto functionIndex = lua_gettop(lua);
+        for (size_t i = 0; i < count; ++i) {
+            lua_pushvalue(lua, functionIndex);
+            lua_pushnumber(lua, x[i]);
+            lua_pushnumber(lua, y[i]);
+            lua_call(lua, 2, 1);
+            results[i] = lua_tointeger(lua, functionIndex + 1);
+            lua_settop(lua, functionIndex);
+        }
+        lua_pop(lua, 1);
+    }
+
+    // This is the other way to call a function for a whole batch of inputs:
+    // call a function which handles the entire batch itself, passing it the
+    // inputs, and a table for the results, as Lua tables in a single call.
+    // This way, the only per-element work done in Lua is by the Lua function
+    // itself, which indexes the tables directly.
+    //
+    // The tables are made with `lua_createtable`, giving the number of
+    // elements in advance, so that each table allocates its memory only once,
+    // and all elements go into the fast "array part" of the table.
+    void CallWithTables(
+        lua_State* lua,
+        const RefTable::Handle& function,
+        const double* x,
+        const double* y,
+        lua_Integer* results,
+        size_t count
+    ) {
+        luaL_checkstack(lua, 6, "batch call");
+        lua_createtable(lua, (int)count, 0);
+        const auto resultsTable = lua_gettop(lua);
+        function.Push();
+        lua_createtable(lua, (int)count, 0);
+        for (size_t i = 0; i < count; ++i) {
+            lua_pushnumber(lua, x[i]);
+            lua_rawseti(lua, -2, (lua_Integer)(i + 1));
+        }
+        lua_createtable(lua, (int)count, 0);
+        for (size_t i = 0; i < count; ++i) {
+            lua_pushnumber(lua, y[i]);
+            lua_rawseti(lua, -2, (lua_Integer)(i + 1));
+        }
+        lua_pushvalue(lua, resultsTable);
+        lua_pushinteger(lua, (lua_Integer)count);
+        lua_call(lua, 4, 0);
+        for (size_t i = 0; i < count; ++i) {
+            (void)lua_rawgeti(lua, resultsTable, (lua_Integer)(i + 1));
+            results[i] = lua_tointeger(lua, -1);
+            lua_pop(lua, 1);
+        }
+        lua_pop(lua, 1);
+    }
+
+    // Measure how many references per second can be taken, fetched, and
+    // released, using the Lua registry and using a reference table.
+    void CompareReferences(lua_State* lua, RefTable& refs) {
+        const size_t numRefs = 200000;
+        const auto perSecond = [](
+            std::chrono::steady_clock::time_point start,
+            std::chrono::steady_clock::time_point end
+        ) {
+            return (double)numRefs / std::chrono::duration< double >(end - start).count();
+        };
+        (void)printf(
+            "%-24s %14s %14s %14s\n",
+            "",
+            "acquire (/s)",
+            "fetch (/s)",
+            "release (/s)"
+        );
+
+        // Use the Lua registry, with plain `int` references.
+        WithLua(lua, "return function() end", 0, 1);
+        std::vector< int > registryRefs(numRefs);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < numRefs; ++i) {
+            lua_pushvalue(lua, -1);
+            registryRefs[i] = luaL_ref(lua, LUA_REGISTRYINDEX);
+        }
+        auto end = std::chrono::steady_clock::now();
+        const auto registryAcquire = perSecond(start, end);
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < numRefs; ++i) {
+            (void)lua_rawgeti(lua, LUA_REGISTRYINDEX, registryRefs[i]);
+            lua_pop(lua, 1);
+        }
+        end = std::chrono::steady_clock::now();
+        const auto registryFetch = perSecond(start, end);
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < numRefs; ++i) {
+            luaL_unref(lua, LUA_REGISTRYINDEX, registryRefs[i]);
+        }
+        end = std::chrono::steady_clock::now();
+        (void)printf(
+            "%-24s %14.0f %14.0f %14.0f\n",
+            "luaL_ref",
+            registryAcquire,
+            registryFetch,
+            perSecond(start, end)
+        );
+
+        // Use the reference table, releasing handles one at a time, and
+        // then all at once.  The table is pushed once for all of the
+        // acquiring and fetching, so each of those is a single operation on
+        // the table.
+        const auto value = lua_gettop(lua);
+        const auto refsIndex = refs.Push();
+        std::vector< RefTable::Handle > handles;
+        handles.reserve(numRefs);
+        for (int batched = 0; batched < 2; ++batched) {
+            start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < numRefs; ++i) {
+                lua_pushvalue(lua, value);
+                handles.push_back(refs.Acquire(refsIndex));
+            }
+            end = std::chrono::steady_clock::now();
+            const auto acquire = perSecond(start, end);
+            start = std::chrono::steady_clock::now();
+            for (const auto& handle: handles) {
+                handle.Push(refsIndex);
+                lua_pop(lua, 1);
+            }
+            end = std::chrono::steady_clock::now();
+            const auto fetch = perSecond(start, end);
+            start = std::chrono::steady_clock::now();
+            if (batched) {
+                refs.Release(handles);
+            } else {
+                for (auto& handle: handles) {
+                    handle.Release();
+                }
+                handles.clear();
+            }
+            end = std::chrono::steady_clock::now();
+            (void)printf(
+                "%-24s %14.0f %14.0f %14.0f\n",
+                (batched ? "RefTable, batch release" : "RefTable"),
+                acquire,
+                fetch,
+                perSecond(start, end)
+            );
+        }
+        lua_pop(lua, 2);
+    }
+
+    // Measure how long a single call takes when written out by hand, and
+    // when made with `Call`, with something already on the stack below the
+    // call to show that `Call` doesn't depend on the stack being empty.
+    // The hand-written call is checked the same way `Call` checks it, with
+    // `lua_pcall`, `lua_tointegerx`, and restoring the top of the stack, so
+    // the difference is only the cost of the wrapper itself.
+    void CompareCallWrappers(
+        lua_State* lua,
+        const RefTable& refs,
+        const RefTable::Handle& function
+    ) {
+        const size_t numCalls = 1000000;
+        lua_pushnil(lua);
+        const auto refsIndex = refs.Push();
+        const auto pinnedFunction = function.Pin(refsIndex);
+        lua_Integer total[2] = {0, 0};
+        double nanosecondsPerCall[2];
+        for (int useCall = 0; useCall < 2; ++useCall) {
+            const auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < numCalls; ++i) {
+                const auto x = (double)i * 0.25;
+                if (useCall) {
+                    total[useCall] += Call< lua_Integer >(lua, pinnedFunction, x, 0.3).value;
+                } else {
+                    const auto base = lua_gettop(lua);
+                    function.Push(refsIndex);
+                    lua_pushnumber(lua, x);
+                    lua_pushnumber(lua, 0.3);
+                    if (lua_pcall(lua, 2, 1, 0) == LUA_OK) {
+                        int isInteger;
+                        const auto result = lua_tointegerx(lua, -1, &isInteger);
+                        if (isInteger) {
+                            total[useCall] += result;
+                        }
+                    }
+                    lua_settop(lua, base);
+                }
+            }
+            const auto end = std::chrono::steady_clock::now();
+            nanosecondsPerCall[useCall] = (
+                std::chrono::duration< double, std::nano >(end - start).count()
+                / numCalls
+            );
+        }
+        lua_pop(lua, 2);
+        (void)printf(
+            "By hand: %.1f ns/call, Call: %.1f ns/call, overhead %.1f ns/call (%s results)\n",
+            nanosecondsPerCall[0],
+            nanosecondsPerCall[1],
+            nanosecondsPerCall[1] - nanosecondsPerCall[0],
+            ((total[0] == total[1]) ? "same" : "different")
+        );
+    }
+
+    void CompareBatchCalls(
+        lua_State* lua,
+        const RefTable& refs,
+        const RefTable::Handle& function,
+        const RefTable::Handle& batchFunction
+    ) {
+        // Prepare a million pairs of inputs.  Every batch size is measured
+        // calling the function this many times in total.
+        const size_t totalCalls = 1000000;
+        std::vector< double > x(totalCalls);
+        std::vector< double > y(totalCalls);
+        std::vector< lua_Integer > results(totalCalls);
+        for (size_t i = 0; i < totalCalls; ++i) {
+            x[i] = (double)i * 0.25;
+            y[i] = 0.3;
+        }
+        (void)printf(
+            "%10s %18s %18s %18s\n",
+            "batch size",
+            "one by one (/s)",
+            "CallForEach (/s)",
+            "CallWithTables (/s)"
+        );
+        const auto refsIndex = refs.Push();
+        for (size_t batchSize = 1; batchSize <= totalCalls; batchSize *= 10) {
+            const auto numBatches = totalCalls / batchSize;
+            double callsPerSecond[3];
+            for (int method = 0; method < 3; ++method) {
+                const auto start = std::chrono::steady_clock::now();
+                for (size_t batch = 0; batch < numBatches; ++batch) {
+                    const auto offset = batch * batchSize;
+                    switch (method) {
+                        case 0: {
+                            for (size_t i = offset; i < offset + batchSize; ++i) {
+                                function.Push(refsIndex);
+                                lua_pushnumber(lua, x[i]);
+                                lua_pushnumber(lua, y[i]);
+                                (void)lua_call(lua, 2, 1);
+                                results[i] = lua_tointeger(lua, -1);
+                                lua_pop(lua, 1);
+                            }
+                        } break;
+
+                        case 1: {
+                            CallForEach(
+                                lua, function,
+                                &x[offset], &y[offset], &results[offset],
+                                batchSize
+                            );
+                        } break;
+
+                        default: {
+                            CallWithTables(
+                                lua, batchFunction,
+                                &x[offset], &y[offset], &results[offset],
+                                batchSize
+                            );
+                        } break;
+                    }
+                }
+                const auto end = std::chrono::steady_clock::now();
+                callsPerSecond[method] = (
+                    (double)(numBatches * batchSize)
+                    / std::chrono::duration< double >(end - start).count()
+                );
+            }
+            (void)printf(
+                "%10zu %18.0f %18.0f %18.0f\n",
+                batchSize,
+                callsPerSecond[0],
+                callsPerSecond[1],
+                callsPerSecond[2]
+            );
+        }
+        lua_pop(lua, 1);
+    }
+
 }
 
 int main(int argc, char* argv[]) {
@@ -53,17 +815,98 @@ int main(int argc, char* argv[]) {
 
     // Recover the stashed Lua function from the Lua registry
     // and call it to perform a computation.
-    (void)lua_rawgeti(lua, LUA_REGISTRYINDEX, ourRegistryIndex);
-    lua_pushnumber(lua, 14.9);
-    lua_pushnumber(lua, 27.3);
-    (void)lua_call(lua, 2, 1);
-    const auto answer = (int)lua_tointeger(lua, 1);
-    lua_pop(lua, 1);
-    (void)printf("The answer is %d.\n", answer);
+    const auto answer = Call< int >(lua, ourRegistryIndex, 14.9, 27.3);
+    if (answer) {
+        (void)printf("The answer is %d.\n", answer.value);
+    } else {
+        (void)printf("The call failed: %s\n", answer.error.c_str());
+    }
 
     // Drop our Lua registry entry now that we no longer need it.
     luaL_unref(lua, LUA_REGISTRYINDEX, ourRegistryIndex);
 
+    // Programs which keep many references, or which can't be sure to
+    // release every reference they take, can use a reference table instead,
+    // which hands out references as objects that release them automatically.
+    // The reference table is kept in its own scope, so that it's destroyed
+    // (along with the handles) before the Lua instance.
+    {
+        RefTable refs(lua);
+
+        // Stash the function again, this time in the reference table, and
+        // call it for a whole batch of inputs at once.
+        WithLua(lua, R"lua(
+            return function(x, y)
+                return math.floor(x + y + 0.5)
+            end
+        )lua", 0, 1);
+        const auto function = refs.Acquire();
+        const double xs[] = {1.2, 2.5, 3.7};
+        const double ys[] = {0.1, 0.1, 0.1};
+        lua_Integer answers[3];
+        CallForEach(lua, function, xs, ys, answers, 3);
+        (void)printf(
+            "The batch answers are %d, %d, and %d.\n",
+            (int)answers[0],
+            (int)answers[1],
+            (int)answers[2]
+        );
+
+        // Stash a second version of the function, which handles a whole batch
+        // of inputs in one call, and compare the different ways of calling a
+        // function for a batch of inputs.
+        WithLua(lua, R"lua(
+            return function(x, y, results, n)
+                for i = 1, n do
+                    results[i] = (x[i] + y[i] + 0.5) // 1
+                end
+            end
+        )lua", 0, 1);
+        const auto batchFunction = refs.Acquire();
+        CompareBatchCalls(lua, refs, function, batchFunction);
+
+        // Call a function which returns more than one result, getting them
+        // back as a tuple.
+        WithLua(lua, R"lua(
+            return function(name, x, y)
+                return name .. " divided", x // y, x % y
+            end
+        )lua", 0, 1);
+        const auto divide = refs.Acquire();
+        const auto divided = Call< std::tuple< std::string, lua_Integer, lua_Integer > >(
+            lua, divide, "17", 17, 5
+        );
+        if (divided) {
+            std::string what;
+            lua_Integer quotient, remainder;
+            std::tie(what, quotient, remainder) = divided.value;
+            (void)printf(
+                "%s by 5 is %d remainder %d.\n",
+                what.c_str(),
+                (int)quotient,
+                (int)remainder
+            );
+        }
+
+        // Show what happens when the results aren't what we asked for, or
+        // the function raises an error: `Call` reports it instead.
+        const auto mismatched = Call< lua_Integer >(lua, divide, "17", 17, 5);
+        (void)printf("Asking for an integer: %s\n", mismatched.error.c_str());
+        const auto failed = Call< std::tuple< std::string, lua_Integer, lua_Integer > >(
+            lua, divide, "17", 17, 0
+        );
+        (void)printf("Dividing by zero: %s\n", failed.error.c_str());
+
+        // Compare calling a function with `Call` and calling it by hand.
+        CompareCallWrappers(lua, refs, function);
+
+        // Compare the reference table with the Lua registry.
+        CompareReferences(lua, refs);
+    }
+
+    // Destroy the Lua instance.
+    lua_close(lua);
+
     // All done!
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,298 @@
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unordered_map>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // This is a cache of compiled Lua chunks.  Loading a chunk means lexing
+    // and compiling its source code, which is by far the most expensive part
+    // of running a small script.  The cache keeps each compiled chunk (a Lua
+    // function) in the Lua registry, so running the same script again only
+    // needs to fetch the function back out of the registry.
+    //
+    // Chunks are keyed by a hash of their source code combined with their
+    // chunk name, since the name is baked into the compiled chunk (it shows
+    // up in error messages and tracebacks).  The least recently used chunk is
+    // evicted once the cache is full, releasing its registry entry so that
+    // Lua can garbage-collect it.
+    class ChunkCache {
+    public:
+        ChunkCache(lua_State* lua, size_t capacity)
+            : lua_(lua)
+            , capacity_(capacity)
+        {
+        }
+
+        ~ChunkCache() {
+            for (const auto& entry: entries_) {
+                luaL_unref(lua_, LUA_REGISTRYINDEX, entry.registryIndex);
+            }
+        }
+
+        ChunkCache(const ChunkCache&) = delete;
+        ChunkCache& operator=(const ChunkCache&) = delete;
+
+        // Push the compiled chunk for the given script onto the Lua stack,
+        // compiling it only if it isn't already in the cache.
+        //
+        // This returns the result from lua_load (LUA_OK on success).  As with
+        // lua_load, if the script has an error, the error message is pushed
+        // onto the stack instead, and nothing is cached.
+        int Load(const std::string& script, const std::string& chunkName) {
+            const auto hash = Hash(script, chunkName);
+            const auto range = index_.equal_range(hash);
+            for (auto indexEntry = range.first; indexEntry != range.second; ++indexEntry) {
+                const auto entry = indexEntry->second;
+                if (
+                    (entry->chunkName == chunkName)
+                    && (entry->script == script)
+                ) {
+                    // Move the entry to the front of the list, to mark it as
+                    // the most recently used one.
+                    entries_.splice(entries_.begin(), entries_, entry);
+                    (void)lua_rawgeti(lua_, LUA_REGISTRYINDEX, entry->registryIndex);
+                    ++hits_;
+                    return LUA_OK;
+                }
+            }
+            ++misses_;
+            const auto loadResult = luaL_loadbufferx(
+                lua_,
+                script.data(),
+                script.length(),
+                chunkName.c_str(),
+                "t"
+            );
+            if (loadResult != LUA_OK) {
+                return loadResult;
+            }
+            if (capacity_ == 0) {
+                return LUA_OK;
+            }
+            if (entries_.size() >= capacity_) {
+                Evict();
+            }
+
+            // Make a copy of the chunk, since luaL_ref pops the value it
+            // stores, and we want to leave the chunk on the stack.
+            lua_pushvalue(lua_, -1);
+            Entry entry;
+            entry.hash = hash;
+            entry.script = script;
+            entry.chunkName = chunkName;
+            entry.registryIndex = luaL_ref(lua_, LUA_REGISTRYINDEX);
+            entries_.push_front(std::move(entry));
+            index_.insert(std::make_pair(hash, entries_.begin()));
+            return LUA_OK;
+        }
+
+        size_t Hits() const {
+            return hits_;
+        }
+
+        size_t Misses() const {
+            return misses_;
+        }
+
+        size_t Evictions() const {
+            return evictions_;
+        }
+
+        size_t Size() const {
+            return entries_.size();
+        }
+
+    private:
+        struct Entry {
+            size_t hash = 0;
+            std::string script;
+            std::string chunkName;
+            int registryIndex = LUA_NOREF;
+        };
+
+        static size_t Hash(const std::string& script, const std::string& chunkName) {
+            const auto scriptHash = std::hash< std::string >()(script);
+            const auto chunkNameHash = std::hash< std::string >()(chunkName);
+            return scriptHash ^ (chunkNameHash + 0x9e3779b9 + (scriptHash << 6) + (scriptHash >> 2));
+        }
+
+        void Evict() {
+            const auto entry = std::prev(entries_.end());
+            const auto range = index_.equal_range(entry->hash);
+            for (auto indexEntry = range.first; indexEntry != range.second; ++indexEntry) {
+                if (indexEntry->second == entry) {
+                    (void)index_.erase(indexEntry);
+                    break;
+                }
+            }
+            luaL_unref(lua_, LUA_REGISTRYINDEX, entry->registryIndex);
+            entries_.erase(entry);
+            ++evictions_;
+        }
+
+        lua_State* lua_;
+        size_t capacity_;
+        std::list< Entry > entries_;
+        std::unordered_multimap< size_t, std::list< Entry >::iterator > index_;
+        size_t hits_ = 0;
+        size_t misses_ = 0;
+        size_t evictions_ = 0;
+    };
+
+    int AddAndRoundInLua(lua_State* lua, ChunkCache& cache, double a, double b) {
+        // Obtain the compiled chunk from the cache.  Only the first call
+        // actually compiles the script; every call after that reuses
+        // the same Lua function.
+        (void)cache.Load(
+            R"lua(
+                local a, b = ...
+                local ab = a + b
+                return math.floor(ab + 0.5)
+            )lua",
+            "=example"
+        );
+
+        // Call the chunk to execute it.
+        lua_pushnumber(lua, a);
+        lua_pushnumber(lua, b);
+        (void)lua_call(lua, 2, 1);
+
+        // Pop the return value off the Lua stack and return it.
+        const auto result = (int)lua_tointeger(lua, -1);
+        lua_pop(lua, 1);
+        return result;
+    }
+
+    void DemonstrateEviction(lua_State* lua) {
+        // Use a tiny cache so that we can see chunks being evicted.
+        ChunkCache cache(lua, 2);
+        const std::string scripts[] = {
+            "return 1",
+            "return 2",
+            "return 1",
+            "return 3",
+            "return 2",
+        };
+        for (const auto& script: scripts) {
+            (void)cache.Load(script, "=eviction");
+            (void)lua_call(lua, 0, 1);
+            (void)printf("'%s' returned %d\n", script.c_str(), (int)lua_tointeger(lua, -1));
+            lua_pop(lua, 1);
+        }
+        (void)printf(
+            "Small cache: %zu hits, %zu misses, %zu evictions, %zu cached\n",
+            cache.Hits(),
+            cache.Misses(),
+            cache.Evictions(),
+            cache.Size()
+        );
+    }
+
+    double MeasureNanosecondsPerCall(size_t iterations, const std::function< void() >& call) {
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            call();
+        }
+        const auto end = std::chrono::steady_clock::now();
+        return (
+            std::chrono::duration< double, std::nano >(end - start).count()
+            / (double)iterations
+        );
+    }
+
+    void CompareColdAndWarmCalls(lua_State* lua) {
+        const std::string script = R"lua(
+            local a, b = ...
+            local ab = a + b
+            return math.floor(ab + 0.5)
+        )lua";
+        const size_t iterations = 100000;
+
+        // "Cold" calls compile the script every time, like the other examples.
+        const auto coldNanoseconds = MeasureNanosecondsPerCall(
+            iterations,
+            [&]{
+                (void)luaL_loadbufferx(lua, script.data(), script.length(), "=example", "t");
+                lua_pushnumber(lua, 14.9);
+                lua_pushnumber(lua, 27.3);
+                (void)lua_call(lua, 2, 1);
+                lua_pop(lua, 1);
+            }
+        );
+
+        // "Warm" calls get the compiled script from the cache.
+        ChunkCache cache(lua, 16);
+        const auto warmNanoseconds = MeasureNanosecondsPerCall(
+            iterations,
+            [&]{
+                (void)cache.Load(script, "=example");
+                lua_pushnumber(lua, 14.9);
+                lua_pushnumber(lua, 27.3);
+                (void)lua_call(lua, 2, 1);
+                lua_pop(lua, 1);
+            }
+        );
+        (void)printf(
+            "Cold (compile every call): %.0f ns/call\n"
+            "Warm (chunk cache):        %.0f ns/call (%zu hits, %zu misses)\n",
+            coldNanoseconds,
+            warmNanoseconds,
+            cache.Hits(),
+            cache.Misses()
+        );
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Create the Lua instance.
+    const auto lua = luaL_newstate();
+
+    // Load standard Lua libraries.
+    //
+    // Temporarily disable the garbage collector as we load the
+    // libraries, to improve performance
+    // (http://lua-users.org/lists/lua-l/2008-07/msg00690.html).
+    lua_gc(lua, LUA_GCSTOP, 0);
+    luaL_openlibs(lua);
+    lua_gc(lua, LUA_GCRESTART, 0);
+
+    // Use Lua to perform the same calculation a few times.  The script is
+    // only compiled the first time.
+    {
+        ChunkCache cache(lua, 16);
+        for (int i = 0; i < 3; ++i) {
+            const auto answer = AddAndRoundInLua(lua, cache, 14.9, 27.3 + i);
+            (void)printf("The answer is %d.\n", answer);
+        }
+        (void)printf(
+            "Chunk cache: %zu hits, %zu misses\n",
+            cache.Hits(),
+            cache.Misses()
+        );
+    }
+
+    // Show how the least recently used chunks are dropped from a full cache.
+    DemonstrateEviction(lua);
+
+    // Measure how much time the cache saves per call.
+    CompareColdAndWarmCalls(lua);
+
+    // Destroy the Lua instance.
+    lua_close(lua);
+
+    // All done!
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,534 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif /* __linux__ */
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // These are the keys of the Lua registry entries where the pool keeps the
+    // snapshot of the Lua instance it restores when the instance is returned
+    // to the pool: the contents of the tables, and their metatables.  We use
+    // the addresses of these variables as the keys, since they're unique and
+    // can't collide with anything else.
+    const char BASELINE_KEY = 0;
+    const char BASELINE_METATABLES_KEY = 0;
+
+    // This is how many levels of tables inside the Lua registry are included
+    // in the snapshot.  Three levels reach the global table and the tables
+    // kept by the `package` library (1), the standard library tables and the
+    // methods of files (2), and the tables inside `package`, such as
+    // `package.loaded` (3).
+    constexpr int BASELINE_DEPTH = 3;
+
+    // Return the index of the CPU core running the calling thread,
+    // or zero if this isn't known.
+    unsigned GetCurrentCore() {
+#ifdef __linux__
+        const auto core = sched_getcpu();
+        return ((core < 0) ? 0 : (unsigned)core);
+#else /* not __linux__ */
+        return 0;
+#endif /* __linux__ / not __linux__ */
+    }
+
+    // Ask the operating system to only run the calling thread on the given
+    // CPU core.  This is only supported on Linux; elsewhere it does nothing.
+    void PinCurrentThreadToCore(unsigned core) {
+#ifdef __linux__
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(core, &cpuSet);
+        (void)pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+#endif /* __linux__ */
+    }
+
+    // Copy every field of the table at the top of the Lua stack into a new
+    // table, leaving the copy on the top of the stack above the original.
+    void PushShallowCopy(lua_State* lua) {
+        lua_newtable(lua);
+        lua_pushnil(lua);
+        while (lua_next(lua, -3) != 0) {
+            lua_pushvalue(lua, -2);
+            lua_insert(lua, -2);
+            lua_rawset(lua, -4);
+        }
+    }
+
+    // Add the table at the top of the Lua stack to the snapshot, along with
+    // every table inside it down to the given depth, popping the table.
+    // `copies` is the stack index of the table mapping each table in the
+    // snapshot to a shallow copy of its contents, and `metatables` of the
+    // table mapping each table in the snapshot to its metatable, if it has
+    // one.  A table found more than once is only copied once.
+    void AddToSnapshot(lua_State* lua, int copies, int metatables, int depth) {
+        luaL_checkstack(lua, 4, "snapshot");
+        lua_pushvalue(lua, -1);
+        if (lua_rawget(lua, copies) == LUA_TNIL) {
+            lua_pop(lua, 1);
+            lua_pushvalue(lua, -1);
+            PushShallowCopy(lua);
+            lua_rawset(lua, copies);
+            if (lua_getmetatable(lua, -1)) {
+                lua_pushvalue(lua, -2);
+                lua_insert(lua, -2);
+                lua_rawset(lua, metatables);
+            }
+        } else {
+            lua_pop(lua, 1);
+        }
+        if (depth > 0) {
+            lua_pushnil(lua);
+            while (lua_next(lua, -2) != 0) {
+                if (lua_istable(lua, -1)) {
+                    AddToSnapshot(lua, copies, metatables, depth - 1);
+                } else {
+                    lua_pop(lua, 1);
+                }
+            }
+        }
+        lua_pop(lua, 1);
+    }
+
+    // Take a snapshot of a freshly-initialized Lua instance and keep it in
+    // the registry.  The snapshot covers the registry itself, and the tables
+    // inside it down to `BASELINE_DEPTH` levels, which include the global
+    // table, the standard library tables, `package.loaded` and the other
+    // tables of the `package` library, and the metatable of files.  It also
+    // covers the metatable shared by all strings.
+    void SaveBaseline(lua_State* lua) {
+        lua_newtable(lua);
+        const auto copies = lua_gettop(lua);
+        lua_newtable(lua);
+        const auto metatables = lua_gettop(lua);
+        lua_pushvalue(lua, LUA_REGISTRYINDEX);
+        AddToSnapshot(lua, copies, metatables, BASELINE_DEPTH);
+        lua_pushliteral(lua, "");
+        if (lua_getmetatable(lua, -1)) {
+            AddToSnapshot(lua, copies, metatables, 0);
+        }
+        lua_pop(lua, 1);
+        lua_rawsetp(lua, LUA_REGISTRYINDEX, &BASELINE_METATABLES_KEY);
+        lua_rawsetp(lua, LUA_REGISTRYINDEX, &BASELINE_KEY);
+    }
+
+    // Put the Lua instance back the way it was when the snapshot was taken,
+    // undoing anything a script added, removed or replaced in any table in
+    // the snapshot, and any metatable it set on one of them.  This includes
+    // global variables, modules cached by `require`, and anything kept in
+    // the registry.  Values which are only reachable from tables outside the
+    // snapshot, such as the fields of a table a script made, go away along
+    // with those tables.
+    void RestoreBaseline(lua_State* lua) {
+        lua_settop(lua, 0);
+        (void)lua_rawgetp(lua, LUA_REGISTRYINDEX, &BASELINE_KEY);
+        (void)lua_rawgetp(lua, LUA_REGISTRYINDEX, &BASELINE_METATABLES_KEY);
+        lua_pushnil(lua);
+        while (lua_next(lua, 1) != 0) {
+            // Stack: copies, metatables, table, copy
+
+            // Clear fields which aren't in the copy.  Lua allows clearing
+            // fields of a table while traversing it.
+            lua_pushnil(lua);
+            while (lua_next(lua, 3) != 0) {
+                lua_pop(lua, 1);
+                lua_pushvalue(lua, -1);
+                if (lua_rawget(lua, 4) == LUA_TNIL) {
+                    lua_pushvalue(lua, -2);
+                    lua_pushnil(lua);
+                    lua_rawset(lua, 3);
+                }
+                lua_pop(lua, 1);
+            }
+
+            // Restore fields from the copy.
+            lua_pushnil(lua);
+            while (lua_next(lua, 4) != 0) {
+                lua_pushvalue(lua, -2);
+                lua_insert(lua, -2);
+                lua_rawset(lua, 3);
+            }
+
+            // Restore the metatable, or remove it if there wasn't one.
+            lua_pushvalue(lua, 3);
+            (void)lua_rawget(lua, 2);
+            (void)lua_setmetatable(lua, 3);
+            lua_pop(lua, 1);
+        }
+
+        // The snapshot itself was taken before it was put in the registry,
+        // so restoring the registry removed it, and it needs to be put back.
+        lua_rawsetp(lua, LUA_REGISTRYINDEX, &BASELINE_METATABLES_KEY);
+        lua_rawsetp(lua, LUA_REGISTRYINDEX, &BASELINE_KEY);
+    }
+
+    lua_State* CreateState() {
+        const auto lua = luaL_newstate();
+
+        // Load standard Lua libraries.
+        //
+        // Temporarily disable the garbage collector as we load the
+        // libraries, to improve performance
+        // (http://lua-users.org/lists/lua-l/2008-07/msg00690.html).
+        lua_gc(lua, LUA_GCSTOP, 0);
+        luaL_openlibs(lua);
+        SaveBaseline(lua);
+        lua_gc(lua, LUA_GCRESTART, 0);
+        return lua;
+    }
+
+    // This is a thread-safe pool of fully-initialized Lua instances.
+    //
+    // Setting up a Lua instance and loading its standard libraries takes
+    // much longer than running a small script, so rather than creating a
+    // new instance for each piece of work, a thread "checks out" an idle
+    // instance from the pool, uses it, and "checks it in" again when done.
+    // When an instance is checked in, its global variables, standard
+    // libraries, loaded modules and registry are restored to the way they
+    // were when the instance was created, so that one piece of work can't
+    // affect the next.
+    //
+    // The pool grows by creating new instances whenever none are idle, up to
+    // a maximum, beyond which threads wait for an instance to be checked in.
+    // It shrinks by closing instances checked in while the maximum number of
+    // idle instances are already waiting to be used.
+    //
+    // With per-core affinity, idle instances are kept in separate lists for
+    // each CPU core, and a thread prefers instances last used on the core it
+    // is running on, since their memory is more likely to still be in that
+    // core's caches.
+    class StatePool {
+    public:
+        struct Options {
+            // This is the number of instances to create up front.
+            size_t initialStates = 0;
+
+            // This is the largest number of idle instances to keep.
+            size_t maxIdleStates = 16;
+
+            // This is the largest number of instances which may exist at
+            // once, or zero for no limit.
+            size_t maxStates = 0;
+
+            // This is the largest amount of memory, in kilobytes, an instance
+            // may use and still be kept for reuse when checked in.
+            size_t maxRetainedKilobytes = 1024;
+
+            // This selects whether or not idle instances are kept in separate
+            // lists for each CPU core.
+            bool perCoreAffinity = false;
+        };
+
+        // This holds an instance checked out from the pool, and automatically
+        // checks it back in when the lease is destroyed.
+        class Lease {
+        public:
+            explicit Lease(StatePool& pool)
+                : pool_(&pool)
+                , lua_(pool.CheckOut())
+            {
+            }
+
+            ~Lease() {
+                if (lua_ != nullptr) {
+                    pool_->CheckIn(lua_);
+                }
+            }
+
+            Lease(Lease&& other)
+                : pool_(other.pool_)
+                , lua_(other.lua_)
+            {
+                other.lua_ = nullptr;
+            }
+
+            Lease(const Lease&) = delete;
+            Lease& operator=(const Lease&) = delete;
+            Lease& operator=(Lease&&) = delete;
+
+            lua_State* Get() const {
+                return lua_;
+            }
+
+        private:
+            StatePool* pool_;
+            lua_State* lua_;
+        };
+
+        explicit StatePool(const Options& options)
+            : options_(options)
+            , idleStates_(
+                options.perCoreAffinity
+                ? std::max(std::thread::hardware_concurrency(), 1u)
+                : 1
+            )
+        {
+            for (size_t i = 0; i < options_.initialStates; ++i) {
+                idleStates_[i % idleStates_.size()].push_back(CreateState());
+                ++numIdleStates_;
+                ++numStates_;
+            }
+        }
+
+        ~StatePool() {
+            for (const auto& list: idleStates_) {
+                for (const auto lua: list) {
+                    lua_close(lua);
+                }
+            }
+        }
+
+        StatePool(const StatePool&) = delete;
+        StatePool& operator=(const StatePool&) = delete;
+
+        lua_State* CheckOut() {
+            std::unique_lock< std::mutex > lock(mutex_);
+            for (;;) {
+                if (numIdleStates_ > 0) {
+                    const auto preferred = PreferredList();
+                    for (size_t i = 0; i < idleStates_.size(); ++i) {
+                        auto& list = idleStates_[(preferred + i) % idleStates_.size()];
+                        if (!list.empty()) {
+                            const auto lua = list.back();
+                            list.pop_back();
+                            --numIdleStates_;
+                            return lua;
+                        }
+                    }
+                }
+                if (
+                    (options_.maxStates == 0)
+                    || (numStates_ < options_.maxStates)
+                ) {
+                    break;
+                }
+                stateAvailable_.wait(lock);
+            }
+
+            // Create the new instance without holding the lock, since it
+            // takes a while and other threads may be checking in instances.
+            ++numStates_;
+            ++statesCreated_;
+            lock.unlock();
+            return CreateState();
+        }
+
+        void CheckIn(lua_State* lua) {
+            RestoreBaseline(lua);
+            const auto kilobytes = (size_t)lua_gc(lua, LUA_GCCOUNT, 0);
+            std::unique_lock< std::mutex > lock(mutex_);
+            if (
+                (numIdleStates_ >= options_.maxIdleStates)
+                || (kilobytes > options_.maxRetainedKilobytes)
+            ) {
+                --numStates_;
+                ++statesClosed_;
+                lock.unlock();
+                lua_close(lua);
+            } else {
+                idleStates_[PreferredList()].push_back(lua);
+                ++numIdleStates_;
+                lock.unlock();
+            }
+            stateAvailable_.notify_one();
+        }
+
+        size_t StatesCreated() const {
+            std::lock_guard< std::mutex > lock(mutex_);
+            return statesCreated_;
+        }
+
+        size_t StatesClosed() const {
+            std::lock_guard< std::mutex > lock(mutex_);
+            return statesClosed_;
+        }
+
+    private:
+        size_t PreferredList() const {
+            return GetCurrentCore() % idleStates_.size();
+        }
+
+        const Options options_;
+        mutable std::mutex mutex_;
+        std::condition_variable stateAvailable_;
+        std::vector< std::vector< lua_State* > > idleStates_;
+        size_t numIdleStates_ = 0;
+        size_t numStates_ = 0;
+        size_t statesCreated_ = 0;
+        size_t statesClosed_ = 0;
+    };
+
+    const char* const REQUEST_SCRIPT = R"lua(
+        local a, b = ...
+        counter = (counter or 0) + 1
+        return math.floor(a + b + 0.5)
+    )lua";
+
+    // Handle one "request" by running a small script in the given Lua
+    // instance.  The script also sets a global variable, to show that the
+    // pool cleans up after it.
+    int HandleRequest(lua_State* lua, double a, double b) {
+        (void)luaL_loadstring(lua, REQUEST_SCRIPT);
+        lua_pushnumber(lua, a);
+        lua_pushnumber(lua, b);
+        (void)lua_call(lua, 2, 1);
+        const auto result = (int)lua_tointeger(lua, -1);
+        lua_pop(lua, 1);
+        return result;
+    }
+
+    void DemonstrateReset(StatePool& pool) {
+        for (int i = 0; i < 2; ++i) {
+            StatePool::Lease lease(pool);
+            const auto lua = lease.Get();
+            const auto answer = HandleRequest(lua, 14.9, 27.3);
+            (void)lua_getglobal(lua, "counter");
+            (void)printf(
+                "The answer is %d (counter = %d).\n",
+                answer,
+                (int)lua_tointeger(lua, -1)
+            );
+            lua_pop(lua, 1);
+
+            // Also leave behind a module cached by `require`, a metatable on
+            // the global table, and a registry entry, and check whether the
+            // ones left behind by the previous use are still there.
+            if (luaL_dostring(lua, R"lua(
+                local registry = debug.getregistry()
+                local leftovers = (
+                    (package.loaded.leftover ~= nil)
+                    or (getmetatable(_G) ~= nil)
+                    or (registry.leftover ~= nil)
+                )
+                package.loaded.leftover = true
+                setmetatable(_G, {})
+                registry.leftover = true
+                return leftovers
+            )lua") == LUA_OK) {
+                (void)printf(
+                    "Leftovers from the previous use: %s.\n",
+                    (lua_toboolean(lua, -1) ? "yes" : "none")
+                );
+            } else {
+                (void)fprintf(stderr, "Leftover check failed: %s\n", lua_tostring(lua, -1));
+            }
+            lua_pop(lua, 1);
+        }
+    }
+
+    // Run the given number of worker threads, each handling the given
+    // number of requests, and return the number of requests handled
+    // per second overall.
+    template< typename Handler > double MeasureRequestsPerSecond(
+        size_t numWorkers,
+        size_t requestsPerWorker,
+        bool pinWorkers,
+        Handler handler
+    ) {
+        const auto numCores = std::max(std::thread::hardware_concurrency(), 1u);
+        std::vector< std::thread > workers;
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < numWorkers; ++i) {
+            workers.emplace_back([&, i]{
+                if (pinWorkers) {
+                    PinCurrentThreadToCore((unsigned)(i % numCores));
+                }
+                for (size_t j = 0; j < requestsPerWorker; ++j) {
+                    handler();
+                }
+            });
+        }
+        for (auto& worker: workers) {
+            worker.join();
+        }
+        const auto end = std::chrono::steady_clock::now();
+        const auto seconds = std::chrono::duration< double >(end - start).count();
+        return (double)(numWorkers * requestsPerWorker) / seconds;
+    }
+
+    void CompareWithFreshStates() {
+        const auto numCores = std::max(std::thread::hardware_concurrency(), 1u);
+        (void)printf(
+            "%8s %16s %16s %16s\n",
+            "workers",
+            "fresh (req/s)",
+            "pooled (req/s)",
+            "per-core (req/s)"
+        );
+        for (size_t numWorkers = 1; numWorkers <= 2 * numCores; numWorkers *= 2) {
+            const auto freshRate = MeasureRequestsPerSecond(
+                numWorkers, 500, false,
+                []{
+                    const auto lua = CreateState();
+                    (void)HandleRequest(lua, 14.9, 27.3);
+                    lua_close(lua);
+                }
+            );
+            StatePool::Options options;
+            options.initialStates = numWorkers;
+            options.maxIdleStates = numWorkers;
+            StatePool pool(options);
+            const auto pooledRate = MeasureRequestsPerSecond(
+                numWorkers, 20000, false,
+                [&]{
+                    StatePool::Lease lease(pool);
+                    (void)HandleRequest(lease.Get(), 14.9, 27.3);
+                }
+            );
+            options.perCoreAffinity = true;
+            StatePool perCorePool(options);
+            const auto perCoreRate = MeasureRequestsPerSecond(
+                numWorkers, 20000, true,
+                [&]{
+                    StatePool::Lease lease(perCorePool);
+                    (void)HandleRequest(lease.Get(), 14.9, 27.3);
+                }
+            );
+            (void)printf(
+                "%8zu %16.0f %16.0f %16.0f\n",
+                numWorkers,
+                freshRate,
+                pooledRate,
+                perCoreRate
+            );
+        }
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Create a pool of Lua instances, with one ready to go.
+    StatePool::Options options;
+    options.initialStates = 1;
+    StatePool pool(options);
+
+    // Use the same Lua instance twice, showing that global variables set
+    // by the first use are gone by the time of the second use.
+    DemonstrateReset(pool);
+    (void)printf(
+        "Lua instances created on demand: %zu\n",
+        pool.StatesCreated()
+    );
+
+    // Compare handling requests with a new Lua instance each time against
+    // reusing Lua instances from a pool, for different numbers of threads.
+    CompareWithFreshStates();
+
+    // All done!
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,490 @@
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // These describe the two kinds of elements a numeric array can hold.
+    //
+    // Each has an `Arithmetic` type used to do math on the elements.
+    // For integers this is unsigned, so that overflow wraps around the same
+    // way it does for Lua integers, rather than being undefined behavior.
+    struct DoubleElements {
+        typedef double Element;
+        typedef double Arithmetic;
+
+        static const char* MetatableName() {
+            return "DoubleArray";
+        }
+
+        static void Push(lua_State* lua, Element value) {
+            lua_pushnumber(lua, value);
+        }
+
+        static Element Check(lua_State* lua, int index) {
+            return luaL_checknumber(lua, index);
+        }
+    };
+
+    struct IntegerElements {
+        typedef lua_Integer Element;
+        typedef lua_Unsigned Arithmetic;
+
+        static const char* MetatableName() {
+            return "IntegerArray";
+        }
+
+        static void Push(lua_State* lua, Element value) {
+            lua_pushinteger(lua, value);
+        }
+
+        static Element Check(lua_State* lua, int index) {
+            return luaL_checkinteger(lua, index);
+        }
+    };
+
+    // This is a fixed-length array of numbers stored contiguously in memory,
+    // aligned to the size of a cache line.  Keeping numbers this way, rather
+    // than as separate values in a Lua table, lets the bulk operations below
+    // run through them as fast as the processor can, using its SIMD
+    // (single instruction, multiple data) instructions.
+    template< typename Elements > class NumericArray {
+    public:
+        typedef typename Elements::Element Element;
+
+        static constexpr size_t ALIGNMENT = 64;
+
+        // This is the longest array whose size, padded for alignment,
+        // still fits in a size_t.
+        static constexpr size_t MAX_LENGTH = (SIZE_MAX - ALIGNMENT) / sizeof(Element);
+
+        // A length over MAX_LENGTH is treated the same as running out of
+        // memory, rather than letting the size wrap around to a small
+        // allocation.
+        explicit NumericArray(size_t length)
+            : length_(length)
+            , storage_(
+                (length <= MAX_LENGTH)
+                ? malloc(length * sizeof(Element) + ALIGNMENT)
+                : NULL
+            )
+        {
+            if (storage_ == NULL) {
+                length_ = 0;
+                data_ = nullptr;
+            } else {
+                const auto address = (uintptr_t)storage_;
+                data_ = (Element*)((address + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1));
+                (void)memset(data_, 0, length * sizeof(Element));
+            }
+        }
+
+        ~NumericArray() {
+            free(storage_);
+        }
+
+        NumericArray(const NumericArray&) = delete;
+        NumericArray& operator=(const NumericArray&) = delete;
+
+        size_t Length() const {
+            return length_;
+        }
+
+        Element* Data() {
+            return data_;
+        }
+
+        const Element* Data() const {
+            return data_;
+        }
+
+    private:
+        size_t length_;
+        void* storage_;
+        Element* data_;
+    };
+
+    // These are the bulk operations.  They're written so that the compiler
+    // can turn them into SIMD instructions for whichever processor we build
+    // for, without needing processor-specific code.  Reductions such as sum
+    // and dot product keep four separate running totals, since the compiler
+    // isn't allowed to reorder floating-point additions by itself, and
+    // a single running total would make each addition wait for the one
+    // before it.
+    template< typename Elements > typename Elements::Element Sum(
+        const typename Elements::Element* x,
+        size_t length
+    ) {
+        typedef typename Elements::Arithmetic Arithmetic;
+        Arithmetic sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+        size_t i = 0;
+        for (; i + 4 <= length; i += 4) {
+            sum0 += (Arithmetic)x[i];
+            sum1 += (Arithmetic)x[i + 1];
+            sum2 += (Arithmetic)x[i + 2];
+            sum3 += (Arithmetic)x[i + 3];
+        }
+        for (; i < length; ++i) {
+            sum0 += (Arithmetic)x[i];
+        }
+        return (typename Elements::Element)((sum0 + sum1) + (sum2 + sum3));
+    }
+
+    template< typename Elements > typename Elements::Element Dot(
+        const typename Elements::Element* x,
+        const typename Elements::Element* y,
+        size_t length
+    ) {
+        typedef typename Elements::Arithmetic Arithmetic;
+        Arithmetic sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+        size_t i = 0;
+        for (; i + 4 <= length; i += 4) {
+            sum0 += (Arithmetic)x[i] * (Arithmetic)y[i];
+            sum1 += (Arithmetic)x[i + 1] * (Arithmetic)y[i + 1];
+            sum2 += (Arithmetic)x[i + 2] * (Arithmetic)y[i + 2];
+            sum3 += (Arithmetic)x[i + 3] * (Arithmetic)y[i + 3];
+        }
+        for (; i < length; ++i) {
+            sum0 += (Arithmetic)x[i] * (Arithmetic)y[i];
+        }
+        return (typename Elements::Element)((sum0 + sum1) + (sum2 + sum3));
+    }
+
+    // Find the smallest (or, if `Greater` is true, the largest) element
+    // of a non-empty array.
+    template< typename Elements, bool Greater > typename Elements::Element Extreme(
+        const typename Elements::Element* x,
+        size_t length
+    ) {
+        typedef typename Elements::Element Element;
+        Element best0 = x[0], best1 = x[0], best2 = x[0], best3 = x[0];
+        size_t i = 0;
+        for (; i + 4 <= length; i += 4) {
+            best0 = ((x[i] < best0) != Greater) ? x[i] : best0;
+            best1 = ((x[i + 1] < best1) != Greater) ? x[i + 1] : best1;
+            best2 = ((x[i + 2] < best2) != Greater) ? x[i + 2] : best2;
+            best3 = ((x[i + 3] < best3) != Greater) ? x[i + 3] : best3;
+        }
+        for (; i < length; ++i) {
+            best0 = ((x[i] < best0) != Greater) ? x[i] : best0;
+        }
+        best0 = ((best1 < best0) != Greater) ? best1 : best0;
+        best2 = ((best3 < best2) != Greater) ? best3 : best2;
+        return ((best2 < best0) != Greater) ? best2 : best0;
+    }
+
+    template< typename Elements > void Scale(
+        typename Elements::Element* x,
+        typename Elements::Element a,
+        size_t length
+    ) {
+        typedef typename Elements::Arithmetic Arithmetic;
+        for (size_t i = 0; i < length; ++i) {
+            x[i] = (typename Elements::Element)((Arithmetic)x[i] * (Arithmetic)a);
+        }
+    }
+
+    // Compute y = a * x + y, element by element.
+    template< typename Elements > void Axpy(
+        typename Elements::Element* y,
+        typename Elements::Element a,
+        const typename Elements::Element* x,
+        size_t length
+    ) {
+        typedef typename Elements::Arithmetic Arithmetic;
+        for (size_t i = 0; i < length; ++i) {
+            y[i] = (typename Elements::Element)(
+                (Arithmetic)a * (Arithmetic)x[i] + (Arithmetic)y[i]
+            );
+        }
+    }
+
+    // This holds the functions which make a numeric array usable from Lua.
+    template< typename Elements > struct NumericArrayBinding {
+        typedef typename Elements::Element Element;
+        typedef NumericArray< Elements > Array;
+
+        static Array& CheckArray(lua_State* lua, int index) {
+            return *(Array*)luaL_checkudata(lua, index, Elements::MetatableName());
+        }
+
+        // Return the zero-based position of the element at the one-based
+        // index given at the given position on the Lua stack, or raise a Lua
+        // error if the index is out of range.
+        static size_t CheckPosition(lua_State* lua, const Array& array, int index) {
+            const auto luaIndex = luaL_checkinteger(lua, index);
+            luaL_argcheck(
+                lua,
+                (luaIndex >= 1) && ((lua_Unsigned)luaIndex <= array.Length()),
+                index,
+                "index out of range"
+            );
+            return (size_t)(luaIndex - 1);
+        }
+
+        static int Index(lua_State* lua) {
+            auto& array = CheckArray(lua, 1);
+
+            // Numbers select elements.  Anything else selects methods.
+            if (lua_type(lua, 2) == LUA_TNUMBER) {
+                Elements::Push(lua, array.Data()[CheckPosition(lua, array, 2)]);
+            } else {
+                lua_pushvalue(lua, 2);
+                (void)lua_rawget(lua, lua_upvalueindex(1));
+            }
+            return 1;
+        }
+
+        static int NewIndex(lua_State* lua) {
+            auto& array = CheckArray(lua, 1);
+            const auto position = CheckPosition(lua, array, 2);
+            array.Data()[position] = Elements::Check(lua, 3);
+            return 0;
+        }
+
+        static int Length(lua_State* lua) {
+            lua_pushinteger(lua, (lua_Integer)CheckArray(lua, 1).Length());
+            return 1;
+        }
+
+        static int Collect(lua_State* lua) {
+            auto& array = *(Array*)lua_touserdata(lua, 1);
+            array.~Array();
+            return 0;
+        }
+
+        static int SumMethod(lua_State* lua) {
+            const auto& array = CheckArray(lua, 1);
+            Elements::Push(lua, Sum< Elements >(array.Data(), array.Length()));
+            return 1;
+        }
+
+        template< bool Greater > static int ExtremeMethod(lua_State* lua) {
+            const auto& array = CheckArray(lua, 1);
+            if (array.Length() == 0) {
+                lua_pushnil(lua);
+            } else {
+                Elements::Push(
+                    lua,
+                    Extreme< Elements, Greater >(array.Data(), array.Length())
+                );
+            }
+            return 1;
+        }
+
+        static int ScaleMethod(lua_State* lua) {
+            auto& array = CheckArray(lua, 1);
+            Scale< Elements >(array.Data(), Elements::Check(lua, 2), array.Length());
+            lua_settop(lua, 1);
+            return 1;
+        }
+
+        static int AxpyMethod(lua_State* lua) {
+            auto& y = CheckArray(lua, 1);
+            const auto a = Elements::Check(lua, 2);
+            const auto& x = CheckArray(lua, 3);
+            luaL_argcheck(lua, x.Length() == y.Length(), 3, "length mismatch");
+            Axpy< Elements >(y.Data(), a, x.Data(), y.Length());
+            lua_settop(lua, 1);
+            return 1;
+        }
+
+        static int DotMethod(lua_State* lua) {
+            const auto& x = CheckArray(lua, 1);
+            const auto& y = CheckArray(lua, 2);
+            luaL_argcheck(lua, x.Length() == y.Length(), 2, "length mismatch");
+            Elements::Push(lua, Dot< Elements >(x.Data(), y.Data(), x.Length()));
+            return 1;
+        }
+
+        // Make a new numeric array of the given length, with all elements
+        // set to zero, and push it onto the Lua stack.
+        static Array& Push(lua_State* lua, size_t length) {
+            // Create userdata value, and move a new array into it,
+            // just like `PushOwnedObject` in Example3.
+            auto udata = (Array*)lua_newuserdata(lua, sizeof(Array));
+            new (udata) Array(length);
+
+            // Give the userdata its metatable, which is constructed only once
+            // and shared by all arrays of the same kind.  Besides the usual
+            // metamethods, the metatable holds a table of methods, given to
+            // the `__index` metamethod as an upvalue, which the `__index`
+            // metamethod uses to look up any key which isn't a number.
+            if (luaL_newmetatable(lua, Elements::MetatableName())) {
+                const luaL_Reg methods[] = {
+                    {"sum", SumMethod},
+                    {"min", ExtremeMethod< false >},
+                    {"max", ExtremeMethod< true >},
+                    {"scale", ScaleMethod},
+                    {"axpy", AxpyMethod},
+                    {"dot", DotMethod},
+                    {NULL, NULL},
+                };
+                luaL_newlib(lua, methods);
+                lua_pushcclosure(lua, Index, 1);
+                lua_setfield(lua, -2, "__index");
+                lua_pushcfunction(lua, NewIndex);
+                lua_setfield(lua, -2, "__newindex");
+                lua_pushcfunction(lua, Length);
+                lua_setfield(lua, -2, "__len");
+                lua_pushcfunction(lua, Collect);
+                lua_setfield(lua, -2, "__gc");
+            }
+            lua_setmetatable(lua, -2);
+
+            // Now that the array has its finalizer, we can safely raise a Lua
+            // error if there wasn't enough memory for the elements.
+            if ((udata->Data() == nullptr) && (length > 0)) {
+                (void)luaL_error(lua, "not enough memory for %d elements", (int)length);
+            }
+            return *udata;
+        }
+
+        // This is the function Lua scripts call to make a new array.
+        static int New(lua_State* lua) {
+            const auto length = luaL_checkinteger(lua, 1);
+            luaL_argcheck(lua, length >= 0, 1, "negative length");
+            luaL_argcheck(lua, (lua_Unsigned)length <= Array::MAX_LENGTH, 1, "length too large");
+            (void)Push(lua, (size_t)length);
+            return 1;
+        }
+    };
+
+    // Make a table with functions scripts can use to make numeric arrays,
+    // and store it in a global variable named `arrays`.
+    void RegisterArrays(lua_State* lua) {
+        const luaL_Reg functions[] = {
+            {"doubles", NumericArrayBinding< DoubleElements >::New},
+            {"integers", NumericArrayBinding< IntegerElements >::New},
+            {NULL, NULL},
+        };
+        luaL_newlib(lua, functions);
+        lua_setglobal(lua, "arrays");
+    }
+
+    void WithLua(lua_State* lua, const char* chunk, int nargs) {
+        // Load (compile) Lua script.
+        (void)luaL_loadstring(lua, chunk);
+
+        // Insert the chunk below the arguments being passed to it.
+        lua_insert(lua, -nargs - 1);
+
+        // Call the chunk to execute it.
+        (void)lua_call(lua, nargs, 0);
+    }
+
+    void CompareWithTables(lua_State* lua) {
+        // Make an array of samples in C++, and a Lua table with the same
+        // samples, and pass both to a script which adds them up and computes
+        // a dot product both ways.
+        const size_t numSamples = 4000000;
+        auto& samples = NumericArrayBinding< DoubleElements >::Push(lua, numSamples);
+        lua_createtable(lua, (int)numSamples, 0);
+        for (size_t i = 0; i < numSamples; ++i) {
+            samples.Data()[i] = (double)(i % 1000) * 0.001;
+            lua_pushnumber(lua, samples.Data()[i]);
+            lua_rawseti(lua, -2, (lua_Integer)(i + 1));
+        }
+        WithLua(lua, R"lua(
+            local samples, samplesTable = ...
+            local clock = os.clock
+            local function measure(what, f)
+                local start = clock()
+                local result = f()
+                print(string.format(
+                    "%-28s %10.3f ms (result: %.6g)",
+                    what, (clock() - start) * 1000, result
+                ))
+            end
+
+            measure("Sum, Lua loop over table:", function()
+                local sum = 0
+                for i = 1, #samplesTable do
+                    sum = sum + samplesTable[i]
+                end
+                return sum
+            end)
+            measure("Sum, array method:", function()
+                return samples:sum()
+            end)
+            measure("Dot, Lua loop over table:", function()
+                local sum = 0
+                for i = 1, #samplesTable do
+                    local v = samplesTable[i]
+                    sum = sum + v * v
+                end
+                return sum
+            end)
+            measure("Dot, array method:", function()
+                return samples:dot(samples)
+            end)
+            measure("Max, Lua loop over table:", function()
+                local best = samplesTable[1]
+                for i = 2, #samplesTable do
+                    local v = samplesTable[i]
+                    if v > best then
+                        best = v
+                    end
+                end
+                return best
+            end)
+            measure("Max, array method:", function()
+                return samples:max()
+            end)
+        )lua", 2);
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Create the Lua instance.
+    const auto lua = luaL_newstate();
+
+    // Load standard Lua libraries.
+    //
+    // Temporarily disable the garbage collector as we load the
+    // libraries, to improve performance
+    // (http://lua-users.org/lists/lua-l/2008-07/msg00690.html).
+    lua_gc(lua, LUA_GCSTOP, 0);
+    luaL_openlibs(lua);
+    lua_gc(lua, LUA_GCRESTART, 0);
+
+    // Give scripts the ability to make numeric arrays.
+    RegisterArrays(lua);
+
+    // Have a script make a couple of small arrays and use them.
+    WithLua(lua, R"lua(
+        local x = arrays.doubles(5)
+        local y = arrays.doubles(5)
+        for i = 1, #x do
+            x[i] = i
+            y[i] = 10 * i
+        end
+        y:axpy(2, x)
+        print("y = 2 * x + y: " .. y[1] .. ", " .. y[2] .. ", ... " .. y[#y])
+        print("sum(y) = " .. y:sum() .. ", min(y) = " .. y:min() .. ", max(y) = " .. y:max())
+        print("x . y = " .. x:dot(y))
+        local n = arrays.integers(3)
+        n[1], n[2], n[3] = 7, -2, 5
+        print("3 * sum(n) = " .. n:scale(3):sum())
+        print("Out of range: " .. select(2, pcall(function() return x[6] end)))
+    )lua", 0);
+
+    // Compare the bulk operations against doing the same work in Lua.
+    CompareWithTables(lua);
+
+    // Destroy the Lua instance.
+    lua_close(lua);
+
+    // All done!
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,280 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // This is a sampling profiler for Lua scripts.
+    //
+    // While the profiler is running, a timer thread raises a flag at a
+    // regular interval.  Lua calls a "count hook" of ours every so many
+    // virtual machine instructions, and the hook does nothing more than check
+    // the flag, unless it's raised, in which case it lowers the flag and
+    // takes a sample: a record of which line of which function of which chunk
+    // was running, and which functions called it.  Functions which take the
+    // most time show up in the most samples.
+    //
+    // When the profiler isn't running, the hook isn't installed at all, so
+    // scripts run exactly as fast as they would without a profiler.
+    //
+    // The samples are written out in the "collapsed stack" format used by
+    // flame graph tools (https://github.com/brendangregg/FlameGraph):
+    // one line per distinct call stack, listing the functions from outermost
+    // to innermost separated by semicolons, then a space and the number of
+    // samples with that call stack.
+    //
+    // The profiler keeps a pointer to itself in the "extra space" Lua
+    // reserves in each Lua thread for the program to use, so the hook can
+    // find it quickly.
+    class Profiler {
+    public:
+        // This is the maximum number of stack frames recorded in a sample.
+        static constexpr int MAX_FRAMES = 64;
+
+        explicit Profiler(lua_State* lua)
+            : lua_(lua)
+        {
+            *(Profiler**)lua_getextraspace(lua) = this;
+        }
+
+        ~Profiler() {
+            Stop();
+            *(Profiler**)lua_getextraspace(lua_) = nullptr;
+        }
+
+        Profiler(const Profiler&) = delete;
+        Profiler& operator=(const Profiler&) = delete;
+
+        // Begin taking samples, once every `interval`, checking whether a
+        // sample is due once every `instructionsPerCheck` Lua instructions.
+        void Start(
+            std::chrono::microseconds interval,
+            int instructionsPerCheck = 1000
+        ) {
+            Stop();
+            stopping_ = false;
+            sampleDue_ = false;
+            lua_sethook(lua_, Hook, LUA_MASKCOUNT, instructionsPerCheck);
+            timer_ = std::thread([this, interval]{
+                std::unique_lock< std::mutex > lock(mutex_);
+                while (!stopping_) {
+                    (void)wakeTimer_.wait_for(lock, interval);
+                    sampleDue_ = true;
+                }
+            });
+        }
+
+        // Stop taking samples.  Samples already taken are kept.
+        void Stop() {
+            if (!timer_.joinable()) {
+                return;
+            }
+            lua_sethook(lua_, NULL, 0, 0);
+            {
+                std::lock_guard< std::mutex > lock(mutex_);
+                stopping_ = true;
+                wakeTimer_.notify_one();
+            }
+            timer_.join();
+        }
+
+        size_t Samples() const {
+            return samples_;
+        }
+
+        void WriteCollapsedStacks(FILE* file) const {
+            for (const auto& stack: stacks_) {
+                (void)fprintf(file, "%s %zu\n", stack.first.c_str(), stack.second);
+            }
+        }
+
+    private:
+        static void Hook(lua_State* lua, lua_Debug* ar) {
+            const auto self = *(Profiler**)lua_getextraspace(lua);
+            if (
+                (self != nullptr)
+                && self->sampleDue_.exchange(false, std::memory_order_relaxed)
+            ) {
+                self->TakeSample(lua);
+            }
+        }
+
+        void TakeSample(lua_State* lua) {
+            // Describe each function on the call stack, innermost first.
+            frames_.clear();
+            lua_Debug ar;
+            for (int level = 0; level < MAX_FRAMES; ++level) {
+                if (lua_getstack(lua, level, &ar) == 0) {
+                    break;
+                }
+                (void)lua_getinfo(lua, "Sln", &ar);
+                char frame[LUA_IDSIZE + 64];
+                if (ar.currentline > 0) {
+                    if (ar.name == NULL) {
+                        (void)snprintf(frame, sizeof(frame), "%s:%d", ar.short_src, ar.currentline);
+                    } else {
+                        (void)snprintf(
+                            frame,
+                            sizeof(frame),
+                            "%s:%d (%s)",
+                            ar.short_src,
+                            ar.currentline,
+                            ar.name
+                        );
+                    }
+                } else {
+                    (void)snprintf(
+                        frame,
+                        sizeof(frame),
+                        "[%s] %s",
+                        ar.what,
+                        ((ar.name == NULL) ? "?" : ar.name)
+                    );
+                }
+
+                // Semicolons separate frames in the output, so don't let
+                // them appear in frame descriptions.
+                for (auto c = frame; *c != '\0'; ++c) {
+                    if (*c == ';') {
+                        *c = ',';
+                    }
+                }
+                frames_.push_back(frame);
+            }
+
+            // Count the sample under the call stack, outermost first.
+            stack_.clear();
+            for (auto frame = frames_.rbegin(); frame != frames_.rend(); ++frame) {
+                if (!stack_.empty()) {
+                    stack_ += ';';
+                }
+                stack_ += *frame;
+            }
+            ++stacks_[stack_];
+            ++samples_;
+        }
+
+        lua_State* lua_;
+        std::thread timer_;
+        std::mutex mutex_;
+        std::condition_variable wakeTimer_;
+        bool stopping_ = false;
+        std::atomic< bool > sampleDue_{false};
+        std::vector< std::string > frames_;
+        std::string stack_;
+        std::map< std::string, size_t > stacks_;
+        size_t samples_ = 0;
+    };
+
+    const char* const WORKLOAD_SCRIPT = R"lua(
+        local function fib(n)
+            if n < 2 then
+                return n
+            end
+            return fib(n - 1) + fib(n - 2)
+        end
+
+        local function build(n)
+            local parts = {}
+            for i = 1, n do
+                parts[#parts + 1] = tostring(i)
+            end
+            return table.concat(parts, ",")
+        end
+
+        local total = 0
+        for i = 1, 3 do
+            total = total + fib(25) + #build(100000)
+        end
+        return total
+    )lua";
+
+    // Run the workload script a few times, returning how long the fastest
+    // run took, in milliseconds.
+    double RunWorkload(lua_State* lua) {
+        double fastest = 0.0;
+        for (int i = 0; i < 5; ++i) {
+            const auto start = std::chrono::steady_clock::now();
+            (void)luaL_loadbuffer(lua, WORKLOAD_SCRIPT, strlen(WORKLOAD_SCRIPT), "=example");
+            lua_call(lua, 0, 0);
+            const auto end = std::chrono::steady_clock::now();
+            const auto milliseconds = std::chrono::duration< double, std::milli >(end - start).count();
+            if ((i == 0) || (milliseconds < fastest)) {
+                fastest = milliseconds;
+            }
+        }
+        return fastest;
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Create the Lua instance.
+    const auto lua = luaL_newstate();
+
+    // Load standard Lua libraries.
+    //
+    // Temporarily disable the garbage collector as we load the
+    // libraries, to improve performance
+    // (http://lua-users.org/lists/lua-l/2008-07/msg00690.html).
+    lua_gc(lua, LUA_GCSTOP, 0);
+    luaL_openlibs(lua);
+    lua_gc(lua, LUA_GCRESTART, 0);
+
+    // Run the workload once without profiling, and again while taking
+    // a sample every millisecond, to see how much the profiler slows it down.
+    //
+    // The profiler must be destroyed before the Lua instance, so keep it
+    // in its own scope.
+    {
+        Profiler profiler(lua);
+        const auto unprofiledMilliseconds = RunWorkload(lua);
+        profiler.Start(std::chrono::milliseconds(1));
+        const auto profiledMilliseconds = RunWorkload(lua);
+        profiler.Stop();
+        (void)printf(
+            "Without profiler: %.1f ms\n"
+            "With profiler:    %.1f ms (%zu samples, %+.1f%%)\n",
+            unprofiledMilliseconds,
+            profiledMilliseconds,
+            profiler.Samples(),
+            (profiledMilliseconds / unprofiledMilliseconds - 1.0) * 100.0
+        );
+
+        // Write out the samples, either to the file named on the command line,
+        // or to the standard output.
+        if (argc > 1) {
+            const auto file = fopen(argv[1], "w");
+            if (file == NULL) {
+                (void)fprintf(stderr, "Unable to open '%s' for writing\n", argv[1]);
+            } else {
+                profiler.WriteCollapsedStacks(file);
+                (void)fclose(file);
+                (void)printf("Collapsed stacks written to '%s'.\n", argv[1]);
+            }
+        } else {
+            profiler.WriteCollapsedStacks(stdout);
+        }
+    }
+
+    // Destroy the Lua instance.
+    lua_close(lua);
+
+    // All done!
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,574 @@
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <errno.h>
+#include <memory>
+#include <queue>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+namespace {
+
+    // This is a cooperative scheduler which runs many Lua scripts at once
+    // on a single operating system thread.
+    //
+    // Each script runs in its own Lua thread (a coroutine).  When a script
+    // needs to wait, either for time to pass or for a file descriptor to
+    // become readable or writable, the C function it called yields the
+    // coroutine back to the scheduler instead of blocking.  The scheduler
+    // keeps a single event loop, built on epoll, which resumes each script
+    // once the thing it's waiting for has happened.  A waiting script costs
+    // only the memory of its Lua thread, so tens of thousands of them can be
+    // in flight at once.
+    //
+    // Scripts get a global `scheduler` table with these functions:
+    //
+    //   scheduler.sleep(seconds)   -- wait for the given time to pass
+    //   scheduler.read(fd)         -- read some bytes; nil at end of file
+    //   scheduler.write(fd, data)  -- write all of the given bytes
+    //   scheduler.close(fd)        -- close a file descriptor
+    //   scheduler.now()            -- seconds on a monotonic clock
+    //
+    // File descriptors given to scripts must be in non-blocking mode.
+    class Scheduler {
+    public:
+        explicit Scheduler(lua_State* lua)
+            : lua_(lua)
+            , epoll_(epoll_create1(EPOLL_CLOEXEC))
+        {
+            // The extra space of each Lua thread we create holds a pointer
+            // to the task it runs.  Lua copies the main thread's extra space
+            // into each new thread, including coroutines made by scripts, so
+            // clearing it here lets us tell tasks apart from other coroutines.
+            *(Task**)lua_getextraspace(lua) = nullptr;
+
+            static const luaL_Reg functions[] = {
+                {"sleep", Sleep},
+                {"read", Read},
+                {"write", Write},
+                {"close", Close},
+                {"now", Now},
+                {NULL, NULL}
+            };
+            luaL_newlib(lua, functions);
+            lua_setglobal(lua, "scheduler");
+        }
+
+        ~Scheduler() {
+            for (const auto& task: tasks_) {
+                luaL_unref(lua_, LUA_REGISTRYINDEX, task->ref);
+            }
+            (void)close(epoll_);
+        }
+
+        Scheduler(const Scheduler&) = delete;
+        Scheduler& operator=(const Scheduler&) = delete;
+
+        // Start a new task.  Like `lua_call`, this pops the function to run
+        // and `nargs` arguments to pass to it from the top of the stack.
+        // The task doesn't actually run until `Run` is called.
+        void Spawn(int nargs) {
+            std::unique_ptr< Task > task(new Task());
+            task->thread = lua_newthread(lua_);
+            *(Task**)lua_getextraspace(task->thread) = task.get();
+            lua_insert(lua_, -(nargs + 2));
+            lua_xmove(lua_, task->thread, nargs + 1);
+            task->ref = luaL_ref(lua_, LUA_REGISTRYINDEX);
+            task->scheduler = this;
+            task->nargs = nargs;
+            task->index = tasks_.size();
+            ready_.push_back(task.get());
+            tasks_.push_back(std::move(task));
+        }
+
+        // Run tasks until they have all finished, or until none of them can
+        // make progress because they're all waiting on file descriptors
+        // which will never become ready.
+        void Run() {
+            std::vector< epoll_event > events(256);
+            while (!tasks_.empty()) {
+                // Resume each task which is ready.  Tasks made ready while
+                // doing this wait for the next pass, so that a task which
+                // keeps yielding can't starve the others.
+                for (auto n = ready_.size(); n > 0; --n) {
+                    const auto task = ready_.front();
+                    ready_.pop_front();
+                    Resume(task);
+                }
+
+                // Wake tasks whose timers have expired.
+                const auto now = Clock::now();
+                while (!timers_.empty() && (timers_.top().deadline <= now)) {
+                    const auto task = timers_.top().task;
+                    timers_.pop();
+                    task->waiting = false;
+                    ready_.push_back(task);
+                }
+
+                // Wait for file descriptors to become ready, but only as
+                // long as it is until the next timer expires, and not at all
+                // if some tasks are already ready.
+                int timeout = -1;
+                if (!ready_.empty()) {
+                    timeout = 0;
+                } else if (!timers_.empty()) {
+                    const auto wait = std::chrono::duration_cast< std::chrono::microseconds >(
+                        timers_.top().deadline - now
+                    ).count();
+                    timeout = (int)((wait + 999) / 1000);
+                } else if (tasks_.empty()) {
+                    break;
+                } else if (ioWaiters_ == 0) {
+                    (void)printf("%zu task(s) can never be resumed\n", tasks_.size());
+                    break;
+                }
+                const auto numEvents = epoll_wait(epoll_, events.data(), (int)events.size(), timeout);
+                for (int i = 0; i < numEvents; ++i) {
+                    const auto watch = watches_.find(events[i].data.fd);
+                    if (watch == watches_.end()) {
+                        continue;
+                    }
+                    const auto flags = events[i].events;
+                    if (flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                        Wake(watch->second.reader);
+                    }
+                    if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                        Wake(watch->second.writer);
+                    }
+                }
+            }
+        }
+
+        // Return how many times tasks have been resumed.
+        size_t Resumes() const {
+            return resumes_;
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        // This holds what the scheduler knows about one running script.
+        struct Task {
+            Scheduler* scheduler = nullptr;
+            lua_State* thread = nullptr;
+            int ref = LUA_NOREF;
+            int nargs = 0;
+            size_t index = 0;
+            bool waiting = false;
+        };
+
+        // This is a task waiting for time to pass.  The sequence number
+        // keeps tasks with the same deadline in the order they went to sleep.
+        struct Timer {
+            Clock::time_point deadline;
+            uint64_t sequence;
+            Task* task;
+
+            bool operator>(const Timer& other) const {
+                if (deadline != other.deadline) {
+                    return deadline > other.deadline;
+                }
+                return sequence > other.sequence;
+            }
+        };
+
+        // These are the tasks waiting on one file descriptor.
+        struct Watch {
+            Task* reader = nullptr;
+            Task* writer = nullptr;
+        };
+
+        static Task* GetTask(lua_State* lua) {
+            const auto task = *(Task**)lua_getextraspace(lua);
+            if (task == nullptr) {
+                (void)luaL_error(lua, "scheduler functions may only be called by a task itself, not a coroutine it made");
+            }
+            return task;
+        }
+
+        void Resume(Task* task) {
+            const auto nargs = task->nargs;
+            task->nargs = 0;
+            ++resumes_;
+            const auto status = lua_resume(task->thread, lua_, nargs);
+            if (status == LUA_YIELD) {
+                // A task yielding on its own, rather than from one of our
+                // functions, simply lets other tasks have a turn.
+                if (!task->waiting) {
+                    lua_settop(task->thread, 0);
+                    ready_.push_back(task);
+                }
+                return;
+            }
+            if (status != LUA_OK) {
+                (void)printf("Task failed: %s\n", lua_tostring(task->thread, -1));
+            }
+            Finish(task);
+        }
+
+        void Finish(Task* task) {
+            luaL_unref(lua_, LUA_REGISTRYINDEX, task->ref);
+            const auto index = task->index;
+            if (index + 1 < tasks_.size()) {
+                std::swap(tasks_[index], tasks_.back());
+                tasks_[index]->index = index;
+            }
+            tasks_.pop_back();
+        }
+
+        void Wake(Task*& task) {
+            if (task == nullptr) {
+                return;
+            }
+            task->waiting = false;
+            ready_.push_back(task);
+            task = nullptr;
+            --ioWaiters_;
+        }
+
+        void WaitForTimer(Task* task, Clock::duration delay) {
+            task->waiting = true;
+            timers_.push({Clock::now() + delay, nextTimerSequence_++, task});
+        }
+
+        // Arrange for the task to be resumed once the file descriptor is
+        // readable (or writable).  The descriptor is registered with epoll
+        // just once, edge-triggered, the first time any task waits on it.
+        // This is safe because tasks only wait after a read or write on the
+        // descriptor fails with EAGAIN, which guarantees another edge.
+        void WaitForFd(lua_State* lua, Task* task, int fd, bool write) {
+            auto watch = watches_.find(fd);
+            if (watch == watches_.end()) {
+                epoll_event event;
+                event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                event.data.fd = fd;
+                if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event) != 0) {
+                    (void)luaL_error(lua, "unable to watch file descriptor %d: %s", fd, strerror(errno));
+                }
+                watch = watches_.insert({fd, Watch()}).first;
+            }
+            auto& waiter = (write ? watch->second.writer : watch->second.reader);
+            if (waiter != nullptr) {
+                (void)luaL_error(lua, "another task is already waiting on file descriptor %d", fd);
+            }
+            waiter = task;
+            task->waiting = true;
+            ++ioWaiters_;
+        }
+
+        static int Sleep(lua_State* lua) {
+            const auto seconds = luaL_checknumber(lua, 1);
+            const auto task = GetTask(lua);
+            task->scheduler->WaitForTimer(
+                task,
+                std::chrono::duration_cast< Clock::duration >(
+                    std::chrono::duration< double >(seconds)
+                )
+            );
+            return lua_yield(lua, 0);
+        }
+
+        static int Read(lua_State* lua) {
+            const auto fd = (int)luaL_checkinteger(lua, 1);
+            return ReadContinue(lua, LUA_OK, (lua_KContext)fd);
+        }
+
+        static int ReadContinue(lua_State* lua, int status, lua_KContext context) {
+            const auto fd = (int)context;
+            char buffer[4096];
+            for (;;) {
+                const auto amount = read(fd, buffer, sizeof(buffer));
+                if (amount > 0) {
+                    lua_pushlstring(lua, buffer, (size_t)amount);
+                    return 1;
+                } else if (amount == 0) {
+                    lua_pushnil(lua);
+                    return 1;
+                } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                    const auto task = GetTask(lua);
+                    task->scheduler->WaitForFd(lua, task, fd, false);
+                    return lua_yieldk(lua, 0, context, ReadContinue);
+                } else if (errno != EINTR) {
+                    return luaL_error(lua, "read failed: %s", strerror(errno));
+                }
+            }
+        }
+
+        // Writing keeps the bytes to write at stack index 2 and the number
+        // of bytes written so far at stack index 3, since the stack is
+        // preserved while the task is suspended.
+        static int Write(lua_State* lua) {
+            const auto fd = (int)luaL_checkinteger(lua, 1);
+            (void)luaL_checkstring(lua, 2);
+            lua_settop(lua, 2);
+            lua_pushinteger(lua, 0);
+            return WriteContinue(lua, LUA_OK, (lua_KContext)fd);
+        }
+
+        static int WriteContinue(lua_State* lua, int status, lua_KContext context) {
+            const auto fd = (int)context;
+            size_t length;
+            const auto data = lua_tolstring(lua, 2, &length);
+            auto written = (size_t)lua_tointeger(lua, 3);
+            while (written < length) {
+                const auto amount = write(fd, data + written, length - written);
+                if (amount >= 0) {
+                    written += (size_t)amount;
+                } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                    lua_pushinteger(lua, (lua_Integer)written);
+                    lua_replace(lua, 3);
+                    const auto task = GetTask(lua);
+                    task->scheduler->WaitForFd(lua, task, fd, true);
+                    return lua_yieldk(lua, 0, context, WriteContinue);
+                } else if (errno != EINTR) {
+                    return luaL_error(lua, "write failed: %s", strerror(errno));
+                }
+            }
+            return 0;
+        }
+
+        static int Close(lua_State* lua) {
+            const auto fd = (int)luaL_checkinteger(lua, 1);
+            const auto task = GetTask(lua);
+            auto& watches = task->scheduler->watches_;
+            const auto watch = watches.find(fd);
+            if (watch != watches.end()) {
+                if (
+                    (watch->second.reader != nullptr)
+                    || (watch->second.writer != nullptr)
+                ) {
+                    return luaL_error(lua, "another task is waiting on file descriptor %d", fd);
+                }
+                watches.erase(watch);
+            }
+            (void)close(fd);
+            return 0;
+        }
+
+        static int Now(lua_State* lua) {
+            lua_pushnumber(
+                lua,
+                std::chrono::duration< double >(Clock::now().time_since_epoch()).count()
+            );
+            return 1;
+        }
+
+        lua_State* lua_;
+        int epoll_;
+        std::vector< std::unique_ptr< Task > > tasks_;
+        std::deque< Task* > ready_;
+        std::priority_queue< Timer, std::vector< Timer >, std::greater< Timer > > timers_;
+        uint64_t nextTimerSequence_ = 0;
+        std::unordered_map< int, Watch > watches_;
+        size_t ioWaiters_ = 0;
+        size_t resumes_ = 0;
+    };
+
+    // Return the current value of the monotonic clock, in seconds.
+    double Now() {
+        return std::chrono::duration< double >(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count();
+    }
+
+    // Allow the program to have as many file descriptors open as the
+    // operating system will let it, and return that limit.
+    rlim_t RaiseFileDescriptorLimit() {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            return 1024;
+        }
+        limit.rlim_cur = limit.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &limit);
+        (void)getrlimit(RLIMIT_NOFILE, &limit);
+        return limit.rlim_cur;
+    }
+
+    // Run a few scripts which take turns, to show the scheduler interleaving
+    // them.
+    void DemonstrateScheduling(lua_State* lua) {
+        const char* const script = R"lua(
+            local name, delay = ...
+            for i = 1, 3 do
+                scheduler.sleep(delay)
+                print(name .. " woke up (" .. i .. ")")
+            end
+        )lua";
+        Scheduler scheduler(lua);
+        const struct {
+            const char* name;
+            double delay;
+        } tasks[] = {
+            {"tortoise", 0.03},
+            {"hare", 0.01},
+            {"snail", 0.05},
+        };
+        for (const auto& task: tasks) {
+            (void)luaL_loadstring(lua, script);
+            lua_pushstring(lua, task.name);
+            lua_pushnumber(lua, task.delay);
+            scheduler.Spawn(2);
+        }
+        scheduler.Run();
+    }
+
+    // Run a large number of scripts at once, each of which sleeps a few
+    // times, to measure how much memory each waiting script needs and how
+    // quickly the scheduler can switch between them.
+    void MeasureManyTasks(lua_State* lua, int numTasks) {
+        const char* const script = R"lua(
+            local sleep, n = scheduler.sleep, ...
+            for i = 1, 5 do
+                sleep(0.001 * (n % 10))
+            end
+        )lua";
+        Scheduler scheduler(lua);
+        (void)luaL_loadstring(lua, script);
+        lua_gc(lua, LUA_GCCOLLECT, 0);
+        const auto kilobytesBefore = lua_gc(lua, LUA_GCCOUNT, 0);
+        const auto start = Now();
+        for (int i = 0; i < numTasks; ++i) {
+            lua_pushvalue(lua, -1);
+            lua_pushinteger(lua, i);
+            scheduler.Spawn(1);
+        }
+        const auto kilobytesAfter = lua_gc(lua, LUA_GCCOUNT, 0);
+        scheduler.Run();
+        const auto seconds = Now() - start;
+        lua_pop(lua, 1);
+        (void)printf(
+            "%d tasks: %.2f KB each, %zu resumes in %.3f s (%.0f resumes/s)\n",
+            numTasks,
+            (double)(kilobytesAfter - kilobytesBefore) / numTasks,
+            scheduler.Resumes(),
+            seconds,
+            scheduler.Resumes() / seconds
+        );
+    }
+
+    // This is a Lua function for scripts to report a measurement.  Its
+    // upvalue points to the vector where measurements are collected.
+    int Report(lua_State* lua) {
+        const auto measurements = (std::vector< double >*)lua_touserdata(lua, lua_upvalueindex(1));
+        measurements->push_back(luaL_checknumber(lua, 1));
+        return 0;
+    }
+
+    // Connect pairs of scripts with local sockets, and have one of each pair
+    // send messages which the other echoes back, to measure the round trip
+    // latency and the total number of messages exchanged per second.
+    void MeasureEcho(lua_State* lua, int numPairs, int roundTrips) {
+        const char* const serverScript = R"lua(
+            local read, write, fd = scheduler.read, scheduler.write, ...
+            while true do
+                local message = read(fd)
+                if not message then
+                    break
+                end
+                write(fd, message)
+            end
+            scheduler.close(fd)
+        )lua";
+        const char* const clientScript = R"lua(
+            local read, write, now = scheduler.read, scheduler.write, scheduler.now
+            local fd, roundTrips = ...
+            for i = 1, roundTrips do
+                local start = now()
+                write(fd, "ping")
+                read(fd)
+                report(now() - start)
+            end
+            scheduler.close(fd)
+        )lua";
+        std::vector< double > latencies;
+        latencies.reserve((size_t)numPairs * roundTrips);
+        lua_pushlightuserdata(lua, &latencies);
+        lua_pushcclosure(lua, Report, 1);
+        lua_setglobal(lua, "report");
+        Scheduler scheduler(lua);
+        (void)luaL_loadstring(lua, serverScript);
+        (void)luaL_loadstring(lua, clientScript);
+        for (int i = 0; i < numPairs; ++i) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) != 0) {
+                (void)printf("socketpair failed: %s\n", strerror(errno));
+                break;
+            }
+            lua_pushvalue(lua, -2);
+            lua_pushinteger(lua, fds[0]);
+            scheduler.Spawn(1);
+            lua_pushvalue(lua, -1);
+            lua_pushinteger(lua, fds[1]);
+            lua_pushinteger(lua, roundTrips);
+            scheduler.Spawn(2);
+        }
+        lua_pop(lua, 2);
+        const auto start = Now();
+        scheduler.Run();
+        const auto seconds = Now() - start;
+        if (latencies.empty()) {
+            return;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        const auto percentile = [&latencies](double p) {
+            return latencies[(size_t)(p * (latencies.size() - 1))] * 1e6;
+        };
+        (void)printf(
+            "%5d pairs: %8.0f round trips/s, latency p50 %6.1f us, p99 %7.1f us\n",
+            numPairs,
+            latencies.size() / seconds,
+            percentile(0.50),
+            percentile(0.99)
+        );
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    // Create the Lua instance.
+    const auto lua = luaL_newstate();
+
+    // Load standard Lua libraries.
+    //
+    // Temporarily disable the garbage collector as we load the
+    // libraries, to improve performance
+    // (http://lua-users.org/lists/lua-l/2008-07/msg00690.html).
+    lua_gc(lua, LUA_GCSTOP, 0);
+    luaL_openlibs(lua);
+    lua_gc(lua, LUA_GCRESTART, 0);
+
+    // Show a few scripts taking turns.
+    DemonstrateScheduling(lua);
+
+    // Show many scripts waiting at once.
+    MeasureManyTasks(lua, 10000);
+    MeasureManyTasks(lua, 50000);
+
+    // Measure exchanging messages between scripts over local sockets.
+    // Each pair of scripts needs two file descriptors.
+    const auto maxPairs = (int)std::min< rlim_t >(10000, (RaiseFileDescriptorLimit() - 16) / 2);
+    MeasureEcho(lua, 1, 20000);
+    MeasureEcho(lua, 100, 200);
+    MeasureEcho(lua, maxPairs, 5);
+
+    // Destroy the Lua instance.
+    lua_close(lua);
+
+    // All done!
+    return EXIT_SUCCESS;
+}
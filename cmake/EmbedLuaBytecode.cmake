@@ -0,0 +1,34 @@
+# EmbedLuaBytecode.cmake
+#
+# © 2020 by Richard Walters
+#
+# This script is run by the `embed_lua_scripts` function at build time,
+# to turn Lua bytecode files into a C++ source file defining the
+# `EMBEDDED_LUA_SCRIPTS` array declared in "EmbeddedLuaScripts.h".
+#
+# It expects these variables to be defined:
+#   NAMES -- list of script names
+#   PATHS -- list of script source file paths
+#   BYTECODES -- list of bytecode file paths
+#   OUTPUT -- path of the C++ source file to generate
+
+set(Content "// Generated by EmbedLuaBytecode.cmake; do not edit.\n\n#include \"EmbeddedLuaScripts.h\"\n\nnamespace {\n")
+set(Entries "")
+list(LENGTH NAMES NumScripts)
+math(EXPR LastScript "${NumScripts} - 1")
+foreach(Index RANGE ${LastScript})
+    list(GET NAMES ${Index} Name)
+    list(GET PATHS ${Index} Path)
+    list(GET BYTECODES ${Index} Bytecode)
+    file(READ ${Bytecode} Hex HEX)
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," Bytes "${Hex}")
+    string(REGEX REPLACE "(0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,)" "\\1\n        " Bytes "${Bytes}")
+    string(APPEND Content "\n    const unsigned char bytecode${Index}[] = {\n        ${Bytes}\n    };\n")
+    string(APPEND Entries "    {\"${Name}\", \"${Path}\", bytecode${Index}, sizeof(bytecode${Index})},\n")
+endforeach()
+string(APPEND Content "\n}\n\nconst EmbeddedLuaScript EMBEDDED_LUA_SCRIPTS[] = {\n${Entries}};\n\nconst size_t NUM_EMBEDDED_LUA_SCRIPTS = ${NumScripts};\n")
+
+# Only replace the output if it changed, to avoid needless recompiling.
+file(WRITE ${OUTPUT}.tmp "${Content}")
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different ${OUTPUT}.tmp ${OUTPUT})
+file(REMOVE ${OUTPUT}.tmp)
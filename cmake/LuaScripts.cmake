@@ -0,0 +1,58 @@
+# LuaScripts.cmake
+#
+# © 2020 by Richard Walters
+
+set(LUA_SCRIPTS_CMAKE_DIRECTORY ${CMAKE_CURRENT_LIST_DIR})
+
+# Compile the given Lua scripts into bytecode at build time, using the Lua
+# compiler, and embed the bytecode in the given target.
+#
+# The target can include the generated "EmbeddedLuaScripts.h" header to get
+# the list of embedded scripts.  Each script is named after its file name,
+# without the extension.  Debug information is stripped from the bytecode,
+# so error messages from embedded scripts don't include line numbers.
+#
+# Lua bytecode depends on the sizes of the types Lua uses, so the Lua
+# compiler which produces it must be built for the same kind of machine as
+# the target, which means this doesn't work when cross-compiling.
+function(embed_lua_scripts Target)
+    set(GeneratedDirectory ${CMAKE_CURRENT_BINARY_DIR}/EmbeddedLuaScripts)
+    set(Names)
+    set(Paths)
+    set(Bytecodes)
+    foreach(Script ${ARGN})
+        get_filename_component(Path ${Script} ABSOLUTE)
+        get_filename_component(Name ${Script} NAME_WE)
+        set(Bytecode ${GeneratedDirectory}/${Name}.luac)
+        add_custom_command(
+            OUTPUT ${Bytecode}
+            COMMAND LuaCompiler -s -o ${Bytecode} ${Path}
+            DEPENDS LuaCompiler ${Path}
+            COMMENT "Compiling Lua script ${Name}"
+            VERBATIM
+        )
+        list(APPEND Names ${Name})
+        list(APPEND Paths ${Path})
+        list(APPEND Bytecodes ${Bytecode})
+    endforeach()
+    set(Source ${GeneratedDirectory}/EmbeddedLuaScripts.cpp)
+    add_custom_command(
+        OUTPUT ${Source}
+        COMMAND ${CMAKE_COMMAND}
+            "-DNAMES=${Names}"
+            "-DPATHS=${Paths}"
+            "-DBYTECODES=${Bytecodes}"
+            "-DOUTPUT=${Source}"
+            -P ${LUA_SCRIPTS_CMAKE_DIRECTORY}/EmbedLuaBytecode.cmake
+        DEPENDS ${Bytecodes} ${LUA_SCRIPTS_CMAKE_DIRECTORY}/EmbedLuaBytecode.cmake
+        COMMENT "Embedding Lua bytecode in ${Target}"
+        VERBATIM
+    )
+    configure_file(
+        ${LUA_SCRIPTS_CMAKE_DIRECTORY}/EmbeddedLuaScripts.h.in
+        ${GeneratedDirectory}/EmbeddedLuaScripts.h
+        COPYONLY
+    )
+    target_sources(${Target} PRIVATE ${Source})
+    target_include_directories(${Target} PRIVATE ${GeneratedDirectory})
+endfunction(embed_lua_scripts)